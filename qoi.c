@@ -6,9 +6,15 @@
 #define QOI_OP_RGB    0xfe /* 11111110 */
 #define QOI_OP_RGBA   0xff /* 11111111 */
 
+//with QOI_FLAG_LONG_RUN followed by a varint, the run is QOI_RUN_FULL_VAL plus
+//its value
 #define QOI_OP_RUN_FULL 0xfd /* 11111101 */
 #define QOI_RUN_FULL_VAL (62)
 
+//with QOI_FLAG_RAW_BLOCKS the run of 61 is followed by a varint count of pixels
+//stored as they are, runs of 61 are written as a run of 60 and a run of 1
+#define QOI_OP_RAW    0xfc /* 11111100 */
+
 #define QOI_MASK_2    0xc0 /* 11000000 */
 
 #define QOI_COLOR_HASH(C) (C.rgba.r*3 + C.rgba.g*5 + C.rgba.b*7 + C.rgba.a*11)
@@ -19,16 +25,44 @@
 #define EXT_STR "qoi"
 
 #define QOI_PIXEL_WORST_CASE (desc->channels==4?5:4)
+#define QOI_PIXEL_WORST_CASE_OPAQUE 4
+
+#ifdef QOI_STATS
+//QOI_STATS op indexes
+enum {QOI_STAT_INDEX, QOI_STAT_DIFF, QOI_STAT_LUMA, QOI_STAT_RGB, QOI_STAT_RGBA, QOI_STAT_RUN, QOI_STAT_RUN_FULL, QOI_STAT_RAW};
+const char *const qoi_stats_op_names[QOI_STATS_OPS]={"INDEX", "DIFF", "LUMA", "RGB", "RGBA", "RUN", "RUN_FULL", "RAW"};
+#endif
+
+//a long run is carried whole until it ends, see DUMP_RUN_LONG
+#define DUMP_RUN_FULL(rrr) do{ \
+	if(!(s.flags&QOI_FLAG_LONG_RUN)){ \
+		for(;rrr>=QOI_RUN_FULL_VAL;rrr-=QOI_RUN_FULL_VAL){ \
+			s.bytes[s.b++] = QOI_OP_RUN_FULL; \
+			QOI_STAT_RUN_OP(qoi_stats_enc, QOI_RUN_FULL_VAL); \
+		} \
+	} \
+}while(0)
 
 #define DUMP_RUN(rrr) do{ \
-	for(;rrr>=QOI_RUN_FULL_VAL;rrr-=QOI_RUN_FULL_VAL) \
-		s.bytes[s.b++] = QOI_OP_RUN_FULL; \
+	QOI_STAT_RUN(qoi_stats_enc, rrr); \
+	if (rrr>=QOI_RUN_FULL_VAL) \
+		DUMP_RUN_LONG(rrr); \
 	if (rrr) { \
+		if (rrr==QOI_RUN_FULL_VAL-1 && (s.flags&QOI_FLAG_RAW_BLOCKS)) { \
+			s.bytes[s.b++] = QOI_OP_RUN | (rrr - 2); \
+			QOI_STAT_RUN_OP(qoi_stats_enc, rrr - 1); \
+			rrr = 1; \
+		} \
 		s.bytes[s.b++] = QOI_OP_RUN | (rrr - 1); \
+		QOI_STAT_RUN_OP(qoi_stats_enc, rrr); \
 		rrr = 0; \
 	} \
 }while(0)
 
+//the last pixel of a QOI_OP_RAW goes in the index on both sides, as a run of it
+//puts it there in the decoder
+#define QOI_RAW_INDEX(index, px) (index)[QOI_COLOR_HASH(px) & 63] = (px)
+
 //s.px.rgba.r = s.pixels[s.px_pos + 0];
 //s.px.rgba.g = s.pixels[s.px_pos + 1];
 //s.px.rgba.b = s.pixels[s.px_pos + 2];
@@ -53,6 +87,7 @@
 		ag < 2\
 	) {\
 		s.bytes[s.b++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);\
+		QOI_STAT_OP(qoi_stats_enc, QOI_STAT_DIFF, 1);\
 	}\
 	else if (\
 		l < 8 &&\
@@ -60,19 +95,24 @@
 	) {\
 		s.bytes[s.b++] = QOI_OP_LUMA     | (vg   + 32);\
 		s.bytes[s.b++] = (vg_r + 8) << 4 | (vg_b +  8);\
+		QOI_STAT_OP(qoi_stats_enc, QOI_STAT_LUMA, 2);\
 	}\
 	else {\
 		s.bytes[s.b++] = QOI_OP_RGB;\
 		s.bytes[s.b++] = px.rgba.r;\
 		s.bytes[s.b++] = px.rgba.g;\
 		s.bytes[s.b++] = px.rgba.b;\
+		QOI_STAT_OP(qoi_stats_enc, QOI_STAT_RGB, 4);\
 	}\
 }while(0)
 
-typedef struct{
+//bulk and finish are the kernel rows picked by qoi_kernel_select, indexed by
+//QOI_ENC_*
+typedef struct enc_state{
 	unsigned char *bytes, *pixels, *pixels_alloc;
+	struct enc_state (*const *bulk)(struct enc_state), (*const *finish)(struct enc_state);
 	qoi_rgba_t index[64];
-	unsigned int b, px_pos, run, pixel_cnt;
+	unsigned int b, px_pos, run, pixel_cnt, flags;
 } enc_state;
 
 static enc_state qoi_encode_chunk3_scalar(enc_state s){
@@ -86,8 +126,7 @@ static enc_state qoi_encode_chunk3_scalar(enc_state s){
 		while(px.v == px_prev.v) {
 			++s.run;
 			if(s.px_pos == px_end) {
-				for(;s.run>=QOI_RUN_FULL_VAL;s.run-=QOI_RUN_FULL_VAL)
-					s.bytes[s.b++] = QOI_OP_RUN_FULL;
+				DUMP_RUN_FULL(s.run);
 				s.px_pos+=3;
 				return s;
 			}
@@ -98,6 +137,7 @@ static enc_state qoi_encode_chunk3_scalar(enc_state s){
 		int index_pos = QOI_COLOR_HASH(px) & 63;
 		if(s.index[index_pos].v == px.v) {
 			s.bytes[s.b++] = QOI_OP_INDEX | index_pos;
+			QOI_STAT_OP(qoi_stats_enc, QOI_STAT_INDEX, 1);
 			px_prev = px;
 			continue;
 		}
@@ -118,8 +158,7 @@ static enc_state qoi_encode_chunk4_scalar(enc_state s){
 		while(px.v == px_prev.v) {
 			++s.run;
 			if(s.px_pos == px_end) {
-				for(;s.run>=QOI_RUN_FULL_VAL;s.run-=QOI_RUN_FULL_VAL)
-					s.bytes[s.b++] = QOI_OP_RUN_FULL;
+				DUMP_RUN_FULL(s.run);
 				s.px_pos+=4;
 				return s;
 			}
@@ -130,6 +169,7 @@ static enc_state qoi_encode_chunk4_scalar(enc_state s){
 		int index_pos = QOI_COLOR_HASH(px) & 63;
 		if(s.index[index_pos].v == px.v) {
 			s.bytes[s.b++] = QOI_OP_INDEX | index_pos;
+			QOI_STAT_OP(qoi_stats_enc, QOI_STAT_INDEX, 1);
 			px_prev = px;
 			continue;
 		}
@@ -141,6 +181,7 @@ static enc_state qoi_encode_chunk4_scalar(enc_state s){
 			s.bytes[s.b++] = px.rgba.g;
 			s.bytes[s.b++] = px.rgba.b;
 			s.bytes[s.b++] = px.rgba.a;
+			QOI_STAT_OP(qoi_stats_enc, QOI_STAT_RGBA, 5);
 			px_prev = px;
 			continue;
 		}
@@ -150,23 +191,86 @@ static enc_state qoi_encode_chunk4_scalar(enc_state s){
 	return s;
 }
 
+//size kernel for qoi_estimate_size: s.b advances by the bytes the encode
+//kernels would write, s.bytes is not touched
+static inline enc_state qoi_size_chunk_scalar(enc_state s, const unsigned int channels){
+	qoi_rgba_t px={0}, px_prev={0};
+	unsigned int px_end=s.pixel_cnt*channels;
+	const unsigned char *p=s.pixels+s.px_pos-channels;
+	px_prev.rgba.r=p[0];
+	px_prev.rgba.g=p[1];
+	px_prev.rgba.b=p[2];
+	px_prev.rgba.a=channels==4?p[3]:255;
+	px.rgba.a=255;
+	for (; s.px_pos < px_end; s.px_pos += channels) {
+		p=s.pixels+s.px_pos;
+		px.rgba.r=p[0];
+		px.rgba.g=p[1];
+		px.rgba.b=p[2];
+		if(channels==4)
+			px.rgba.a=p[3];
+		if(px.v == px_prev.v) {
+			++s.run;
+			continue;
+		}
+		SIZE_RUN(s.run);
+		int index_pos = QOI_COLOR_HASH(px) & 63;
+		if(s.index[index_pos].v == px.v) {
+			s.b++;
+			px_prev = px;
+			continue;
+		}
+		s.index[index_pos] = px;
+		if(px.rgba.a!=px_prev.rgba.a){
+			s.b+=5;
+			px_prev = px;
+			continue;
+		}
+		signed char vr = px.rgba.r - px_prev.rgba.r;
+		signed char vg = px.rgba.g - px_prev.rgba.g;
+		signed char vb = px.rgba.b - px_prev.rgba.b;
+		signed char vg_r = vr - vg;
+		signed char vg_b = vb - vg;
+		unsigned char ag = (vg<0)?(-vg)-1:vg;
+		unsigned char d = ((vr<0)?(-vr)-1:vr) | ((vb<0)?(-vb)-1:vb);
+		unsigned char l = ((vg_b<0)?(-vg_b)-1:vg_b) | ((vg_r<0)?(-vg_r)-1:vg_r);
+		s.b += ( d < 2 && ag < 2 ) ? 1 : ( l < 8 && ag < 32 ) ? 2 : 4;
+		px_prev = px;
+	}
+	return s;
+}
+
+static enc_state qoi_size_chunk3_scalar(enc_state s){
+	return qoi_size_chunk_scalar(s, 3);
+}
+
+static enc_state qoi_size_chunk4_scalar(enc_state s){
+	return qoi_size_chunk_scalar(s, 4);
+}
+
+//indexed by channels-3, there is no simd size kernel for qoi
+static enc_state (*const size_bulk[2])(enc_state)={qoi_size_chunk3_scalar, qoi_size_chunk4_scalar};
+static enc_state (*const size_finish[2])(enc_state)={qoi_size_chunk3_scalar, qoi_size_chunk4_scalar};
+
 //Optimised decode functions////////////////////////////////////////////////////
 
 typedef struct{
 	unsigned char *bytes, *pixels;
 	qoi_rgba_t px, index[64];
-	unsigned int b, b_limit, b_present, p, p_limit, px_pos, run, pixel_cnt, pixel_curr;
+	unsigned int b, b_limit, b_present, p, p_limit, px_pos, run, pixel_cnt, pixel_curr, raw, flags;
 } dec_state;
 
 #define QOI_DECODE_COMMON \
 	;int b1 = s.bytes[s.b++]; \
 	if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) { \
 		s.px = s.index[b1]; \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_INDEX, 1); \
 	} \
 	else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) { \
 		s.px.rgba.r += ((b1 >> 4) & 0x03) - 2; \
 		s.px.rgba.g += ((b1 >> 2) & 0x03) - 2; \
 		s.px.rgba.b += ( b1       & 0x03) - 2; \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_DIFF, 1); \
 	} \
 	else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) { \
 		int b2 = s.bytes[s.b++]; \
@@ -174,14 +278,23 @@ typedef struct{
 		s.px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f); \
 		s.px.rgba.g += vg; \
 		s.px.rgba.b += vg - 8 +  (b2       & 0x0f); \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_LUMA, 2); \
 	} \
 	else if (b1 == QOI_OP_RGB) { \
 		s.px.rgba.r = s.bytes[s.b++]; \
 		s.px.rgba.g = s.bytes[s.b++]; \
 		s.px.rgba.b = s.bytes[s.b++]; \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_RGB, 4); \
 	}
 
 static dec_state dec_in4out4(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(4, 4);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(4);
 	while( ((s.b+5)<s.b_present) && ((s.px_pos+4)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
@@ -192,9 +305,24 @@ static dec_state dec_in4out4(dec_state s){
 				s.px.rgba.g = s.bytes[s.b++];
 				s.px.rgba.b = s.bytes[s.b++];
 				s.px.rgba.a = s.bytes[s.b++];
+				QOI_STAT_OP(qoi_stats_dec, QOI_STAT_RGBA, 5);
+			}
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
+				QOI_DECODE_RUN_FILL(4);
+				continue;
 			}
-			else
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(4, 4);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{
 				s.run = (b1 & 0x3f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 			s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
@@ -208,6 +336,13 @@ static dec_state dec_in4out4(dec_state s){
 }
 
 static dec_state dec_in4out3(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(4, 3);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(3);
 	while( ((s.b+5)<s.b_present) && ((s.px_pos+3)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
@@ -218,9 +353,24 @@ static dec_state dec_in4out3(dec_state s){
 				s.px.rgba.g = s.bytes[s.b++];
 				s.px.rgba.b = s.bytes[s.b++];
 				s.px.rgba.a = s.bytes[s.b++];
+				QOI_STAT_OP(qoi_stats_dec, QOI_STAT_RGBA, 5);
 			}
-			else
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
+				QOI_DECODE_RUN_FILL(3);
+				continue;
+			}
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(4, 3);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{
 				s.run = (b1 & 0x3f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 			s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
@@ -233,13 +383,34 @@ static dec_state dec_in4out3(dec_state s){
 }
 
 static dec_state dec_in3out4(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(3, 4);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(4);
 	while( ((s.b+5)<s.b_present) && ((s.px_pos+4)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
 		else{
 			QOI_DECODE_COMMON
-			else
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
+				QOI_DECODE_RUN_FILL(4);
+				continue;
+			}
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(3, 4);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{
 				s.run = (b1 & 0x3f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 			s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
@@ -253,13 +424,34 @@ static dec_state dec_in3out4(dec_state s){
 }
 
 static dec_state dec_in3out3(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(3, 3);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(3);
 	while( ((s.b+5)<s.b_present) && ((s.px_pos+3)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
 		else{
 			QOI_DECODE_COMMON
-			else
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
+				QOI_DECODE_RUN_FILL(3);
+				continue;
+			}
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(3, 3);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{
 				s.run = (b1 & 0x3f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 			s.index[QOI_COLOR_HASH(s.px) & 63] = s.px;
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
@@ -271,9 +463,18 @@ static dec_state dec_in3out3(dec_state s){
 	return s;
 }
 
-//pointers to optimised functions
-static enc_state (*enc_bulk[])(enc_state)={qoi_encode_chunk3_scalar, qoi_encode_chunk4_scalar};
-static enc_state (*enc_finish[])(enc_state)={qoi_encode_chunk3_scalar, qoi_encode_chunk4_scalar};
+//pointers to optimised functions, indexed by QOI_ENC_*. BGRA/BGRX input is
+//roi only and refused by qoi_kernel_select
+static enc_state (*const enc_kernels[QOI_ENC_COUNT])(enc_state)={qoi_encode_chunk3_scalar, qoi_encode_chunk4_scalar, qoi_encode_chunk4_scalar};
+
+int qoi_kernel_available(int kernel){
+	return kernel==QOI_KERNEL_AUTO || kernel==QOI_KERNEL_SCALAR;
+}
+
+static int qoi_kernel_select(const options *opt, enc_state *s){
+	s->bulk=s->finish=enc_kernels;
+	return opt->input==QOI_INPUT_RGB && qoi_kernel_available(opt->kernel);
+}
 
 #define DEC_ARR_INDEX (((desc->channels-3)<<1)|(channels-3))
 static dec_state (*dec_arr[])(dec_state)={dec_in3out3, dec_in3out4, dec_in4out3, dec_in4out4};
@@ -40,6 +40,9 @@ This library provides the following functions;
 - qoi_write_from_ppm: Directly encode and write from a PPM file to a QOI file
 - qoi_encode: Encode an rgb/a buffer into a QOI image in memory
 
+Built with QOI_TIMING every call can report how long each of its stages took,
+see qoi_timing.
+
 See the function declaration below for the signature and more information.
 
 If you don't want/need the qoi_read and qoi_write functions, you can define
@@ -48,6 +51,10 @@ QOI_NO_STDIO before including this library.
 This library uses malloc() and free(). To supply your own malloc implementation
 you can define QOI_MALLOC and QOI_FREE before including this library.
 
+The file functions use fread() and fwrite(). To intercept their I/O, e.g. to
+time it, you can define QOI_FREAD and QOI_FWRITE with the same signatures
+before including this library.
+
 
 -- Data Format
 
@@ -62,6 +69,14 @@ struct qoi_header_t {
 	uint8_t  colorspace; // 0 = sRGB with linear alpha, 1 = all channels linear
 };
 
+The upper bits of the colorspace byte flag format variants, which decoders
+that don't know them reject as an invalid colorspace. QOI_FLAG_LONG_RUN
+(options.long_run) has the op that repeats the previous pixel the most times
+followed by a varint adding to its length, see qoi_write_varint.
+QOI_FLAG_RAW_BLOCKS (options.raw_blocks) has QOI_OP_RAW, a varint count of
+pixels stored verbatim after it, in place of the run op one short of
+QOI_OP_RUN_FULL.
+
 Images are encoded row by row, left to right, top to bottom. The decoder and
 encoder start with {r: 0, g: 0, b: 0, a: 255} as the previous pixel value. An
 image is complete when all pixels specified by width * height have been covered.
@@ -77,6 +92,8 @@ Header - Public functions */
 #ifndef QOI_H
 #define QOI_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -103,11 +120,130 @@ typedef struct {
 	unsigned char colorspace;
 } qoi_desc;
 
+/* Encode kernels for options.kernel. QOI_KERNEL_AUTO uses the instruction set
+chosen at compile time, with the mlut when options.mlut is set. The others
+force one kernel for the bulk of the image, e.g. to compare them in a single
+binary; every kernel produces byte-identical output. */
+enum {
+	QOI_KERNEL_AUTO,
+	QOI_KERNEL_SCALAR,
+	QOI_KERNEL_MLUT,
+	QOI_KERNEL_SSE,
+	QOI_KERNEL_AVX2,
+	QOI_KERNEL_AVX512,
+	QOI_KERNEL_COUNT
+};
+
+#ifdef QOI_TIMING
+/* Per call stage timings, only available when built with QOI_TIMING. Point
+options.timing at a zeroed qoi_timing to have a call fill it in; nothing is
+timed while it is NULL. The outermost call (qoi_encode, qoi_decode_timed,
+qoi_read, qoi_write, qoi_read_to_pam/ppm, qoi_write_from_pam/ppm) clears it
+at the start, calls it nests into only add to it, and callback (if set) gets it
+once the outermost call returns.
+
+ns[] is the time spent in each stage: reading input (fread and input buffer
+handling), opening files, allocating and parsing/writing the header, the
+encode/decode kernels, flushing the final run and padding, and writing output.
+total_ns covers the whole call. chunks counts CHUNK sized kernel calls,
+bytes_in/bytes_out the pixel or op stream bytes consumed and produced.
+
+POSIX builds time with clock_gettime(CLOCK_MONOTONIC), which needs
+_POSIX_C_SOURCE >= 199309L in strict C modes. Define QOI_TIMING_NS() to return
+nanoseconds from another clock. */
+enum {
+	QOI_TIMING_READ,
+	QOI_TIMING_HEADER,
+	QOI_TIMING_KERNEL,
+	QOI_TIMING_RUN,
+	QOI_TIMING_WRITE,
+	QOI_TIMING_STAGES
+};
+
+typedef struct qoi_timing {
+	unsigned long long ns[QOI_TIMING_STAGES];
+	unsigned long long total_ns;
+	unsigned long long chunks;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	void (*callback)(const struct qoi_timing *timing, void *user);
+	void *user;
+	//internal, leave zeroed
+	unsigned int depth;
+	unsigned long long start, mark;
+} qoi_timing;
+
+extern const char *const qoi_timing_stage_names[QOI_TIMING_STAGES];
+#endif
+
+/* options.tolerance enables near-lossless encoding: each channel of every
+decoded pixel is within tolerance of the input (0 is lossless). Pixels are
+quantized against the previously decoded pixel before the encode kernels run,
+snapping to it for a run where possible and otherwise keeping the red and blue
+diffs close to the green one so more pixels fit the short ops. The output is a
+normal stream for the unchanged decoder.
+
+options.input is the byte order of the pixels given to qoi_encode and
+qoi_encode_strided. QOI_INPUT_RGB is packed RGB or RGBA of desc->channels.
+QOI_INPUT_BGRA and QOI_INPUT_BGRX take 4 bytes per pixel as given by screen
+capture and GPU readback, swizzled inside the encode kernels rather than in a
+pass of their own. desc->channels is what is stored: 3 drops alpha, and X is
+never read so BGRX is stored as opaque. roi only, the stdio and streaming
+encoders take QOI_INPUT_RGB.
+
+options.preview is the number of preview levels (0..QOI_PREVIEW_LEVELS_MAX)
+qoi_encode and qoi_encode_strided append after the image, see
+qoi_decode_preview. Level n is 1/4^n of the width and height, box filtered from
+the input while it is encoded. The stdio and streaming encoders take 0.
+
+options.scale has qoi_read, qoi_read_to_pam and qoi_read_to_ppm write the image
+box filtered down by 2, 4 or 8 (0 and 1 are full size) as qoi_decode_scaled
+does, the width and height in the pam/ppm header are the scaled ones.
+
+options.orientation has qoi_read turn the image as qoi_decode_oriented does. It
+can't be combined with options.scale, and qoi_read_to_pam/ppm take only 0 and 1.
+
+options.long_run has every encoder write the QOI_FLAG_LONG_RUN variant, where a
+run of any length is one op of up to 6 bytes rather than a byte per 30
+pixels (62 for qoi). Flat areas such as UI captures and scans shrink, the
+decoders read either variant and write long runs with bulk stores.
+
+options.raw_blocks has every encoder write the QOI_FLAG_RAW_BLOCKS variant, where
+a CHUNK of pixels whose ops come out bigger than the pixels themselves is stored
+as they are. Noise and photos with film grain no longer grow past the size of
+the raw pixels, which is also about all qoi_encode allocates, and such blocks
+decode at memcpy speed. In roi, RGB input blocks the size kernels show will be
+stored raw are copied without running the encode kernels, so noise also encodes
+faster; other blocks have their ops written first to find out. */
+enum {
+	QOI_INPUT_RGB,
+	QOI_INPUT_BGRA,
+	QOI_INPUT_BGRX
+};
+
 typedef struct{
 	unsigned char mlut;
+	unsigned char kernel;
+	unsigned char tolerance;
+	unsigned char input;
+	unsigned char preview;
+	unsigned char scale;
+	unsigned char orientation;
+	unsigned char long_run;
+	unsigned char raw_blocks;
+#ifdef QOI_TIMING
+	qoi_timing *timing;
+#endif
 } options;
 
+/* Return 1 if the kernel is compiled into this build (and for QOI_KERNEL_MLUT,
+if the mlut is loaded), otherwise 0. Encoding with an unavailable kernel
+fails. */
+int qoi_kernel_available(int kernel);
+
 #define QOI_HEADER_SIZE 14
+#define QOI_FLAG_LONG_RUN 0x10
+#define QOI_FLAG_RAW_BLOCKS 0x20
 #define UNUSED(x) { x = x; }
 
 #ifndef QOI_NO_STDIO
@@ -138,6 +274,10 @@ will be filled with the description from the file header.
 The returned pixel data should be QOI_FREE()d after use. */
 void *qoi_read(const char *filename, qoi_desc *desc, int channels, const options *opt);
 
+/* qoi_read of one preview level (see qoi_decode_preview), reading only the
+footer and that level from the file. */
+void *qoi_read_preview(const char *filename, qoi_desc *desc, int channels, int level, const options *opt);
+
 /* Decode directly from file to PAM/PPM file
 
 The function returns 0 on failure (invalid parameters, or fopen or malloc
@@ -156,6 +296,23 @@ is set to the size in bytes of the encoded data.
 The returned qoi data should be QOI_FREE()d after use. */
 void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len, const options *opt);
 
+/* qoi_encode for pixels that are not tightly packed, e.g. a window of a
+framebuffer or one tile of a larger canvas. Row y of the image starts at
+data + y*stride bytes and only width*channels bytes of each row are read.
+stride may be negative for bottom-up buffers, with data pointing at the top
+row, and its magnitude must be at least width*channels. Unlike qoi_encode,
+data needs no space in front of it and is not written to. The output is the
+same as qoi_encode of the packed pixels. */
+void *qoi_encode_strided(const void *data, int stride, const qoi_desc *desc, int *out_len, const options *opt);
+
+/* Estimate the size in bytes qoi_encode would return for the pixels, without
+encoding them. Only the op lengths and runs are worked out, with the simd
+classification of the encode kernels where there is one. With sample_rate 0 or
+1 every row is read and the result is exact (for options.tolerance 0), with
+sample_rate n only every nth row is read and the count is scaled up to the
+whole image. data is only read. Returns 0 on invalid parameters. */
+int qoi_estimate_size(const void *data, const qoi_desc *desc, int sample_rate);
+
 /* Decode a QOI image from memory.
 
 The function either returns NULL on failure (invalid parameters or malloc
@@ -165,6 +322,178 @@ is filled with the description from the file header.
 The returned pixel data should be QOI_FREE()d after use. */
 void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 
+/* qoi_decode of the image box filtered down by scale (1, 2, 4 or 8) in width
+and height, rounded up, with the boxes on the right and bottom edges averaging
+the pixels they have. Rows are decoded scale at a time into a line buffer and
+reduced from there, only the scaled image is allocated. desc is filled with the
+width and height of the returned pixels. */
+void *qoi_decode_scaled(const void *data, int size, qoi_desc *desc, int channels, int scale);
+
+/* qoi_decode with the image turned upright for its EXIF orientation (1..8, 0
+is 1): 2 mirrors it, 3 turns it 180 degrees, 4 flips it, 5 transposes it, 6
+turns it 90 degrees clockwise, 7 transverses it and 8 turns it 90 degrees
+counterclockwise. Flips decode each row straight to its place, the others
+decode strips of rows and write them out turned, in tiles, so the output is
+never walked a column at a time. desc is filled with the width and height of
+the returned pixels, swapped for 5..8. */
+void *qoi_decode_oriented(const void *data, int size, qoi_desc *desc, int channels, int orientation);
+
+/* Previews are complete encoded images, smallest last, after the padding of
+the main image, followed by a footer:
+
+	uint32_t offset[levels];  // of each level from the start of the data
+	uint32_t levels;
+	uint32_t magic;           // "prvw"
+
+all big-endian like the header. Decoders that stop at the padding never see
+them. qoi_preview_levels returns the number of levels in data, 0 if there are
+none. qoi_decode_preview decodes level (0 is the image itself) like qoi_decode,
+touching only the footer and that level, and returns NULL if there is no such
+level. */
+#define QOI_PREVIEW_LEVELS_MAX 3
+
+int qoi_preview_levels(const void *data, int size);
+void *qoi_decode_preview(const void *data, int size, qoi_desc *desc, int channels, int level);
+
+/* Streaming encode and decode through callbacks with bounded memory, e.g. to
+transcode between two formats without holding the whole image (see qoitrans.c).
+Each stream keeps at most CHUNK pixels plus the op stream buffers for them.
+read and write follow fread/fwrite: they return the number of bytes moved and
+anything short of len from write is an error, 0 from read is end of input.
+
+qoi_enc_stream_open validates desc, selects the kernels from opt and writes the
+header. Pixels are handed over without a copy: qoi_enc_stream_buffer returns
+where the next pixels go and in *count how many fit (NULL once the image is
+complete), fill some of them and pass how many to qoi_enc_stream_commit. Each
+full CHUNK is encoded and written as soon as it is committed.
+qoi_enc_stream_close encodes the remainder, writes the padding and frees the
+stream. commit and close return 0 on success, 1 on a failed write, and close
+also fails if fewer pixels than width*height were committed.
+
+qoi_dec_stream_open reads and validates the header into desc, channels works
+as for qoi_decode. qoi_dec_stream_read decodes up to count pixels into pixels
+and returns how many it wrote, 0 at the end of the image or on truncated input.
+qoi_dec_stream_close frees the stream and returns 0 if the whole image was
+decoded, otherwise 1.
+
+The open functions return NULL on invalid parameters, a failed read/write or
+malloc failure. */
+typedef struct qoi_enc_stream qoi_enc_stream;
+typedef struct qoi_dec_stream qoi_dec_stream;
+typedef unsigned int (*qoi_stream_read)(void *user, void *buf, unsigned int len);
+typedef unsigned int (*qoi_stream_write)(void *user, const void *buf, unsigned int len);
+
+qoi_enc_stream *qoi_enc_stream_open(const qoi_desc *desc, const options *opt, qoi_stream_write write, void *user);
+unsigned char *qoi_enc_stream_buffer(qoi_enc_stream *es, unsigned int *count);
+int qoi_enc_stream_commit(qoi_enc_stream *es, unsigned int count);
+int qoi_enc_stream_close(qoi_enc_stream *es);
+
+qoi_dec_stream *qoi_dec_stream_open(qoi_desc *desc, int channels, qoi_stream_read read, void *user);
+unsigned int qoi_dec_stream_read(qoi_dec_stream *ds, void *pixels, unsigned int count);
+int qoi_dec_stream_close(qoi_dec_stream *ds);
+
+/* Archive of many encoded images in one file, for sprites and thumbnails where
+a file per image costs more than the image. All fields are little-endian:
+
+struct qoi_archive_header {  // 64 bytes
+	char     magic[4];      // "roia" ("qoia" when built for qoi)
+	uint32_t version;       // 1
+	uint32_t count;         // number of images
+	uint32_t reserved;
+	uint64_t index;         // offset of count index entries
+	uint64_t names;         // offset of the names, each NUL terminated
+	uint64_t names_size;
+	uint8_t  reserved2[24];
+};
+
+struct qoi_archive_index {   // 32 bytes, sorted by name as strcmp() orders them
+	uint64_t offset;        // of the encoded image, a multiple of 64
+	uint32_t size;          // of the encoded image
+	uint32_t width;
+	uint32_t height;
+	uint32_t name;          // offset of the name from the names
+	uint16_t name_len;      // without the NUL
+	uint8_t  channels;
+	uint8_t  colorspace;
+	uint32_t reserved;
+};
+
+The encoded images follow the header, each a complete stream for qoi_decode.
+Reading works on the whole archive in memory, typically mmap()ed, and makes no
+calls of its own: qoi_archive_open checks the header and that the index and
+names are inside size and returns 1, or 0 if not. qoi_archive_find looks a
+name up in the sorted index and returns its entry number, or -1.
+qoi_archive_get fills in entry i, pointing into data, and returns 1, or 0 if
+the entry is out of range or lies outside the archive. */
+typedef struct {
+	const unsigned char *data, *index, *names;
+	size_t size, names_size;
+	unsigned int count;
+} qoi_archive;
+
+typedef struct {
+	const char *name;
+	unsigned int name_len;
+	const void *data;
+	int size;
+	qoi_desc desc;
+} qoi_archive_entry;
+
+int qoi_archive_open(qoi_archive *ar, const void *data, size_t size);
+int qoi_archive_find(const qoi_archive *ar, const char *name);
+int qoi_archive_get(const qoi_archive *ar, unsigned int i, qoi_archive_entry *entry);
+
+#ifndef QOI_NO_STDIO
+/* Write an archive to filename. qoi_archive_add appends one encoded image (as
+from qoi_encode) under name, the index is kept in memory until
+qoi_archive_close sorts it and writes it out with the header. add and close
+return 0 on success, 1 on invalid data, a failed write or malloc failure.
+close also fails if a name was added twice, and frees the writer either way.
+qoi_archive_create returns NULL if filename can't be opened. */
+typedef struct qoi_archive_writer qoi_archive_writer;
+
+qoi_archive_writer *qoi_archive_create(const char *filename);
+int qoi_archive_add(qoi_archive_writer *aw, const char *name, const void *data, int size);
+int qoi_archive_close(qoi_archive_writer *aw);
+#endif
+
+#ifdef QOI_TIMING
+/* qoi_decode filling in timing (which may be NULL), see qoi_timing */
+void *qoi_decode_timed(const void *data, int size, qoi_desc *desc, int channels, qoi_timing *timing);
+#endif
+
+#ifdef QOI_STATS
+/* Op stream statistics, only available when built with QOI_STATS. Counters
+accumulate over every encode and decode call until qoi_stats_reset() and are
+not thread safe.
+
+op_cnt/op_bytes are indexed by op, see qoi_stats_op_names for the format
+that was built. run_op_hist[n] counts run ops covering n+1 pixels, with long
+runs (options.long_run) of more than 64 in run_op_hist[63] and under RUN_FULL.
+run_hist[n] counts whole runs of [2^n, 2^(n+1)) pixels (encoder only, runs
+crossing a CHUNK boundary in the streaming encoder are counted as two runs unless
+they are long runs). Blocks stored by options.raw_blocks count under RAW, the ops
+that were written for them first and dropped are counted too. sse_blocks and
+sse_alpha_fallback count 16 pixel SSE iterations and those that fell back to
+scalar because alpha changed. */
+#define QOI_STATS_OPS 8
+
+typedef struct {
+	unsigned long long op_cnt[QOI_STATS_OPS];
+	unsigned long long op_bytes[QOI_STATS_OPS];
+	unsigned long long run_op_hist[64];
+	unsigned long long run_hist[32];
+	unsigned long long sse_blocks;
+	unsigned long long sse_alpha_fallback;
+} qoi_stats;
+
+extern const char *const qoi_stats_op_names[QOI_STATS_OPS];
+
+/* Copy the encoder and decoder counters, either pointer may be NULL */
+void qoi_stats_get(qoi_stats *enc, qoi_stats *dec);
+void qoi_stats_reset(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -175,6 +504,7 @@ Implementation */
 
 #ifdef QOI_IMPLEMENTATION
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #ifndef QOI_SCALAR
@@ -208,6 +538,38 @@ enough for anybody. */
 	memcpy(&px, s.pixels+s.px_pos, 4); \
 }while(0)
 
+//the size kernels' DUMP_RUN: count the bytes of a pending run into s.b, for
+//the variant flagged in s.flags
+#define SIZE_RUN(rrr) do{ \
+	if(rrr>=QOI_RUN_FULL_VAL && (s.flags&QOI_FLAG_LONG_RUN)) \
+		s.b+=1+qoi_varint_len(rrr-QOI_RUN_FULL_VAL); \
+	else \
+		s.b+=((rrr+QOI_RUN_FULL_VAL-1)/QOI_RUN_FULL_VAL)+((s.flags&QOI_FLAG_RAW_BLOCKS) && (rrr%QOI_RUN_FULL_VAL)==QOI_RUN_FULL_VAL-1); \
+	rrr=0; \
+}while(0)
+
+//load the qoi_rgba_t px from p in RGBA order, BGRX loads with alpha 255
+#define QOI_LOAD_RGBA(px, p) memcpy(&(px), (p), 4)
+#define QOI_LOAD_BGRA(px, p) do{ \
+	memcpy(&(px), (p), 4); \
+	(px).v=((px).v&0xff00ff00)|(((px).v>>16)&0xff)|(((px).v&0xff)<<16); \
+}while(0)
+#define QOI_LOAD_BGRX(px, p) do{ \
+	QOI_LOAD_BGRA(px, p); \
+	(px).v|=0xff000000; \
+}while(0)
+
+//the encode kernels for each input: RGB and RGBA of desc->channels, RGBA with
+//alpha 255 throughout, and 4 byte BGRA/BGRX input (see options.input)
+enum {
+	QOI_ENC_RGB,
+	QOI_ENC_RGBA,
+	QOI_ENC_RGBA_OPAQUE,
+	QOI_ENC_BGRA,
+	QOI_ENC_BGRX,
+	QOI_ENC_COUNT
+};
+
 typedef union {
 	struct { unsigned char r, g, b, a; } rgba;
 	unsigned int v;
@@ -215,6 +577,100 @@ typedef union {
 
 static const unsigned char qoi_padding[8] = {0,0,0,0,0,0,0,1};
 
+#ifdef QOI_STATS
+static qoi_stats qoi_stats_enc, qoi_stats_dec;
+
+void qoi_stats_get(qoi_stats *enc, qoi_stats *dec) {
+	if(enc)
+		*enc=qoi_stats_enc;
+	if(dec)
+		*dec=qoi_stats_dec;
+}
+
+void qoi_stats_reset(void) {
+	memset(&qoi_stats_enc, 0, sizeof(qoi_stats_enc));
+	memset(&qoi_stats_dec, 0, sizeof(qoi_stats_dec));
+}
+
+static inline unsigned int qoi_stats_log2(unsigned int v) {
+	unsigned int r=0;
+	while(v>>=1)
+		++r;
+	return r;
+}
+
+#define QOI_STAT_OP(st, op, len) do{ (st).op_cnt[op]++; (st).op_bytes[op]+=(len); }while(0)
+#define QOI_STAT_RUN_OP(st, len) do{ \
+	QOI_STAT_OP(st, (len)==QOI_RUN_FULL_VAL?QOI_STAT_RUN_FULL:QOI_STAT_RUN, 1); \
+	(st).run_op_hist[(len)-1]++; \
+}while(0)
+#define QOI_STAT_LONG_RUN_OP(st, len, bytes) do{ \
+	QOI_STAT_OP(st, QOI_STAT_RUN_FULL, bytes); \
+	(st).run_op_hist[(len)<64?(len)-1:63]++; \
+}while(0)
+#define QOI_STAT_RAW_OP(st, bytes) QOI_STAT_OP(st, QOI_STAT_RAW, bytes)
+#define QOI_STAT_RUN(st, len) do{ if(len) (st).run_hist[qoi_stats_log2(len)]++; }while(0)
+#define QOI_STAT_INC(var) do{ (var)++; }while(0)
+#else
+#define QOI_STAT_OP(st, op, len)
+#define QOI_STAT_RUN_OP(st, len)
+#define QOI_STAT_LONG_RUN_OP(st, len, bytes) do{ (void)(bytes); }while(0)
+#define QOI_STAT_RAW_OP(st, bytes) do{ (void)(bytes); }while(0)
+#define QOI_STAT_RUN(st, len)
+#define QOI_STAT_INC(var)
+#endif
+
+#ifdef QOI_TIMING
+#ifndef QOI_TIMING_NS
+#include <time.h>
+static unsigned long long qoi_timing_ns(void) {
+	struct timespec ts;
+#ifdef _WIN32
+	timespec_get(&ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#define QOI_TIMING_NS() qoi_timing_ns()
+#endif
+
+const char *const qoi_timing_stage_names[QOI_TIMING_STAGES]={"read", "header", "kernel", "run", "write"};
+
+//the outermost call clears t and calls back at its end, nested calls add to it
+#define QOI_TIMING_BEGIN(t) do{ \
+	qoi_timing *qt=(t); \
+	if(qt && !qt->depth++){ \
+		memset(qt->ns, 0, sizeof(qt->ns)); \
+		qt->chunks=qt->bytes_in=qt->bytes_out=0; \
+		qt->start=qt->mark=QOI_TIMING_NS(); \
+	} \
+}while(0)
+//charge the time since the previous mark to stage
+#define QOI_TIMING_MARK(t, stage) do{ \
+	qoi_timing *qt=(t); \
+	if(qt){ \
+		unsigned long long qt_now=QOI_TIMING_NS(); \
+		qt->ns[stage]+=qt_now-qt->mark; \
+		qt->mark=qt_now; \
+	} \
+}while(0)
+#define QOI_TIMING_ADD(t, field, n) do{ if(t) (t)->field+=(n); }while(0)
+#define QOI_TIMING_END(t) do{ \
+	qoi_timing *qt=(t); \
+	if(qt && !--qt->depth){ \
+		qt->total_ns=QOI_TIMING_NS()-qt->start; \
+		if(qt->callback) \
+			qt->callback(qt, qt->user); \
+	} \
+}while(0)
+#else
+#define QOI_TIMING_BEGIN(t)
+#define QOI_TIMING_MARK(t, stage)
+#define QOI_TIMING_ADD(t, field, n)
+#define QOI_TIMING_END(t)
+#endif
+
 static void qoi_write_32(unsigned char *bytes, unsigned int *p, unsigned int v) {
 	bytes[(*p)++] = (0xff000000 & v) >> 24;
 	bytes[(*p)++] = (0x00ff0000 & v) >> 16;
@@ -230,93 +686,1340 @@ static unsigned int qoi_read_32(const unsigned char *bytes, unsigned int *p) {
 	return a << 24 | b << 16 | c << 8 | d;
 }
 
-#ifdef ROI
-#include "roi.c"
-#elif defined QOI
-#include "qoi.c"
-#else
-#error "Format must be defined"
-#endif
-
-static void qoi_encode_init(const qoi_desc *desc, unsigned char *bytes, unsigned int *p) {
-	qoi_write_32(bytes, p, QOI_MAGIC);
-	qoi_write_32(bytes, p, desc->width);
-	qoi_write_32(bytes, p, desc->height);
-	bytes[(*p)++] = desc->channels;
-	bytes[(*p)++] = desc->colorspace;
+//QOI_FLAG_LONG_RUN and QOI_FLAG_RAW_BLOCKS: v in 7 bits a byte, low bits first,
+//the top bit set on all but the last byte. Returns the bytes written, at most
+//QOI_VARINT_MAX
+#define QOI_VARINT_MAX 5
+static inline unsigned int qoi_write_varint(unsigned char *bytes, unsigned int v) {
+	unsigned int n=0;
+	for(;v>=0x80;v>>=7)
+		bytes[n++]=(v&0x7f)|0x80;
+	bytes[n++]=v;
+	return n;
+}
+
+//the bytes qoi_write_varint writes for v
+static inline unsigned int qoi_varint_len(unsigned int v) {
+	unsigned int n=1;
+	for(;v>=0x80;v>>=7)
+		n++;
+	return n;
+}
+
+//reads no more than QOI_VARINT_MAX bytes whatever they hold, so a damaged
+//stream stays inside the bytes the decode kernels know are present
+static inline unsigned int qoi_read_varint(const unsigned char *bytes, unsigned int *p) {
+	unsigned int v=0, shift=0, c;
+	do{
+		c=bytes[(*p)++];
+		v|=(c&0x7f)<<shift;
+		shift+=7;
+	}while((c&0x80) && shift<(QOI_VARINT_MAX*7));
+	return v;
+}
+
+//split the colorspace byte of a header into desc->colorspace and the
+//QOI_FLAG_* returned. Flags this build doesn't know stay in desc->colorspace so
+//the header fails the usual colorspace check
+static inline unsigned int qoi_header_flags(unsigned char colorspace, qoi_desc *desc) {
+	desc->colorspace=colorspace&~(QOI_FLAG_LONG_RUN|QOI_FLAG_RAW_BLOCKS);
+	return colorspace&(QOI_FLAG_LONG_RUN|QOI_FLAG_RAW_BLOCKS);
+}
+
+//the DUMP_RUN of a run of QOI_RUN_FULL_VAL or more pixels: with QOI_FLAG_LONG_RUN one
+//QOI_OP_RUN_FULL and a varint of the rest, else a QOI_OP_RUN_FULL per
+//QOI_RUN_FULL_VAL pixels leaving what is left over in rrr
+#define DUMP_RUN_LONG(rrr) do{ \
+	if(s.flags&QOI_FLAG_LONG_RUN){ \
+		unsigned int lr_b=s.b; \
+		s.bytes[s.b++] = QOI_OP_RUN_FULL; \
+		s.b+=qoi_write_varint(s.bytes+s.b, rrr-QOI_RUN_FULL_VAL); \
+		QOI_STAT_LONG_RUN_OP(qoi_stats_enc, rrr, s.b-lr_b); \
+		rrr=0; \
+	} \
+	else \
+		DUMP_RUN_FULL(rrr); \
+}while(0)
+
+//a QOI_OP_RUN_FULL of a QOI_FLAG_LONG_RUN stream: s.run becomes every pixel of
+//the run, the one of the op included. The op and varint fit in the bytes the
+//decode kernels check are present
+#define QOI_DECODE_LONG_RUN do{ \
+	unsigned int lr_b=s.b; \
+	s.run=QOI_RUN_FULL_VAL+qoi_read_varint(s.bytes, &(s.b)); \
+	QOI_STAT_LONG_RUN_OP(qoi_stats_dec, s.run, s.b-lr_b+1); \
+}while(0)
+
+//write n copies of the channels bytes of px to p, doubling what is already
+//written so a run of thousands of pixels is a dozen memcpy
+static inline void qoi_fill_run(unsigned char *p, qoi_rgba_t px, unsigned int n, unsigned int channels) {
+	size_t done=channels, total=(size_t)n*channels, len;
+	if(!n)
+		return;
+	memcpy(p, &px, channels);
+	while(done<total){
+		len=done<(total-done)?done:(total-done);
+		memcpy(p+done, p, len);
+		done+=len;
+	}
+}
+
+//write the s.run pixels of a long run in one go, as far as the output and the
+//image allow. What is left is picked up by the next call of the kernel, the
+//short runs keep to the pixel at a time loop
+#define QOI_DECODE_RUN_FILL(channels) do{ \
+	unsigned int fill=s.run; \
+	if(fill>(s.p_limit-s.px_pos)/(channels)) \
+		fill=(s.p_limit-s.px_pos)/(channels); \
+	if(fill>s.pixel_cnt-s.pixel_curr) \
+		fill=s.pixel_cnt-s.pixel_curr; \
+	qoi_fill_run(s.pixels+s.px_pos, s.px, fill, channels); \
+	s.run-=fill; \
+	s.px_pos+=fill*(channels); \
+	s.pixel_curr+=fill; \
+}while(0)
+
+//n pixels of a QOI_OP_RAW from in to out channels, an added alpha is 255 as
+//only 3 channel images have in<out
+static inline void qoi_raw_copy(unsigned char *dst, const unsigned char *src, unsigned int n, unsigned int in, unsigned int out) {
+	unsigned int i;
+	if(in==out){
+		memcpy(dst, src, (size_t)n*in);
+		return;
+	}
+	for(i=0;i<n;i++,dst+=out,src+=in){
+		dst[0]=src[0];
+		dst[1]=src[1];
+		dst[2]=src[2];
+		if(out==4)
+			dst[3]=255;
+	}
+}
+
+//copy what there is of the s.raw pixels of a QOI_OP_RAW, as far as the input,
+//the output and the image allow. The last one is the previous pixel, and once
+//the block is done goes in the index of formats that have one
+#define QOI_DECODE_RAW(in, out) do{ \
+	unsigned int raw_n=s.raw; \
+	if(raw_n>(s.b_present-s.b)/(in)) \
+		raw_n=(s.b_present-s.b)/(in); \
+	if(raw_n>(s.p_limit-s.px_pos)/(out)) \
+		raw_n=(s.p_limit-s.px_pos)/(out); \
+	if(raw_n>s.pixel_cnt-s.pixel_curr) \
+		raw_n=s.pixel_cnt-s.pixel_curr; \
+	if(raw_n){ \
+		qoi_raw_copy(s.pixels+s.px_pos, s.bytes+s.b, raw_n, in, out); \
+		memcpy(&s.px, s.bytes+s.b+((raw_n-1)*(in)), in); \
+	} \
+	s.raw-=raw_n; \
+	s.b+=raw_n*(in); \
+	s.px_pos+=raw_n*(out); \
+	s.pixel_curr+=raw_n; \
+	if(!s.raw) \
+		QOI_RAW_INDEX(s.index, s.px); \
+}while(0)
+
+//a QOI_OP_RAW of a QOI_FLAG_RAW_BLOCKS stream, the kernel returns while s.raw
+//is left so the caller brings in more input or output
+#define QOI_DECODE_RAW_BLOCK(in, out) do{ \
+	unsigned int raw_b=s.b; \
+	s.raw=qoi_read_varint(s.bytes, &(s.b)); \
+	QOI_STAT_RAW_OP(qoi_stats_dec, (s.b-raw_b)+1+(s.raw*(in))); \
+	QOI_DECODE_RAW(in, out); \
+}while(0)
+
+#ifdef ROI
+#include "roi.c"
+#elif defined QOI
+#include "qoi.c"
+#else
+#error "Format must be defined"
+#endif
+
+#ifdef ROI
+//1 if every pixel of cnt RGBA pixels has alpha 255
+static int qoi_opaque(const unsigned char *pixels, unsigned int cnt) {
+	unsigned int i=0;
+	unsigned char a=255;
+#ifdef QOI_SSE
+	const __m128i rgb=_mm_set1_epi32(0x00ffffff), ones=_mm_set1_epi8(-1);
+	__m128i v;
+	for(;(i+16)<=cnt;i+=16){
+		v=_mm_and_si128(
+			_mm_and_si128(_mm_loadu_si128((__m128i const*)(pixels+(i*4))), _mm_loadu_si128((__m128i const*)(pixels+(i*4)+16))),
+			_mm_and_si128(_mm_loadu_si128((__m128i const*)(pixels+(i*4)+32)), _mm_loadu_si128((__m128i const*)(pixels+(i*4)+48))));
+		if(0xffff!=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(v, rgb), ones)))
+			return 0;
+	}
+#endif
+	for(;i<cnt;i++)
+		a&=pixels[(i*4)+3];
+	return a==255;
+}
+#endif
+
+//s.bulk/s.finish index for cnt pixels at pixels of options.input. 4 byte
+//input with alpha 255 throughout, prev_alpha included, encodes to the same ops
+//as RGB and so goes through the kernels that never look at alpha, as does 4
+//byte input stored as 3 channels. qoi has no such kernels, so it skips the scan
+static int qoi_enc_index(const unsigned char *pixels, unsigned int cnt, unsigned int channels, unsigned int input, unsigned int prev_alpha) {
+#ifdef ROI
+	if(input==QOI_INPUT_RGB){
+		if(channels==3)
+			return QOI_ENC_RGB;
+		return (prev_alpha==255 && qoi_opaque(pixels, cnt))?QOI_ENC_RGBA_OPAQUE:QOI_ENC_RGBA;
+	}
+	if(input==QOI_INPUT_BGRX || channels==3)
+		return QOI_ENC_BGRX;
+	return (prev_alpha==255 && qoi_opaque(pixels, cnt))?QOI_ENC_BGRX:QOI_ENC_BGRA;
+#else
+	(void)pixels;
+	(void)cnt;
+	(void)input;
+	(void)prev_alpha;
+	return channels==3?QOI_ENC_RGB:QOI_ENC_RGBA;
+#endif
+}
+
+//write the header to s->bytes and set up s for the variant it flags
+static void qoi_encode_init(enc_state *s, const qoi_desc *desc, const options *opt) {
+	qoi_write_32(s->bytes, &(s->b), QOI_MAGIC);
+	qoi_write_32(s->bytes, &(s->b), desc->width);
+	qoi_write_32(s->bytes, &(s->b), desc->height);
+	s->bytes[s->b++] = desc->channels;
+	s->flags = (opt->long_run?QOI_FLAG_LONG_RUN:0) | (opt->raw_blocks?QOI_FLAG_RAW_BLOCKS:0);
+	s->bytes[s->b++] = desc->colorspace | s->flags;
+}
+
+//cnt pixels of options.input at src as the channels bytes each of a QOI_OP_RAW
+static void qoi_raw_store(unsigned char *dst, const unsigned char *src, unsigned int cnt, unsigned int channels, unsigned int input) {
+	unsigned int i;
+	if(input==QOI_INPUT_RGB){
+		memcpy(dst, src, (size_t)cnt*channels);
+		return;
+	}
+	for(i=0;i<cnt;i++,src+=4){
+		*dst++=src[2];
+		*dst++=src[1];
+		*dst++=src[0];
+		if(channels==4)
+			*dst++=input==QOI_INPUT_BGRX?255:src[3];
+	}
+}
+
+//the QOI_OP_RAW and varint of a block and the run written in front of them
+#define QOI_RAW_BLOCK_SLACK (2*(1+QOI_VARINT_MAX))
+//the pixels qoi_raw_sure counts first, the rest are only counted when these
+//did not compress, so compressible blocks don't pay for a second pass
+#define QOI_RAW_PROBE 4096
+
+//the run carried into a block and a QOI_OP_RAW of its cnt pixels at px (of
+//options.input), the index is as it was before the block
+static enc_state qoi_raw_emit(enc_state s, const unsigned char *px, unsigned int cnt, unsigned int channels, unsigned int input) {
+	qoi_rgba_t last;
+	unsigned int raw_b;
+	DUMP_RUN(s.run);
+	raw_b=s.b;
+	s.bytes[s.b++]=QOI_OP_RAW;
+	s.b+=qoi_write_varint(s.bytes+s.b, cnt);
+	qoi_raw_store(s.bytes+s.b, px, cnt, channels, input);
+	s.b+=cnt*channels;
+	QOI_STAT_RAW_OP(qoi_stats_enc, s.b-raw_b);
+	last.v=0xff000000;
+	memcpy(&last, s.bytes+s.b-channels, channels);
+	QOI_RAW_INDEX(s.index, last);
+	return s;
+}
+
+//with QOI_FLAG_RAW_BLOCKS, the ops the kernels wrote since before for the cnt
+//pixels at px (of options.input) are swapped for a QOI_OP_RAW of the pixels when
+//they came out bigger
+static enc_state qoi_raw_block(enc_state before, enc_state s, const unsigned char *px, unsigned int cnt, unsigned int channels, unsigned int input) {
+	if(!(s.flags&QOI_FLAG_RAW_BLOCKS) || (s.b-before.b)<=(cnt*channels)+QOI_RAW_BLOCK_SLACK)
+		return s;
+	before.pixels=s.pixels;
+	before.px_pos=s.px_pos;
+	before.pixel_cnt=s.pixel_cnt;
+	return qoi_raw_emit(before, px, cnt, channels, input);
+}
+
+#ifdef ROI
+//1 if the RGB input pixels s.px_pos/channels..s.pixel_cnt are sure to be
+//stored by qoi_raw_block. The size kernels count what the encode kernels write
+//for the variant in s.flags, less the full runs those write at the end of the
+//pixels, so a count past the threshold means the ops would be swapped out
+static int qoi_raw_sure(enc_state s, unsigned int channels) {
+	const unsigned int b=s.b, from=s.px_pos/channels, end=s.pixel_cnt;
+	const unsigned int bulk=from+(((end-from)/16)*16);
+	if(bulk>from+QOI_RAW_PROBE){
+		s.pixel_cnt=from+QOI_RAW_PROBE;
+		s=size_bulk[channels-3](s);
+		if((s.b-b)<=QOI_RAW_PROBE*channels)
+			return 0;
+	}
+	if(bulk*channels>s.px_pos){
+		s.pixel_cnt=bulk;
+		s=size_bulk[channels-3](s);
+	}
+	if(bulk<end){
+		s.px_pos=bulk*channels;
+		s.pixel_cnt=end;
+		s=size_finish[channels-3](s);
+	}
+	return (s.b-b)>((end-from)*channels)+QOI_RAW_BLOCK_SLACK;
+}
+#endif
+
+//kernel from s.px_pos to s.pixel_cnt, the cnt pixels at px of options.input,
+//then qoi_raw_block. With QOI_FLAG_RAW_BLOCKS, RGB input the size kernels show
+//will be stored raw is stored without running the kernel, so incompressible
+//blocks cost a count and a copy rather than a full encode. The QOI size kernel
+//emulates the index and is no faster than its encode kernels, so QOI doesn't
+static enc_state qoi_encode_block(enc_state s, enc_state (*kernel)(enc_state), const unsigned char *px, unsigned int cnt, unsigned int channels, unsigned int input) {
+	enc_state before=s;
+#ifdef ROI
+	if((s.flags&QOI_FLAG_RAW_BLOCKS) && input==QOI_INPUT_RGB && qoi_raw_sure(s, channels)){
+		s=qoi_raw_emit(s, px, cnt, channels, input);
+		s.px_pos=s.pixel_cnt*channels;
+		return s;
+	}
+#endif
+	return qoi_raw_block(before, kernel(s), px, cnt, channels, input);
+}
+
+//bytes the ops of cnt pixels take at most with QOI_FLAG_RAW_BLOCKS: each block
+//no more than stored, plus the ops of one block at worst per pixel while they
+//are tried, plus the run at the end
+static unsigned int qoi_raw_max_size(unsigned int cnt, unsigned int channels, unsigned int worst) {
+	unsigned int blocks=(cnt+CHUNK-1)/CHUNK;
+	return (cnt*channels)+((blocks+1)*QOI_RAW_BLOCK_SLACK)+((cnt<CHUNK?cnt:CHUNK)*(worst-channels));
+}
+
+//the value within tol of v (and 0..255) closest to target
+static inline int qoi_quantize_channel(int v, int target, int tol) {
+	int lo=v-tol, hi=v+tol;
+	if(lo<0)
+		lo=0;
+	if(hi>255)
+		hi=255;
+	return target<lo?lo:(target>hi?hi:target);
+}
+
+//near-lossless: rewrite cnt pixels in place so each is cheap to encode against
+//the previous rewritten pixel, which must be at pixels-channels. This carries a
+//dependency from pixel to pixel so it runs ahead of the kernels rather than in
+//them, every kernel then encodes the result losslessly
+static void qoi_quantize(unsigned char *pixels, unsigned int cnt, unsigned int channels, int tol) {
+	unsigned char *px=pixels, *end=pixels+(cnt*channels);
+	int g;
+	for(;px<end;px+=channels){
+		const unsigned char *prev=px-channels;
+		g=qoi_quantize_channel(px[1], prev[1], tol);
+		px[0]=qoi_quantize_channel(px[0], prev[0]+g-prev[1], tol);
+		px[2]=qoi_quantize_channel(px[2], prev[2]+g-prev[1], tol);
+		px[1]=g;
+		if(channels==4)
+			px[3]=qoi_quantize_channel(px[3], prev[3], tol);
+	}
+}
+
+//preview levels: the box sums of level 1 are gathered a row of boxes at a time
+//as the encoder walks the input. Each finished row of boxes adds its sums,
+//before rounding, to the row of boxes of the next level, so every level is a
+//box filter of the input
+#define QOI_PREVIEW_MAGIC (('p' << 24) | ('r' << 16) | ('v' << 8) | 'w')
+#define QOI_PREVIEW_SCALE 4
+#define QOI_SCALED_DIM(d, scale) (((d)+(scale)-1)/(scale))
+#define QOI_PREVIEW_DIM(d) QOI_SCALED_DIM(d, QOI_PREVIEW_SCALE)
+#define QOI_PREVIEW_FOOTER_SIZE(levels) (((levels)*4)+8)
+
+typedef struct {
+	unsigned int *acc[QOI_PREVIEW_LEVELS_MAX];//sums of the current row of boxes of each level, 4 per box in input order
+	unsigned char *pixels[QOI_PREVIEW_LEVELS_MAX];//each level as stored
+	unsigned int width, height, instride, channels, colorspace, input, levels;
+} qoi_preview;
+
+//input pixels across a box of level l, 0 being level 1
+static unsigned int qoi_preview_box(unsigned int l) {
+	unsigned int box=QOI_PREVIEW_SCALE;
+	while(l--)
+		box*=QOI_PREVIEW_SCALE;
+	return box;
+}
+
+static void qoi_preview_free(qoi_preview *pv) {
+	unsigned int l;
+	for(l=0;l<pv->levels;l++){
+		QOI_FREE(pv->acc[l]);
+		QOI_FREE(pv->pixels[l]);
+	}
+}
+
+static int qoi_preview_init(qoi_preview *pv, const qoi_desc *desc, const options *opt) {
+	unsigned int l, w, box;
+	pv->width=desc->width;
+	pv->height=desc->height;
+	pv->channels=desc->channels;
+	pv->colorspace=desc->colorspace;
+	pv->input=opt->input;
+	pv->instride=opt->input?4:desc->channels;
+	pv->levels=opt->preview;
+	memset(pv->acc, 0, sizeof(pv->acc));
+	memset(pv->pixels, 0, sizeof(pv->pixels));
+	for(l=0;l<pv->levels;l++){
+		box=qoi_preview_box(l);
+		w=QOI_SCALED_DIM(desc->width, box);
+		if(
+			!(pv->acc[l]=QOI_MALLOC(w*4*sizeof(unsigned int))) ||
+			!(pv->pixels[l]=QOI_MALLOC((size_t)w*QOI_SCALED_DIM(desc->height, box)*desc->channels))
+		){
+			qoi_preview_free(pv);
+			return 1;
+		}
+		memset(pv->acc[l], 0, w*4*sizeof(unsigned int));
+	}
+	return 0;
+}
+
+//the averages of row by of the boxes of level l, each over the input pixels it
+//covers. The sums go on to the next level, which is emitted when its row of
+//boxes is complete
+static void qoi_preview_emit(qoi_preview *pv, unsigned int l, unsigned int by) {
+	const unsigned int box=qoi_preview_box(l), w=QOI_SCALED_DIM(pv->width, box);
+	const unsigned int rows=(pv->height-(by*box))<box?pv->height-(by*box):box;
+	unsigned int *acc=pv->acc[l], *up=(l+1)<pv->levels?pv->acc[l+1]:NULL;
+	unsigned char *out=pv->pixels[l]+((size_t)by*w*pv->channels);
+	unsigned int bx, c, cnt, v[4], t;
+	for(bx=0;bx<w;bx++,acc+=4,out+=pv->channels){
+		cnt=rows*(bx==w-1?pv->width-(bx*box):box);
+		if(cnt==box*box){//whole boxes, all but the edges, box*box is 16^(l+1)
+			for(c=0;c<4;c++)
+				v[c]=(acc[c]+(cnt/2))>>(4*(l+1));
+		}
+		else{
+			for(c=0;c<4;c++)
+				v[c]=(acc[c]+(cnt/2))/cnt;
+		}
+		if(up){
+			for(c=0;c<4;c++)
+				up[((bx/QOI_PREVIEW_SCALE)*4)+c]+=acc[c];
+		}
+		if(pv->input){
+			t=v[0];
+			v[0]=v[2];
+			v[2]=t;
+			if(pv->input==QOI_INPUT_BGRX)
+				v[3]=255;
+		}
+		for(c=0;c<pv->channels;c++)
+			out[c]=v[c];
+	}
+	memset(pv->acc[l], 0, w*4*sizeof(unsigned int));
+	if(up && ((by+1)%QOI_PREVIEW_SCALE==0 || (by+1)*box>=pv->height))
+		qoi_preview_emit(pv, l+1, by/QOI_PREVIEW_SCALE);
+}
+
+//add pixels x..end of input row y, at px, to the box sums
+static void qoi_preview_row(qoi_preview *pv, const unsigned char *px, unsigned int x, unsigned int end, unsigned int y) {
+	const unsigned int instride=pv->instride;
+	unsigned int *acc, c;
+#ifdef QOI_SSE
+	const __m128i shuf=instride==3?
+		_mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1):
+		_mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	const __m128i ones8=_mm_set1_epi8(1), ones16=_mm_set1_epi16(1);
+	__m128i v;
+#endif
+	for(;x<end && (x%QOI_PREVIEW_SCALE);x++,px+=instride){
+		acc=pv->acc[0]+((x/QOI_PREVIEW_SCALE)*4);
+		for(c=0;c<instride;c++)
+			acc[c]+=px[c];
+	}
+#ifdef QOI_SSE
+	//a whole box of a row at a time: grouped by channel, then pairs and pairs of
+	//pairs summed into the 4 channel sums. RGB loads 4 bytes past the box so
+	//stops while there is a box and a bit left
+	for(;(x+QOI_PREVIEW_SCALE)<=end && (instride==4 || (x+6)<=end);x+=QOI_PREVIEW_SCALE,px+=QOI_PREVIEW_SCALE*instride){
+		v=_mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)px), shuf);
+		v=_mm_madd_epi16(_mm_maddubs_epi16(v, ones8), ones16);
+		acc=pv->acc[0]+x;
+		_mm_storeu_si128((__m128i*)acc, _mm_add_epi32(_mm_loadu_si128((__m128i const*)acc), v));
+	}
+#endif
+	for(;x<end;x++,px+=instride){
+		acc=pv->acc[0]+((x/QOI_PREVIEW_SCALE)*4);
+		for(c=0;c<instride;c++)
+			acc[c]+=px[c];
+	}
+	if(end==pv->width && ((y+1)%QOI_PREVIEW_SCALE==0 || y+1==pv->height))
+		qoi_preview_emit(pv, 0, y/QOI_PREVIEW_SCALE);
+}
+
+//add input pixels from..to, at px, which may start and end mid row
+static void qoi_preview_span(qoi_preview *pv, const unsigned char *px, unsigned int from, unsigned int to) {
+	unsigned int y, x, end;
+	while(from<to){
+		y=from/pv->width;
+		x=from-(y*pv->width);
+		end=(to-from)<(pv->width-x)?x+(to-from):pv->width;
+		qoi_preview_row(pv, px, x, end, y);
+		px+=(end-x)*pv->instride;
+		from+=end-x;
+	}
+}
+
+//room the levels and footer need after the image
+static int qoi_preview_max_size(const qoi_desc *desc, unsigned int levels) {
+	unsigned int l, w=desc->width, h=desc->height;
+	int size=QOI_PREVIEW_FOOTER_SIZE(levels);
+	for(l=0;l<levels;l++){
+		w=QOI_PREVIEW_DIM(w);
+		h=QOI_PREVIEW_DIM(h);
+		size+=(w*h*QOI_PIXEL_WORST_CASE)+QOI_HEADER_SIZE+sizeof(qoi_padding);
+	}
+	return size;
+}
+
+//encode the levels and the footer after the padding of the image in s.bytes,
+//sized with qoi_preview_max_size
+static int qoi_preview_finish(enc_state *sp, qoi_preview *pv, const options *opt) {
+	enc_state s=*sp;
+	qoi_desc desc={0, 0, pv->channels, pv->colorspace};
+	options lopt=*opt;
+	unsigned char *enc;
+	unsigned int l, box, offs[QOI_PREVIEW_LEVELS_MAX];
+	int len;
+	lopt.tolerance=0;
+	lopt.input=QOI_INPUT_RGB;
+	lopt.preview=0;
+	for(l=0;l<pv->levels;l++){
+		box=qoi_preview_box(l);
+		desc.width=QOI_SCALED_DIM(pv->width, box);
+		desc.height=QOI_SCALED_DIM(pv->height, box);
+		if(!(enc=qoi_encode_strided(pv->pixels[l], desc.width*desc.channels, &desc, &len, &lopt)))
+			return 1;
+		offs[l]=s.b;
+		memcpy(s.bytes+s.b, enc, len);
+		s.b+=len;
+		QOI_FREE(enc);
+	}
+	for(l=0;l<pv->levels;l++)
+		qoi_write_32(s.bytes, &(s.b), offs[l]);
+	qoi_write_32(s.bytes, &(s.b), pv->levels);
+	qoi_write_32(s.bytes, &(s.b), QOI_PREVIEW_MAGIC);
+	*sp=s;
+	return 0;
+}
+
+//offsets of the levels from the footer at end, which has avail bytes in front
+//of it, of size bytes of data. offs[levels] is the start of the footer. Returns
+//the number of levels, 0 if there is no valid footer
+static unsigned int qoi_preview_index(const unsigned char *end, unsigned int avail, unsigned int size, unsigned int *offs) {
+	unsigned int p=0, levels, l;
+	if(avail<8 || size<8)
+		return 0;
+	levels=qoi_read_32(end-8, &p);
+	if(
+		qoi_read_32(end-8, &p)!=QOI_PREVIEW_MAGIC ||
+		levels==0 || levels>QOI_PREVIEW_LEVELS_MAX ||
+		avail<QOI_PREVIEW_FOOTER_SIZE(levels) || size<QOI_PREVIEW_FOOTER_SIZE(levels)
+	)
+		return 0;
+	p=0;
+	for(l=0;l<levels;l++)
+		offs[l]=qoi_read_32(end-QOI_PREVIEW_FOOTER_SIZE(levels), &p);
+	offs[levels]=size-QOI_PREVIEW_FOOTER_SIZE(levels);
+	for(l=0;l<levels;l++){
+		if(offs[l]<(l?offs[l-1]:0)+QOI_HEADER_SIZE+sizeof(qoi_padding) || offs[l]>offs[l+1])
+			return 0;
+	}
+	return levels;
+}
+
+//qoi_encode with options.tolerance, the input is const so each chunk is
+//quantized in a copy. Previews are of the input as given
+static int qoi_encode_quantized(enc_state *sp, const unsigned char *data, const qoi_desc *desc, const options *opt, qoi_preview *pv) {
+	enc_state s=*sp;
+	unsigned int i, cnt, ei, totpixels=desc->width*desc->height;
+	const unsigned int instride=opt->input?4:desc->channels;
+	if(!(s.pixels_alloc=QOI_MALLOC((CHUNK*instride)+65)))
+		return 1;
+	memset(s.pixels_alloc, 0, 64);
+	if(instride==4)
+		s.pixels_alloc[63]=255;
+	s.pixels=s.pixels_alloc+64;
+	for(i=0;i<totpixels;i+=cnt){
+		cnt=(totpixels-i)<CHUNK?(totpixels-i):CHUNK;
+		memcpy(s.pixels, data+((size_t)i*instride), cnt*instride);
+		qoi_quantize(s.pixels, cnt, instride, opt->tolerance);
+		ei=qoi_enc_index(s.pixels, cnt, desc->channels, opt->input, s.pixels[-1]);
+		s.px_pos=0;
+		s.pixel_cnt=cnt;
+		s=qoi_encode_block(s, cnt==CHUNK?s.bulk[ei]:s.finish[ei], s.pixels, cnt, desc->channels, opt->input);
+		memcpy(s.pixels-4, (s.pixels+(cnt*instride))-4, 4);//prev pixel
+		if(pv)
+			qoi_preview_span(pv, data+((size_t)i*instride), i, i+cnt);
+	}
+	QOI_FREE(s.pixels_alloc);
+	*sp=s;
+	return 0;
+}
+
+void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len, const options *opt) {
+	enc_state s={0};
+	qoi_preview pv, *pvp=NULL;
+	unsigned int bulk, end, worst;
+	int i, max_size, ei, instride;
+
+	if (
+		data == NULL || out_len == NULL || desc == NULL ||
+		desc->width == 0 || desc->height == 0 ||
+		desc->channels < 3 || desc->channels > 4 ||
+		desc->colorspace > 1 ||
+		desc->height >= QOI_PIXELS_MAX / desc->width ||
+		opt->preview > QOI_PREVIEW_LEVELS_MAX
+	)
+		return NULL;
+	if(!qoi_kernel_select(opt, &s))
+		return NULL;
+	QOI_TIMING_BEGIN(opt->timing);
+
+	//opaque input goes through the kernels that skip alpha and has the RGB worst case
+	instride = opt->input ? 4 : desc->channels;
+	ei = qoi_enc_index(data, desc->width * desc->height, desc->channels, opt->input, 255);
+	worst = ei==QOI_ENC_RGBA_OPAQUE || ei==QOI_ENC_BGRX ? QOI_PIXEL_WORST_CASE_OPAQUE : QOI_PIXEL_WORST_CASE;
+	max_size =
+		(opt->raw_blocks ? qoi_raw_max_size(desc->width * desc->height, desc->channels, worst) : desc->width * desc->height * worst) +
+		QOI_HEADER_SIZE + sizeof(qoi_padding);
+	if(opt->preview){
+		max_size += qoi_preview_max_size(desc, opt->preview);
+		if(qoi_preview_init(&pv, desc, opt)){
+			QOI_TIMING_END(opt->timing);
+			return NULL;
+		}
+		pvp = &pv;
+	}
+
+	if(!(s.bytes = (unsigned char *) QOI_MALLOC(max_size)))
+		goto BADEXIT0;
+	qoi_encode_init(&s, desc, opt);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
+	if(opt->tolerance){
+		if(qoi_encode_quantized(&s, data, desc, opt, pvp))
+			goto BADEXIT1;
+		QOI_TIMING_ADD(opt->timing, chunks, ((desc->width * desc->height)+CHUNK-1)/CHUNK);
+		goto FINISH;
+	}
+	s.pixels=(unsigned char *)data;
+	memset(s.pixels-4, 0, 4);
+	if(instride==4)
+		*(s.pixels-1)=255;
+	bulk=(desc->width * desc->height)-((desc->width * desc->height)%CHUNK);
+	if(bulk){//encode most of the input as the largest multiple of chunk size for simd
+		if(pvp || opt->raw_blocks){//a chunk at a time, for the box filter to read it while it is in cache and for raw blocks
+			for(end=CHUNK;end<=bulk;end+=CHUNK){
+				s.pixel_cnt=end;
+				s=qoi_encode_block(s, s.bulk[ei], (const unsigned char *)data+((size_t)(end-CHUNK)*instride), CHUNK, desc->channels, opt->input);
+				if(pvp)
+					qoi_preview_span(pvp, (const unsigned char *)data+((size_t)(end-CHUNK)*instride), end-CHUNK, end);
+			}
+		}
+		else{
+			s.pixel_cnt=bulk;
+			s=s.bulk[ei](s);
+		}
+		memcpy(s.pixels-4, (s.pixels+(CHUNK*instride))-4, 4);//prev pixel
+		QOI_TIMING_ADD(opt->timing, chunks, (desc->width * desc->height)/CHUNK);
+	}
+	if((desc->width * desc->height)%CHUNK){//encode the trailing input scalar
+		s.pixel_cnt=(desc->width * desc->height);
+		s=qoi_encode_block(s, s.finish[ei], (const unsigned char *)data+((size_t)bulk*instride), s.pixel_cnt-bulk, desc->channels, opt->input);
+		if(pvp)
+			qoi_preview_span(pvp, (const unsigned char *)data+((size_t)bulk*instride), bulk, s.pixel_cnt);
+		QOI_TIMING_ADD(opt->timing, chunks, 1);
+	}
+	FINISH:
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_KERNEL);
+	DUMP_RUN(s.run);
+	for (i = 0; i < (int)sizeof(qoi_padding); i++)
+		s.bytes[s.b++] = qoi_padding[i];
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_RUN);
+	if(pvp){
+		if(qoi_preview_finish(&s, pvp, opt))
+			goto BADEXIT1;
+		qoi_preview_free(pvp);
+	}
+	QOI_TIMING_ADD(opt->timing, bytes_in, desc->width * desc->height * instride);
+	QOI_TIMING_ADD(opt->timing, bytes_out, s.b);
+	QOI_TIMING_END(opt->timing);
+	*out_len = s.b;
+	return s.bytes;
+	BADEXIT1:
+	QOI_FREE(s.bytes);
+	BADEXIT0:
+	if(pvp)
+		qoi_preview_free(pvp);
+	QOI_TIMING_END(opt->timing);
+	return NULL;
+}
+
+//encode one pixel from a copy next to its previous pixel, for the first pixel of
+//a row whose previous pixel is elsewhere, and the last pixel of an RGB row as
+//the 3 channel kernels read a byte past it. instride is the bytes per input pixel
+static enc_state qoi_encode_seam(enc_state s, const unsigned char *prev, const unsigned char *px, unsigned int instride, int ei) {
+	unsigned char seam[9]={0};
+	memcpy(seam+4-instride, prev, instride);
+	memcpy(seam+4, px, instride);
+	s.pixels=seam+4;
+	s.px_pos=0;
+	s.pixel_cnt=1;
+	return s.finish[ei](s);
+}
+
+//encode a row in place, the kernels run from its second pixel so every pixel
+//they diff against is inside the row
+static enc_state qoi_encode_row(enc_state s, const unsigned char *row, const unsigned char *prev, unsigned int width, unsigned int channels, unsigned int input) {
+	const unsigned int instride=input?4:channels;
+	unsigned int last=instride==3?width-1:width, bulk;
+	int ei=qoi_enc_index(row, width, channels, input, instride==4?prev[3]:255);
+
+	s=qoi_encode_seam(s, prev, row, instride, ei);
+	if(width==1)
+		return s;
+	s.pixels=(unsigned char *)row;
+	bulk=((last-1)/16)*16;//pixels 1..bulk, a multiple of the simd width
+	if(bulk){
+		s.px_pos=instride;
+		s.pixel_cnt=1+bulk;
+		s=s.bulk[ei](s);
+	}
+	if((1+bulk)<last){
+		s.px_pos=(1+bulk)*instride;
+		s.pixel_cnt=last;
+		s=s.finish[ei](s);
+	}
+	if(instride==3)
+		s=qoi_encode_seam(s, row+((width-2)*3), row+((width-1)*3), 3, 0);
+	return s;
+}
+
+void *qoi_encode_strided(const void *data, int stride, const qoi_desc *desc, int *out_len, const options *opt) {
+	static const unsigned char start[4]={0, 0, 0, 255};
+	enc_state s={0}, before;
+	const unsigned char *row, *prev=start;
+	unsigned char last[4], *qrow_alloc=NULL, *qrow=NULL, *raw=NULL;
+	qoi_preview pv, *pvp=NULL;
+	unsigned int y, x, x1, rowbytes, instride, fill=0;
+	int i, max_size;
+
+	if (
+		data == NULL || out_len == NULL || desc == NULL ||
+		desc->width == 0 || desc->height == 0 ||
+		desc->channels < 3 || desc->channels > 4 ||
+		desc->colorspace > 1 ||
+		desc->height >= QOI_PIXELS_MAX / desc->width ||
+		(unsigned int)(stride<0?-stride:stride) < desc->width * (opt->input ? 4 : desc->channels) ||
+		opt->preview > QOI_PREVIEW_LEVELS_MAX
+	)
+		return NULL;
+	if(!qoi_kernel_select(opt, &s))
+		return NULL;
+	QOI_TIMING_BEGIN(opt->timing);
+
+	instride = opt->input ? 4 : desc->channels;
+	rowbytes = desc->width * instride;
+	max_size =
+		(opt->raw_blocks ? qoi_raw_max_size(desc->width * desc->height, desc->channels, QOI_PIXEL_WORST_CASE) : desc->width * desc->height * QOI_PIXEL_WORST_CASE) +
+		QOI_HEADER_SIZE + sizeof(qoi_padding);
+	if(opt->preview){
+		max_size += qoi_preview_max_size(desc, opt->preview);
+		if(qoi_preview_init(&pv, desc, opt))
+			goto BADEXIT0;
+		pvp = &pv;
+	}
+	if(!(s.bytes = (unsigned char *) QOI_MALLOC(max_size)))
+		goto BADEXIT0;
+	if(opt->tolerance){//near-lossless rewrites pixels, so quantize each row in a copy
+		if(!(qrow_alloc = QOI_MALLOC(rowbytes+65)))
+			goto BADEXIT1;
+		qrow=qrow_alloc+64;
+	}
+	if(opt->raw_blocks && !(raw = QOI_MALLOC(CHUNK*desc->channels)))//a block of stored pixels
+		goto BADEXIT2;
+	qoi_encode_init(&s, desc, opt);
+	before=s;
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
+
+	for(y=0;y<desc->height;y++){
+		row=(const unsigned char *)data+((ptrdiff_t)y*stride);
+		if(pvp)
+			qoi_preview_row(pvp, row, 0, desc->width, y);
+		if(qrow){
+			memcpy(qrow-instride, prev, instride);
+			memcpy(qrow, row, rowbytes);
+			qoi_quantize(qrow, desc->width, instride, opt->tolerance);
+			row=qrow;
+		}
+		for(x=0;x<desc->width;x=x1){//rows are split where the raw blocks of qoi_encode end
+			x1=desc->width;
+			if(raw && (x1-x)>(CHUNK-fill))
+				x1=x+(CHUNK-fill);
+			s=qoi_encode_row(s, row+(x*instride), x?row+((x-1)*instride):prev, x1-x, desc->channels, opt->input);
+			if(raw){
+				qoi_raw_store(raw+(fill*desc->channels), row+(x*instride), x1-x, desc->channels, opt->input);
+				fill+=x1-x;
+				if(fill==CHUNK){
+					s=qoi_raw_block(before, s, raw, fill, desc->channels, QOI_INPUT_RGB);
+					before=s;
+					fill=0;
+				}
+			}
+		}
+		memcpy(last, row+rowbytes-instride, instride);
+		prev=last;
+	}
+	if(fill)
+		s=qoi_raw_block(before, s, raw, fill, desc->channels, QOI_INPUT_RGB);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_KERNEL);
+	QOI_TIMING_ADD(opt->timing, chunks, desc->height);
+	DUMP_RUN(s.run);
+	for (i = 0; i < (int)sizeof(qoi_padding); i++)
+		s.bytes[s.b++] = qoi_padding[i];
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_RUN);
+	if(pvp){
+		if(qoi_preview_finish(&s, pvp, opt))
+			goto BADEXIT2;
+		qoi_preview_free(pvp);
+	}
+	QOI_TIMING_ADD(opt->timing, bytes_in, desc->width * desc->height * instride);
+	QOI_TIMING_ADD(opt->timing, bytes_out, s.b);
+	QOI_TIMING_END(opt->timing);
+	if(qrow_alloc)
+		QOI_FREE(qrow_alloc);
+	if(raw)
+		QOI_FREE(raw);
+	*out_len = s.b;
+	return s.bytes;
+	BADEXIT2:
+	if(qrow_alloc)
+		QOI_FREE(qrow_alloc);
+	if(raw)
+		QOI_FREE(raw);
+	BADEXIT1:
+	QOI_FREE(s.bytes);
+	BADEXIT0:
+	if(pvp)
+		qoi_preview_free(pvp);
+	QOI_TIMING_END(opt->timing);
+	return NULL;
+}
+
+//count the ops of pixels from..to of the image into s.b. Pixel 0 goes through a
+//seam as its previous pixel is not in memory, every other span diffs against
+//the pixel in front of it
+static enc_state qoi_size_span(enc_state s, const unsigned char *data, unsigned int from, unsigned int to, unsigned int channels) {
+	unsigned char seam[8]={0};
+	unsigned int bulk;
+	if(from==0){
+		if(channels==4)
+			seam[3]=255;
+		memcpy(seam+4, data, channels);
+		s.pixels=seam+4;
+		s.px_pos=0;
+		s.pixel_cnt=1;
+		s=size_finish[channels-3](s);
+		from=1;
+	}
+	s.pixels=(unsigned char *)data;
+	bulk=from+(((to-from)/16)*16);
+	if(bulk>from){
+		s.px_pos=from*channels;
+		s.pixel_cnt=bulk;
+		s=size_bulk[channels-3](s);
+	}
+	if(bulk<to){
+		s.px_pos=bulk*channels;
+		s.pixel_cnt=to;
+		s=size_finish[channels-3](s);
+	}
+	return s;
+}
+
+int qoi_estimate_size(const void *data, const qoi_desc *desc, int sample_rate) {
+	enc_state s={0};
+	unsigned int y, step=sample_rate>1?sample_rate:1, sampled=0;
+
+	if (
+		data == NULL || desc == NULL ||
+		desc->width == 0 || desc->height == 0 ||
+		desc->channels < 3 || desc->channels > 4 ||
+		desc->colorspace > 1 ||
+		desc->height >= QOI_PIXELS_MAX / desc->width
+	)
+		return 0;
+
+	if(step==1){
+		s=qoi_size_span(s, data, 0, desc->width * desc->height, desc->channels);
+		sampled=desc->width * desc->height;
+	}
+	else{//rows are counted on their own, a run is not carried into the next one
+		for(y=0;y<desc->height;y+=step){
+			s=qoi_size_span(s, data, y * desc->width, (y+1) * desc->width, desc->channels);
+			SIZE_RUN(s.run);
+			sampled+=desc->width;
+		}
+	}
+	SIZE_RUN(s.run);
+	return QOI_HEADER_SIZE + sizeof(qoi_padding) +
+		(int)(((unsigned long long)s.b * (desc->width * desc->height)) / sampled);
+}
+
+//read the header into desc, 1 if it describes a valid image
+static int qoi_decode_header(dec_state *s, qoi_desc *desc) {
+	unsigned int header_magic = qoi_read_32(s->bytes, &(s->b));
+	desc->width = qoi_read_32(s->bytes, &(s->b));
+	desc->height = qoi_read_32(s->bytes, &(s->b));
+	desc->channels = s->bytes[s->b++];
+	s->flags = qoi_header_flags(s->bytes[s->b++], desc);
+	return !(
+		desc->width == 0 || desc->height == 0 ||
+		desc->channels < 3 || desc->channels > 4 ||
+		desc->colorspace > 1 ||
+		header_magic != QOI_MAGIC ||
+		desc->height >= QOI_PIXELS_MAX / desc->width
+	);
+}
+
+//box filter rows (1..scale) decoded rows of width pixels in lines into one row
+//of QOI_SCALED_DIM(width, scale) pixels at out. The rows are summed down each
+//column into sums (width*channels of them) first, so the across sums only
+//touch one line
+static void qoi_scale_rows(const unsigned char *lines, unsigned int width, unsigned int rows, unsigned int channels, unsigned int scale, unsigned short *sums, unsigned char *out) {
+	const unsigned int n=width*channels, shift=scale==2?2:(scale==4?4:6);
+	unsigned int i=0, r, x, c, bw, cnt, sum;
+#ifdef QOI_SSE
+	__m128i lo, hi, v;
+	for(;(i+16)<=n;i+=16){
+		lo=hi=_mm_setzero_si128();
+		for(r=0;r<rows;r++){
+			v=_mm_loadu_si128((__m128i const*)(lines+((size_t)r*n)+i));
+			lo=_mm_add_epi16(lo, _mm_cvtepu8_epi16(v));
+			hi=_mm_add_epi16(hi, _mm_cvtepu8_epi16(_mm_srli_si128(v, 8)));
+		}
+		_mm_storeu_si128((__m128i*)(sums+i), lo);
+		_mm_storeu_si128((__m128i*)(sums+i+8), hi);
+	}
+#endif
+	for(;i<n;i++){
+		for(sum=0,r=0;r<rows;r++)
+			sum+=lines[((size_t)r*n)+i];
+		sums[i]=sum;
+	}
+	for(x=0;x<width;x+=scale){
+		bw=(width-x)<scale?width-x:scale;
+		cnt=bw*rows;
+		for(c=0;c<channels;c++){
+			for(sum=0,i=0;i<bw;i++)
+				sum+=sums[((x+i)*channels)+c];
+			*out++=cnt==scale*scale?(sum+(cnt/2))>>shift:(sum+(cnt/2))/cnt;
+		}
+	}
+}
+
+#ifdef QOI_TIMING
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
+	return qoi_decode_timed(data, size, desc, channels, NULL);
+}
+
+void *qoi_decode_timed(const void *data, int size, qoi_desc *desc, int channels, qoi_timing *timing) {
+#else
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
+#endif
+	dec_state s={0};
+
+	if (
+		data == NULL || desc == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+	)
+		return NULL;
+	QOI_TIMING_BEGIN(timing);
+
+	s.bytes=(unsigned char*)data;
+	if (!qoi_decode_header(&s, desc)){
+		QOI_TIMING_END(timing);
+		return NULL;
+	}
+
+	if (channels == 0)
+		channels = desc->channels;
+
+	s.pixel_cnt=desc->width * desc->height;
+	s.p_limit=s.pixel_cnt*channels;
+	if(!(s.pixels = QOI_MALLOC(s.p_limit))){
+		QOI_TIMING_END(timing);
+		return NULL;
+	}
+	s.b_limit=size;
+	s.b_present=size;
+	s.px.rgba.a=255;
+	QOI_TIMING_MARK(timing, QOI_TIMING_HEADER);
+
+	s=dec_arr[DEC_ARR_INDEX](s);
+	QOI_TIMING_MARK(timing, QOI_TIMING_KERNEL);
+	QOI_TIMING_ADD(timing, chunks, 1);
+	QOI_TIMING_ADD(timing, bytes_in, s.b);
+	QOI_TIMING_ADD(timing, bytes_out, s.px_pos);
+	QOI_TIMING_END(timing);
+
+	return s.pixels;
+}
+
+void *qoi_decode_scaled(const void *data, int size, qoi_desc *desc, int channels, int scale) {
+	dec_state s={0};
+	unsigned char *out, *lines;
+	unsigned short *sums;
+	unsigned int y, rows, ow, rowbytes;
+
+	if (scale == 1)
+		return qoi_decode(data, size, desc, channels);
+	if (
+		data == NULL || desc == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		(scale != 2 && scale != 4 && scale != 8) ||
+		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+	)
+		return NULL;
+
+	s.bytes=(unsigned char*)data;
+	if (!qoi_decode_header(&s, desc))
+		return NULL;
+	if (channels == 0)
+		channels = desc->channels;
+
+	ow=QOI_SCALED_DIM(desc->width, scale);
+	rowbytes=desc->width*channels;
+	if(!(out=QOI_MALLOC((size_t)ow*QOI_SCALED_DIM(desc->height, scale)*channels)))
+		return NULL;
+	if(!(lines=QOI_MALLOC((size_t)rowbytes*scale))){
+		QOI_FREE(out);
+		return NULL;
+	}
+	if(!(sums=QOI_MALLOC(rowbytes*sizeof(unsigned short)))){
+		QOI_FREE(lines);
+		QOI_FREE(out);
+		return NULL;
+	}
+	s.pixels=lines;
+	s.pixel_cnt=desc->width * desc->height;
+	s.b_limit=size;
+	s.b_present=size;
+	s.px.rgba.a=255;
+	for(y=0;y<desc->height;y+=scale){
+		rows=(desc->height-y)<(unsigned int)scale?desc->height-y:(unsigned int)scale;
+		s.px_pos=0;
+		s.p_limit=rows*rowbytes;
+		s=dec_arr[DEC_ARR_INDEX](s);
+		if(s.px_pos<s.p_limit)//truncated input
+			memset(lines+s.px_pos, 0, s.p_limit-s.px_pos);
+		qoi_scale_rows(lines, desc->width, rows, channels, scale, sums, out+((size_t)(y/scale)*ow*channels));
+	}
+	QOI_FREE(sums);
+	QOI_FREE(lines);
+	desc->width=ow;
+	desc->height=QOI_SCALED_DIM(desc->height, scale);
+	return out;
+}
+
+//rows decoded at a time for orientations 5..8, also the tile width. 32 rows
+//fill whole cache lines of the output rows for RGB too
+#define QOI_ORIENT_STRIP 32
+//one pixel, with a constant size so it is not a call
+#define QOI_ORIENT_COPY(dst, src, channels) do{ \
+	if((channels)==4) \
+		memcpy((dst), (src), 4); \
+	else \
+		memcpy((dst), (src), 3); \
+}while(0)
+
+//row of width pixels from row into out in reverse order
+static void qoi_orient_mirror(const unsigned char *row, unsigned int width, unsigned int channels, unsigned char *out) {
+	unsigned int x=0;
+	const unsigned char *px=row+((size_t)width*channels);
+#ifdef QOI_SSE
+	if(channels==4){
+		for(;(x+4)<=width;x+=4,px-=16)
+			_mm_storeu_si128((__m128i*)(out+(x*4)), _mm_shuffle_epi32(_mm_loadu_si128((__m128i const*)(px-16)), 0x1b));
+	}
+#endif
+	for(;x<width;x++){
+		px-=channels;
+		QOI_ORIENT_COPY(out+(x*channels), px, channels);
+	}
+}
+
+//rows rows of width pixels, input rows y0.., into out turned by orientation
+//5..8. The output is height pixels wide, input column x goes to output row x
+//(5, 6) or width-1-x (7, 8) and input row y to output column y (5, 8) or
+//height-1-y (6, 7). Each output row gets rows pixels in a row, RGBA through
+//4x4 transposes
+static void qoi_orient_strip(const unsigned char *strip, unsigned int width, unsigned int height, unsigned int y0, unsigned int rows, unsigned int channels, int orientation, unsigned char *out) {
+	const int flipx=orientation==6 || orientation==7, flipy=orientation==7 || orientation==8;
+	const size_t inrow=(size_t)width*channels, outrow=(size_t)height*channels;
+	unsigned int x0, x, r, x1;
+	unsigned char *orow;
+	for(x0=0;x0<width;x0+=QOI_ORIENT_STRIP){
+		x1=(width-x0)<QOI_ORIENT_STRIP?width:x0+QOI_ORIENT_STRIP;
+		x=x0;
+#ifdef QOI_SSE
+		if(channels==4 && rows%4==0){
+			for(;(x+4)<=x1;x+=4){
+				for(r=0;r<rows;r+=4){
+					const unsigned char *in=strip+(r*inrow)+(x*4);
+					__m128 r0=_mm_castsi128_ps(_mm_loadu_si128((__m128i const*)in));
+					__m128 r1=_mm_castsi128_ps(_mm_loadu_si128((__m128i const*)(in+inrow)));
+					__m128 r2=_mm_castsi128_ps(_mm_loadu_si128((__m128i const*)(in+(2*inrow))));
+					__m128 r3=_mm_castsi128_ps(_mm_loadu_si128((__m128i const*)(in+(3*inrow))));
+					__m128i c[4];
+					unsigned int i, col=flipx?height-1-(y0+r+3):y0+r;
+					_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+					c[0]=_mm_castps_si128(r0);
+					c[1]=_mm_castps_si128(r1);
+					c[2]=_mm_castps_si128(r2);
+					c[3]=_mm_castps_si128(r3);
+					for(i=0;i<4;i++){
+						orow=out+((flipy?width-1-(x+i):x+i)*outrow);
+						_mm_storeu_si128((__m128i*)(orow+(col*4)), flipx?_mm_shuffle_epi32(c[i], 0x1b):c[i]);
+					}
+				}
+			}
+		}
+#endif
+		for(;x<x1;x++){
+			orow=out+((flipy?width-1-x:x)*outrow);
+			for(r=0;r<rows;r++)
+				QOI_ORIENT_COPY(orow+((flipx?height-1-(y0+r):y0+r)*channels), strip+(r*inrow)+(x*channels), channels);
+		}
+	}
+}
+
+void *qoi_decode_oriented(const void *data, int size, qoi_desc *desc, int channels, int orientation) {
+	dec_state s={0};
+	unsigned char *out, *buf=NULL;
+	unsigned int y, rows, step, rowbytes, t;
+
+	if (orientation <= 1)
+		return qoi_decode(data, size, desc, channels);
+	if (
+		data == NULL || desc == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		orientation > 8 ||
+		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+	)
+		return NULL;
+
+	s.bytes=(unsigned char*)data;
+	if (!qoi_decode_header(&s, desc))
+		return NULL;
+	if (channels == 0)
+		channels = desc->channels;
+
+	rowbytes=desc->width*channels;
+	step=orientation>=5?QOI_ORIENT_STRIP:1;
+	if(!(out=QOI_MALLOC((size_t)rowbytes*desc->height)))
+		return NULL;
+	if(orientation!=4 && !(buf=QOI_MALLOC((size_t)rowbytes*step))){
+		QOI_FREE(out);
+		return NULL;
+	}
+	s.pixel_cnt=desc->width * desc->height;
+	s.b_limit=size;
+	s.b_present=size;
+	s.px.rgba.a=255;
+	for(y=0;y<desc->height;y+=step){
+		rows=(desc->height-y)<step?desc->height-y:step;
+		s.pixels=orientation==4?out+((size_t)(desc->height-1-y)*rowbytes):buf;//a flip is decoded in place
+		s.px_pos=0;
+		s.p_limit=rows*rowbytes;
+		s=dec_arr[DEC_ARR_INDEX](s);
+		if(s.px_pos<s.p_limit)//truncated input
+			memset(s.pixels+s.px_pos, 0, s.p_limit-s.px_pos);
+		if(orientation==2 || orientation==3)
+			qoi_orient_mirror(buf, desc->width, channels, out+((size_t)(orientation==3?desc->height-1-y:y)*rowbytes));
+		else if(orientation>=5)
+			qoi_orient_strip(buf, desc->width, desc->height, y, rows, channels, orientation, out);
+	}
+	if(buf)
+		QOI_FREE(buf);
+	if(orientation>=5){
+		t=desc->width;
+		desc->width=desc->height;
+		desc->height=t;
+	}
+	return out;
+}
+
+int qoi_preview_levels(const void *data, int size) {
+	unsigned int offs[QOI_PREVIEW_LEVELS_MAX+1];
+	if(data == NULL || size <= 0)
+		return 0;
+	return qoi_preview_index((const unsigned char *)data+size, size, size, offs);
+}
+
+void *qoi_decode_preview(const void *data, int size, qoi_desc *desc, int channels, int level) {
+	unsigned int offs[QOI_PREVIEW_LEVELS_MAX+1];
+	int levels;
+	if(data == NULL || size <= 0 || level < 0)
+		return NULL;
+	levels=qoi_preview_index((const unsigned char *)data+size, size, size, offs);
+	if(level > levels)
+		return NULL;
+	if(!levels)
+		return qoi_decode(data, size, desc, channels);
+	return qoi_decode((const unsigned char *)data+(level ? offs[level-1] : 0), offs[level]-(level ? offs[level-1] : 0), desc, channels);
 }
 
-void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len, const options *opt) {
+struct qoi_enc_stream {
+	enc_state s;
+	qoi_desc desc;
+	qoi_stream_write write;
+	void *user;
+	unsigned int fill, done, totpixels;
+	int tolerance;
+};
+
+qoi_enc_stream *qoi_enc_stream_open(const qoi_desc *desc, const options *opt, qoi_stream_write write, void *user) {
+	qoi_enc_stream *es;
 	enc_state s={0};
-	int i, max_size;
 
 	if (
-		data == NULL || out_len == NULL || desc == NULL ||
+		desc == NULL || write == NULL ||
 		desc->width == 0 || desc->height == 0 ||
 		desc->channels < 3 || desc->channels > 4 ||
 		desc->colorspace > 1 ||
 		desc->height >= QOI_PIXELS_MAX / desc->width
 	)
 		return NULL;
-#ifdef ROI
-	if(opt->mlut){
-		enc_finish[0]=qoi_encode_chunk3_mlut;
-		enc_finish[1]=qoi_encode_chunk4_mlut;
-#ifdef QOI_SCALAR
-		enc_bulk[0]=qoi_encode_chunk3_mlut;
-		enc_bulk[1]=qoi_encode_chunk4_mlut;
-#endif
-	}
-#else
-	UNUSED(opt);
-#endif
-
-	max_size =
-		desc->width * desc->height * QOI_PIXEL_WORST_CASE +
-		QOI_HEADER_SIZE + sizeof(qoi_padding);
-
-	if(!(s.bytes = (unsigned char *) QOI_MALLOC(max_size)))
+	if(opt->input!=QOI_INPUT_RGB || opt->preview || !qoi_kernel_select(opt, &s))
 		return NULL;
-	s.pixels=(unsigned char *)data;
-	memset(s.pixels-4, 0, 4);
+
+	if(!(es=QOI_MALLOC(sizeof(qoi_enc_stream))))
+		goto BADEXIT0;
+	if(!(s.pixels_alloc=QOI_MALLOC((CHUNK*desc->channels)+65)))
+		goto BADEXIT1;
+	memset(s.pixels_alloc, 0, 64);
 	if(desc->channels==4)
-		*(s.pixels-1)=255;
-	qoi_encode_init(desc, s.bytes, &(s.b));
-	if((desc->width * desc->height)/CHUNK){//encode most of the input as the largest multiple of chunk size for simd
-		s.pixel_cnt=(desc->width * desc->height)-((desc->width * desc->height)%CHUNK);
-		s=enc_bulk[desc->channels-3](s);
-		memcpy(s.pixels-4, (s.pixels+(CHUNK*desc->channels))-4, 4);//prev pixel
-	}
-	if((desc->width * desc->height)%CHUNK){//encode the trailing input scalar
-		s.pixel_cnt=(desc->width * desc->height);
-		s=enc_finish[desc->channels-3](s);
+		s.pixels_alloc[63]=255;
+	s.pixels=s.pixels_alloc+64;
+	if(!(s.bytes=QOI_MALLOC((CHUNK*QOI_PIXEL_WORST_CASE)+1+QOI_VARINT_MAX)))//and a run ending in the chunk
+		goto BADEXIT2;
+
+	qoi_encode_init(&s, desc, opt);
+	if(s.b!=write(user, s.bytes, s.b))
+		goto BADEXIT3;
+
+	es->s=s;
+	es->desc=*desc;
+	es->write=write;
+	es->user=user;
+	es->fill=0;
+	es->done=0;
+	es->totpixels=desc->width*desc->height;
+	es->tolerance=opt->tolerance;
+	return es;
+	BADEXIT3:
+	QOI_FREE(s.bytes);
+	BADEXIT2:
+	QOI_FREE(s.pixels_alloc);
+	BADEXIT1:
+	QOI_FREE(es);
+	BADEXIT0:
+	return NULL;
+}
+
+unsigned char *qoi_enc_stream_buffer(qoi_enc_stream *es, unsigned int *count) {
+	unsigned int left=es->totpixels-es->done-es->fill;
+	*count=CHUNK-es->fill;
+	if(left<*count)
+		*count=left;
+	return *count?es->s.pixels+(es->fill*es->desc.channels):NULL;
+}
+
+int qoi_enc_stream_commit(qoi_enc_stream *es, unsigned int count) {
+	enc_state s;
+	const unsigned int channels=es->desc.channels;
+
+	es->fill+=count;
+	if(es->fill!=CHUNK)
+		return 0;
+	s=es->s;
+	if(es->tolerance)
+		qoi_quantize(s.pixels, CHUNK, channels, es->tolerance);
+	s.b=0;
+	s.px_pos=0;
+	s.pixel_cnt=CHUNK;
+	s=qoi_encode_block(s, s.bulk[qoi_enc_index(s.pixels, CHUNK, channels, QOI_INPUT_RGB, s.pixels[-1])], s.pixels, CHUNK, channels, QOI_INPUT_RGB);
+	memcpy(s.pixels-4, (s.pixels+(CHUNK*channels))-4, 4);//prev pixel
+	es->s=s;
+	es->done+=CHUNK;
+	es->fill=0;
+	return s.b!=es->write(es->user, s.bytes, s.b);
+}
+
+int qoi_enc_stream_close(qoi_enc_stream *es) {
+	enc_state s=es->s;
+	int err=0;
+
+	if(es->fill){//finish scalar
+		if(es->tolerance)
+			qoi_quantize(s.pixels, es->fill, es->desc.channels, es->tolerance);
+		s.b=0;
+		s.px_pos=0;
+		s.pixel_cnt=es->fill;
+		s=qoi_encode_block(s, s.finish[qoi_enc_index(s.pixels, es->fill, es->desc.channels, QOI_INPUT_RGB, s.pixels[-1])], s.pixels, es->fill, es->desc.channels, QOI_INPUT_RGB);
+		err|=s.b!=es->write(es->user, s.bytes, s.b);
+		es->done+=es->fill;
 	}
+	s.b=0;
 	DUMP_RUN(s.run);
-	for (i = 0; i < (int)sizeof(qoi_padding); i++)
-		s.bytes[s.b++] = qoi_padding[i];
-	*out_len = s.b;
-	return s.bytes;
+	memcpy(s.bytes+s.b, qoi_padding, sizeof(qoi_padding));
+	s.b+=sizeof(qoi_padding);
+	err|=s.b!=es->write(es->user, s.bytes, s.b);
+	err|=es->done!=es->totpixels;
+
+	QOI_FREE(s.bytes);
+	QOI_FREE(s.pixels_alloc);
+	QOI_FREE(es);
+	return err;
 }
 
-void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
-	unsigned int header_magic;
+struct qoi_dec_stream {
+	dec_state s;
+	qoi_desc desc;
+	int channels;
+	qoi_stream_read read;
+	void *user;
+};
+
+qoi_dec_stream *qoi_dec_stream_open(qoi_desc *desc, int channels, qoi_stream_read read, void *user) {
+	qoi_dec_stream *ds;
 	dec_state s={0};
+	unsigned char head[QOI_HEADER_SIZE];
+	unsigned int p=0, header_magic;
 
 	if (
-		data == NULL || desc == NULL ||
-		(channels != 0 && channels != 3 && channels != 4) ||
-		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+		desc == NULL || read == NULL ||
+		(channels != 0 && channels != 3 && channels != 4)
 	)
 		return NULL;
 
-	s.bytes=(unsigned char*)data;
-
-	header_magic = qoi_read_32(s.bytes, &(s.b));
-	desc->width = qoi_read_32(s.bytes, &(s.b));
-	desc->height = qoi_read_32(s.bytes, &(s.b));
-	desc->channels = s.bytes[s.b++];
-	desc->colorspace = s.bytes[s.b++];
-
+	if(QOI_HEADER_SIZE!=read(user, head, QOI_HEADER_SIZE))
+		return NULL;
+	header_magic = qoi_read_32(head, &p);
+	desc->width = qoi_read_32(head, &p);
+	desc->height = qoi_read_32(head, &p);
+	desc->channels = head[p++];
+	s.flags = qoi_header_flags(head[p++], desc);
 	if (
 		desc->width == 0 || desc->height == 0 ||
 		desc->channels < 3 || desc->channels > 4 ||
@@ -329,22 +2032,152 @@ void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
 	if (channels == 0)
 		channels = desc->channels;
 
-	s.pixel_cnt=desc->width * desc->height;
-	s.p_limit=s.pixel_cnt*channels;
-	if(!(s.pixels = QOI_MALLOC(s.p_limit)))
+	if(!(ds=QOI_MALLOC(sizeof(qoi_dec_stream))))
 		return NULL;
-	s.b_limit=size;
-	s.b_present=size;
+	s.b_limit=CHUNK*(desc->channels==3?2:3);
+	if(!(s.bytes=QOI_MALLOC(s.b_limit))){
+		QOI_FREE(ds);
+		return NULL;
+	}
 	s.px.rgba.a=255;
+	s.pixel_cnt=desc->width*desc->height;
 
-	s=dec_arr[DEC_ARR_INDEX](s);
+	ds->s=s;
+	ds->desc=*desc;
+	ds->channels=channels;
+	ds->read=read;
+	ds->user=user;
+	return ds;
+}
 
-	return s.pixels;
+unsigned int qoi_dec_stream_read(qoi_dec_stream *ds, void *pixels, unsigned int count) {
+	dec_state s=ds->s;
+	const qoi_desc *desc=&(ds->desc);
+	const int channels=ds->channels;
+	unsigned int got, px_prev;
+
+	s.pixels=pixels;
+	s.px_pos=0;
+	s.p_limit=count*channels;
+	while(s.px_pos!=s.p_limit && s.pixel_curr!=s.pixel_cnt){
+		got=ds->read(ds->user, s.bytes+s.b_present, s.b_limit-s.b_present);
+		s.b_present+=got;
+		px_prev=s.px_pos;
+		s=dec_arr[DEC_ARR_INDEX](s);
+		memmove(s.bytes, s.bytes+s.b, s.b_present-s.b);
+		s.b_present-=s.b;
+		s.b=0;
+		if(!got && s.px_pos==px_prev)//truncated input
+			break;
+	}
+	ds->s=s;
+	return s.px_pos/channels;
+}
+
+int qoi_dec_stream_close(qoi_dec_stream *ds) {
+	int err=ds->s.pixel_curr!=ds->s.pixel_cnt;
+	QOI_FREE(ds->s.bytes);
+	QOI_FREE(ds);
+	return err;
+}
+
+#define QOI_ARCHIVE_MAGIC EXT_STR "a"
+#define QOI_ARCHIVE_VERSION 1
+#define QOI_ARCHIVE_HEADER_SIZE 64
+#define QOI_ARCHIVE_INDEX_SIZE 32
+#define QOI_ARCHIVE_ALIGN 64
+
+static unsigned int qoi_le_32(const unsigned char *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static unsigned long long qoi_le_64(const unsigned char *p) {
+	return qoi_le_32(p) | (unsigned long long)qoi_le_32(p+4) << 32;
+}
+
+int qoi_archive_open(qoi_archive *ar, const void *data, size_t size) {
+	const unsigned char *h=data;
+	unsigned long long index, names, names_size;
+	if(
+		ar == NULL || data == NULL || size < QOI_ARCHIVE_HEADER_SIZE ||
+		memcmp(h, QOI_ARCHIVE_MAGIC, 4) ||
+		qoi_le_32(h+4) != QOI_ARCHIVE_VERSION
+	)
+		return 0;
+	ar->count=qoi_le_32(h+8);
+	index=qoi_le_64(h+16);
+	names=qoi_le_64(h+24);
+	names_size=qoi_le_64(h+32);
+	if(
+		index > size || (size-index)/QOI_ARCHIVE_INDEX_SIZE < ar->count ||
+		names > size || size-names < names_size
+	)
+		return 0;
+	ar->data=h;
+	ar->size=size;
+	ar->index=h+index;
+	ar->names=h+names;
+	ar->names_size=names_size;
+	return 1;
+}
+
+//name of index entry e, NULL if it is not a NUL terminated string inside the names
+static const char *qoi_archive_name(const qoi_archive *ar, const unsigned char *e, unsigned int *len) {
+	unsigned int name=qoi_le_32(e+20);
+	*len=e[24] | e[25] << 8;
+	if(name >= ar->names_size || ar->names_size-name <= *len || ar->names[name+*len])
+		return NULL;
+	return (const char *)ar->names+name;
+}
+
+int qoi_archive_find(const qoi_archive *ar, const char *name) {
+	unsigned int lo=0, hi=ar->count, mid, len;
+	const char *entry;
+	int cmp;
+	while(lo<hi){
+		mid=lo+((hi-lo)/2);
+		if(!(entry=qoi_archive_name(ar, ar->index+((size_t)mid*QOI_ARCHIVE_INDEX_SIZE), &len)))
+			return -1;
+		if(!(cmp=strcmp(name, entry)))
+			return mid;
+		if(cmp<0)
+			hi=mid;
+		else
+			lo=mid+1;
+	}
+	return -1;
+}
+
+int qoi_archive_get(const qoi_archive *ar, unsigned int i, qoi_archive_entry *entry) {
+	const unsigned char *e;
+	unsigned long long offset;
+	unsigned int size;
+	if(i >= ar->count)
+		return 0;
+	e=ar->index+((size_t)i*QOI_ARCHIVE_INDEX_SIZE);
+	offset=qoi_le_64(e);
+	size=qoi_le_32(e+8);
+	if(offset > ar->size || ar->size-offset < size || size > 0x7fffffff)
+		return 0;
+	if(!(entry->name=qoi_archive_name(ar, e, &entry->name_len)))
+		return 0;
+	entry->data=ar->data+offset;
+	entry->size=size;
+	entry->desc.width=qoi_le_32(e+12);
+	entry->desc.height=qoi_le_32(e+16);
+	entry->desc.channels=e[26];
+	entry->desc.colorspace=e[27];
+	return 1;
 }
 
 #ifndef QOI_NO_STDIO
 #include <stdio.h>
 
+#ifndef QOI_FREAD
+	#define QOI_FREAD(p, sz, n, f)  fread(p, sz, n, f)
+	#define QOI_FWRITE(p, sz, n, f) fwrite(p, sz, n, f)
+#endif
+
 static inline FILE* qoi_fopen(const char *path, const char *mode){
 	if(0==strcmp(path, "-"))
 		return *mode=='r'?stdin:stdout;
@@ -358,71 +2191,121 @@ static inline void qoi_fclose(const char *path, FILE *stream){
 }
 
 //decode to a format that contains raw pixels in RGB/A
-static int qoi_read_to_file(FILE *fi, const char *out_f, char *head, size_t head_len, qoi_desc *desc, int channels, const options *opt){
+//with options.scale the pixels are decoded scale rows at a time and each group
+//is written reduced to one row
+static int qoi_read_to_file(FILE *fi, const char *out_f, char *head, size_t head_len, qoi_desc *desc, unsigned int flags, int channels, const options *opt){
 	dec_state s={0};
 	FILE *fo;
-	UNUSED(opt);
+	unsigned char *out=NULL;
+	unsigned short *sums=NULL;
+	unsigned int scale=opt->scale>1?opt->scale:1, rowbytes=desc->width*channels, out_len, px_prev;
+	QOI_TIMING_BEGIN(opt->timing);
 
 	if(
 		desc->width==0 || desc->height==0 ||
 		desc->channels<3 || desc->channels>4 ||
-		desc->colorspace>1
+		desc->colorspace>1 ||
+		(scale!=1 && scale!=2 && scale!=4 && scale!=8) ||
+		opt->orientation>1 ||
+		desc->height >= QOI_PIXELS_MAX / desc->width
 	)
 		goto BADEXIT0;
 
 	if(!(fo=qoi_fopen(out_f, "wb")))
 		goto BADEXIT0;
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
 
 	if(head_len){
-		if(head_len!=fwrite(head, 1, head_len, fo))
+		if(head_len!=QOI_FWRITE(head, 1, head_len, fo))
 			goto BADEXIT1;
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
+		QOI_TIMING_ADD(opt->timing, bytes_out, head_len);
 	}
 
 	s.b_limit=CHUNK*(desc->channels==3?2:3);
 	if(!(s.bytes=QOI_MALLOC(s.b_limit)))
 		goto BADEXIT1;
-	s.p_limit=CHUNK*channels;
+	s.p_limit=scale==1?(unsigned int)CHUNK*channels:rowbytes*scale;
 	if(!(s.pixels=QOI_MALLOC(s.p_limit)))
 		goto BADEXIT2;
+	if(scale!=1){
+		if(!(sums=QOI_MALLOC(rowbytes*sizeof(unsigned short))) || !(out=QOI_MALLOC(QOI_SCALED_DIM(desc->width, scale)*channels)))
+			goto BADEXIT3;
+	}
 	s.px.rgba.a=255;
 	s.pixel_cnt=desc->width*desc->height;
+	s.flags=flags;
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
 	while(s.pixel_curr!=s.pixel_cnt){
-		s.b_present+=fread(s.bytes+s.b_present, 1, s.b_limit-s.b_present, fi);
+		if(scale!=1 && !s.px_pos)//the next group of rows, short at the bottom
+			s.p_limit=(desc->height-(s.pixel_curr/desc->width))<scale?(desc->height-(s.pixel_curr/desc->width))*rowbytes:scale*rowbytes;
+		s.b_present+=QOI_FREAD(s.bytes+s.b_present, 1, s.b_limit-s.b_present, fi);
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_READ);
+		px_prev=s.px_pos;
 		s=dec_arr[DEC_ARR_INDEX](s);
-		if(!s.px_pos)//truncated input
-			goto BADEXIT3;
-		if(s.px_pos!=fwrite(s.pixels, 1, s.px_pos, fo))
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_KERNEL);
+		QOI_TIMING_ADD(opt->timing, chunks, 1);
+		if(s.px_pos==px_prev)//truncated input
 			goto BADEXIT3;
+		QOI_TIMING_ADD(opt->timing, bytes_in, s.b);
 		memmove(s.bytes, s.bytes+s.b, s.b_present-s.b);
 		s.b_present-=s.b;
 		s.b=0;
+		if(scale!=1){
+			if(s.px_pos!=s.p_limit)//rows of this group still to come
+				continue;
+			qoi_scale_rows(s.pixels, desc->width, s.p_limit/rowbytes, channels, scale, sums, out);
+			out_len=QOI_SCALED_DIM(desc->width, scale)*channels;
+			if(out_len!=QOI_FWRITE(out, 1, out_len, fo))
+				goto BADEXIT3;
+		}
+		else{
+			out_len=s.px_pos;
+			if(out_len!=QOI_FWRITE(s.pixels, 1, out_len, fo))
+				goto BADEXIT3;
+		}
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
+		QOI_TIMING_ADD(opt->timing, bytes_out, out_len);
 		s.px_pos=0;
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_READ);
 	}
 
+	if(out){
+		QOI_FREE(out);
+		QOI_FREE(sums);
+	}
 	QOI_FREE(s.pixels);
 	QOI_FREE(s.bytes);
 	qoi_fclose(out_f, fo);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
+	QOI_TIMING_END(opt->timing);
 	return 0;
 	BADEXIT3:
+	if(out)
+		QOI_FREE(out);
+	if(sums)
+		QOI_FREE(sums);
 	QOI_FREE(s.pixels);
 	BADEXIT2:
 	QOI_FREE(s.bytes);
 	BADEXIT1:
 	qoi_fclose(out_f, fo);
 	BADEXIT0:
+	QOI_TIMING_END(opt->timing);
 	return 1;
 }
 
-static int file_to_desc(FILE *fi, qoi_desc *desc){
+//the QOI_FLAG_* of the header go to flags
+static int file_to_desc(FILE *fi, qoi_desc *desc, unsigned int *flags){
 	unsigned char head[14];
-	if(14!=fread(head, 1, 14, fi))
+	if(14!=QOI_FREAD(head, 1, 14, fi))
 		return 1;
 	if(QOI_MAGIC!=(head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3]))
 		return 1;
 	desc->width = head[4] << 24 | head[5] << 16 | head[6] << 8 | head[7];
 	desc->height = head[8] << 24 | head[9] << 16 | head[10] << 8 | head[11];
 	desc->channels = head[12];
-	desc->colorspace = head[13];
+	*flags = qoi_header_flags(head[13], desc);
 	return 0;
 }
 
@@ -430,21 +2313,27 @@ int qoi_read_to_pam(const char *qoi_f, const char *pam_f, const options *opt) {
 	char head[128];
 	FILE *fi;
 	qoi_desc desc;
+	unsigned int flags;
+	QOI_TIMING_BEGIN(opt->timing);
 	if(!(fi=qoi_fopen(qoi_f, "rb")))
 		goto BADEXIT0;
-	if(file_to_desc(fi, &desc))
+	if(file_to_desc(fi, &desc, &flags))
 		goto BADEXIT1;
+	QOI_TIMING_ADD(opt->timing, bytes_in, QOI_HEADER_SIZE);
 
-	sprintf(head, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE RGB%s\nENDHDR\n", desc.width, desc.height, desc.channels, desc.channels==3?"":"_ALPHA");
+	sprintf(head, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE RGB%s\nENDHDR\n", QOI_SCALED_DIM(desc.width, opt->scale>1?opt->scale:1), QOI_SCALED_DIM(desc.height, opt->scale>1?opt->scale:1), desc.channels, desc.channels==3?"":"_ALPHA");
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
 
-	if(qoi_read_to_file(fi, pam_f, head, strlen(head), &desc, desc.channels, opt))
+	if(qoi_read_to_file(fi, pam_f, head, strlen(head), &desc, flags, desc.channels, opt))
 		goto BADEXIT1;
 
 	qoi_fclose(qoi_f, fi);
+	QOI_TIMING_END(opt->timing);
 	return 0;
 	BADEXIT1:
 	qoi_fclose(qoi_f, fi);
 	BADEXIT0:
+	QOI_TIMING_END(opt->timing);
 	return 1;
 }
 
@@ -452,20 +2341,26 @@ int qoi_read_to_ppm(const char *qoi_f, const char *ppm_f, const options *opt) {
 	char head[128];
 	FILE *fi;
 	qoi_desc desc;
+	unsigned int flags;
+	QOI_TIMING_BEGIN(opt->timing);
 	if(!(fi=qoi_fopen(qoi_f, "rb")))
 		goto BADEXIT0;
-	if(file_to_desc(fi, &desc))
+	if(file_to_desc(fi, &desc, &flags))
 		goto BADEXIT1;
+	QOI_TIMING_ADD(opt->timing, bytes_in, QOI_HEADER_SIZE);
 
-	sprintf(head, "P6 %u %u 255\n", desc.width, desc.height);
-	if(qoi_read_to_file(fi, ppm_f, head, strlen(head), &desc, 3, opt))
+	sprintf(head, "P6 %u %u 255\n", QOI_SCALED_DIM(desc.width, opt->scale>1?opt->scale:1), QOI_SCALED_DIM(desc.height, opt->scale>1?opt->scale:1));
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
+	if(qoi_read_to_file(fi, ppm_f, head, strlen(head), &desc, flags, 3, opt))
 		goto BADEXIT1;
 
 	qoi_fclose(qoi_f, fi);
+	QOI_TIMING_END(opt->timing);
 	return 0;
 	BADEXIT1:
 	qoi_fclose(qoi_f, fi);
 	BADEXIT0:
+	QOI_TIMING_END(opt->timing);
 	return 1;
 }
 
@@ -474,7 +2369,11 @@ static inline int qoi_write_from_file(FILE *fi, const char *qoi_f, qoi_desc *des
 	enc_state s={0};
 	FILE *fo;
 	unsigned int i, totpixels;
+	QOI_TIMING_BEGIN(opt->timing);
 
+	//refused before anything is written, like qoi_enc_stream_open
+	if(opt->input!=QOI_INPUT_RGB || opt->preview || !qoi_kernel_select(opt, &s))
+		goto BADEXIT0;
 	if(!(fo=qoi_fopen(qoi_f, "wb")))
 		goto BADEXIT0;
 
@@ -484,58 +2383,68 @@ static inline int qoi_write_from_file(FILE *fi, const char *qoi_f, qoi_desc *des
 	if(desc->channels==4)
 		s.pixels_alloc[63]=255;
 	s.pixels=s.pixels_alloc+64;
-	if(!(s.bytes=QOI_MALLOC(CHUNK*QOI_PIXEL_WORST_CASE)))
+	if(!(s.bytes=QOI_MALLOC((CHUNK*QOI_PIXEL_WORST_CASE)+1+QOI_VARINT_MAX)))//and a run ending in the chunk
 		goto BADEXIT2;
 
-	qoi_encode_init(desc, s.bytes, &(s.b));
-	if(s.b!=fwrite(s.bytes, 1, s.b, fo))
+	qoi_encode_init(&s, desc, opt);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
+	if(s.b!=QOI_FWRITE(s.bytes, 1, s.b, fo))
 		goto BADEXIT3;
-
-#ifdef ROI
-	if(opt->mlut){
-		enc_finish[0]=qoi_encode_chunk3_mlut;
-		enc_finish[1]=qoi_encode_chunk4_mlut;
-#ifdef QOI_SCALAR
-		enc_bulk[0]=qoi_encode_chunk3_mlut;
-		enc_bulk[1]=qoi_encode_chunk4_mlut;
-#endif
-	}
-#else
-	UNUSED(opt);
-#endif
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
+	QOI_TIMING_ADD(opt->timing, bytes_out, s.b);
 
 	totpixels=desc->width*desc->height;
 	s.pixel_cnt=CHUNK;
 	for(i=0;(i+CHUNK)<=totpixels;i+=CHUNK){
-		if((CHUNK*desc->channels)!=fread(s.pixels, 1, CHUNK*desc->channels, fi))
+		if((CHUNK*desc->channels)!=QOI_FREAD(s.pixels, 1, CHUNK*desc->channels, fi))
 			goto BADEXIT3;
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_READ);
+		if(opt->tolerance)
+			qoi_quantize(s.pixels, CHUNK, desc->channels, opt->tolerance);
 		s.b=0;
 		s.px_pos=0;
-		s=enc_bulk[desc->channels-3](s);
-		if(s.b!=fwrite(s.bytes, 1, s.b, fo))
+		s=qoi_encode_block(s, s.bulk[qoi_enc_index(s.pixels, CHUNK, desc->channels, QOI_INPUT_RGB, s.pixels[-1])], s.pixels, CHUNK, desc->channels, QOI_INPUT_RGB);
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_KERNEL);
+		if(s.b!=QOI_FWRITE(s.bytes, 1, s.b, fo))
 			goto BADEXIT3;
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
+		QOI_TIMING_ADD(opt->timing, chunks, 1);
+		QOI_TIMING_ADD(opt->timing, bytes_in, CHUNK*desc->channels);
+		QOI_TIMING_ADD(opt->timing, bytes_out, s.b);
 		memcpy(s.pixels-4, (s.pixels+(CHUNK*desc->channels))-4, 4);//prev pixel
 	}
 	if(i<totpixels){//finish scalar
-		if(((totpixels-i)*desc->channels)!=fread(s.pixels, 1, (totpixels-i)*desc->channels, fi))
+		if(((totpixels-i)*desc->channels)!=QOI_FREAD(s.pixels, 1, (totpixels-i)*desc->channels, fi))
 			goto BADEXIT3;
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_READ);
+		if(opt->tolerance)
+			qoi_quantize(s.pixels, totpixels-i, desc->channels, opt->tolerance);
 		s.b=0;
 		s.px_pos=0;
 		s.pixel_cnt=totpixels-i;
-		s=enc_finish[desc->channels-3](s);
-		if(s.b!=fwrite(s.bytes, 1, s.b, fo))
+		s=qoi_encode_block(s, s.finish[qoi_enc_index(s.pixels, totpixels-i, desc->channels, QOI_INPUT_RGB, s.pixels[-1])], s.pixels, totpixels-i, desc->channels, QOI_INPUT_RGB);
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_KERNEL);
+		if(s.b!=QOI_FWRITE(s.bytes, 1, s.b, fo))
 			goto BADEXIT3;
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
+		QOI_TIMING_ADD(opt->timing, chunks, 1);
+		QOI_TIMING_ADD(opt->timing, bytes_in, (totpixels-i)*desc->channels);
+		QOI_TIMING_ADD(opt->timing, bytes_out, s.b);
 	}
 	s.b=0;
 	DUMP_RUN(s.run);
-	if(s.b && s.b!=fwrite(s.bytes, 1, s.b, fo))
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_RUN);
+	if(s.b && s.b!=QOI_FWRITE(s.bytes, 1, s.b, fo))
 		goto BADEXIT3;
-	if(sizeof(qoi_padding)!=fwrite(qoi_padding, 1, sizeof(qoi_padding), fo))
+	if(sizeof(qoi_padding)!=QOI_FWRITE(qoi_padding, 1, sizeof(qoi_padding), fo))
 		goto BADEXIT3;
+	QOI_TIMING_ADD(opt->timing, bytes_out, s.b+sizeof(qoi_padding));
 
 	QOI_FREE(s.bytes);
 	QOI_FREE(s.pixels_alloc);
 	qoi_fclose(qoi_f, fo);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
+	QOI_TIMING_END(opt->timing);
 	return 0;
 	BADEXIT3:
 	QOI_FREE(s.bytes);
@@ -544,6 +2453,7 @@ static inline int qoi_write_from_file(FILE *fi, const char *qoi_f, qoi_desc *des
 	BADEXIT1:
 	qoi_fclose(qoi_f, fo);
 	BADEXIT0:
+	QOI_TIMING_END(opt->timing);
 	return 1;
 }
 
@@ -552,7 +2462,7 @@ static inline int qoi_write_from_file(FILE *fi, const char *qoi_f, qoi_desc *des
 #define qoi_isdigit(num) ((num>='0') && (num<='9'))
 
 #define PAM_READ1 do{ \
-	if(1!=fread(&t, 1, 1, fi)) \
+	if(1!=QOI_FREAD(&t, 1, 1, fi)) \
 		goto BADEXIT1; \
 }while(0)
 
@@ -583,16 +2493,12 @@ static inline int qoi_write_from_file(FILE *fi, const char *qoi_f, qoi_desc *des
 	} \
 }while(0)
 
-int qoi_write_from_pam(const char *pam_f, const char *qoi_f, const options *opt) {
-	qoi_desc desc;
+//parse a PAM header up to and including ENDHDR, leaving fi at the pixel data
+static int qoi_read_pam_header(FILE *fi, qoi_desc *desc){
 	char *token[]={"WIDTH", "HEIGHT", "DEPTH", "MAXVAL", "ENDHDR\n"};
 	unsigned int hval[4]={0};
 	unsigned char t;
 	unsigned int i, j;
-	FILE *fi;
-
-	if(!(fi=qoi_fopen(pam_f, "rb")))
-		goto BADEXIT0;
 
 	PAM_EXPECT('P');
 	PAM_EXPECT('7');
@@ -633,36 +2539,27 @@ int qoi_write_from_pam(const char *pam_f, const char *qoi_f, const options *opt)
 	}
 	if(hval[0]==0 || hval[1]==0 || hval[2]<3 || hval[2]>4 || hval[3]>255 )
 		goto BADEXIT1;
-	desc.width=hval[0];
-	desc.height=hval[1];
-	desc.channels=hval[2];
-	desc.colorspace=0;
-
-	if(qoi_write_from_file(fi, qoi_f, &desc, opt))
-		goto BADEXIT1;
-
-	qoi_fclose(pam_f, fi);
+	desc->width=hval[0];
+	desc->height=hval[1];
+	desc->channels=hval[2];
+	desc->colorspace=0;
 	return 0;
 	BADEXIT1:
-	qoi_fclose(pam_f, fi);
-	BADEXIT0:
 	return 1;
 }
 
-int qoi_write_from_ppm(const char *ppm_f, const char *qoi_f, const options *opt) {
-	qoi_desc desc={0};
+//parse a binary PPM header, leaving fi at the pixel data
+static int qoi_read_ppm_header(FILE *fi, qoi_desc *desc){
 	unsigned char t;
 	unsigned int maxval=0;
-	FILE *fi;
-
-	if(!(fi=qoi_fopen(ppm_f, "rb")))
-		goto BADEXIT0;
 
+	desc->width=0;
+	desc->height=0;
 	PAM_EXPECT('P');
 	PAM_EXPECT('6');
 	PAM_READ1;
-	PAM_SPACE_NUM(desc.width);
-	PAM_SPACE_NUM(desc.height);
+	PAM_SPACE_NUM(desc->width);
+	PAM_SPACE_NUM(desc->height);
 	PAM_SPACE_NUM(maxval);
 	if(t=='#'){
 		PAM_COMMENT;
@@ -671,16 +2568,56 @@ int qoi_write_from_ppm(const char *ppm_f, const char *qoi_f, const options *opt)
 		goto BADEXIT1;
 	if(maxval>255)
 		goto BADEXIT1;
-	desc.channels=3;
-	desc.colorspace=0;
+	desc->channels=3;
+	desc->colorspace=0;
+	return 0;
+	BADEXIT1:
+	return 1;
+}
+
+int qoi_write_from_pam(const char *pam_f, const char *qoi_f, const options *opt) {
+	qoi_desc desc;
+	FILE *fi;
+	QOI_TIMING_BEGIN(opt->timing);
+
+	if(!(fi=qoi_fopen(pam_f, "rb")))
+		goto BADEXIT0;
+	if(qoi_read_pam_header(fi, &desc))
+		goto BADEXIT1;
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
+	if(qoi_write_from_file(fi, qoi_f, &desc, opt))
+		goto BADEXIT1;
+
+	qoi_fclose(pam_f, fi);
+	QOI_TIMING_END(opt->timing);
+	return 0;
+	BADEXIT1:
+	qoi_fclose(pam_f, fi);
+	BADEXIT0:
+	QOI_TIMING_END(opt->timing);
+	return 1;
+}
+
+int qoi_write_from_ppm(const char *ppm_f, const char *qoi_f, const options *opt) {
+	qoi_desc desc;
+	FILE *fi;
+	QOI_TIMING_BEGIN(opt->timing);
+
+	if(!(fi=qoi_fopen(ppm_f, "rb")))
+		goto BADEXIT0;
+	if(qoi_read_ppm_header(fi, &desc))
+		goto BADEXIT1;
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
 	if(qoi_write_from_file(fi, qoi_f, &desc, opt))
 		goto BADEXIT1;
 
 	qoi_fclose(ppm_f, fi);
+	QOI_TIMING_END(opt->timing);
 	return 0;
 	BADEXIT1:
 	qoi_fclose(ppm_f, fi);
 	BADEXIT0:
+	QOI_TIMING_END(opt->timing);
 	return 1;
 }
 
@@ -691,19 +2628,24 @@ int qoi_write(const char *filename, const void *data, const qoi_desc *desc, cons
 
 	if (!f)
 		return 0;
+	QOI_TIMING_BEGIN(opt->timing);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
 
 	encoded = qoi_encode(data, desc, &size, opt);
 	if (!encoded) {
 		fclose(f);
+		QOI_TIMING_END(opt->timing);
 		return 0;
 	}
 
-	fwrite(encoded, 1, size, f);
+	QOI_FWRITE(encoded, 1, size, f);
 	fflush(f);
 	err = ferror(f);
 	fclose(f);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_WRITE);
 
 	QOI_FREE(encoded);
+	QOI_TIMING_END(opt->timing);
 	return err ? 0 : size;
 }
 
@@ -711,29 +2653,247 @@ void *qoi_read(const char *filename, qoi_desc *desc, int channels, const options
 	FILE *f = fopen(filename, "rb");
 	int size, bytes_read;
 	void *pixels, *data;
-	UNUSED(opt);
 
 	if (!f)
 		return NULL;
+	QOI_TIMING_BEGIN(opt->timing);
 
 	fseek(f, 0, SEEK_END);
 	size = ftell(f);
 	if (size <= 0 || fseek(f, 0, SEEK_SET) != 0) {
 		fclose(f);
+		QOI_TIMING_END(opt->timing);
 		return NULL;
 	}
 
 	if (!(data = QOI_MALLOC(size))) {
 		fclose(f);
+		QOI_TIMING_END(opt->timing);
 		return NULL;
 	}
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
 
-	bytes_read = fread(data, 1, size, f);
+	bytes_read = QOI_FREAD(data, 1, size, f);
 	fclose(f);
-	pixels = (bytes_read != size) ? NULL : qoi_decode(data, bytes_read, desc, channels);
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_READ);
+	if (bytes_read != size || (opt->scale > 1 && opt->orientation > 1))
+		pixels = NULL;
+	else if (opt->orientation > 1)
+		pixels = qoi_decode_oriented(data, bytes_read, desc, channels, opt->orientation);
+	else if (opt->scale > 1)
+		pixels = qoi_decode_scaled(data, bytes_read, desc, channels, opt->scale);
+	else
+#ifdef QOI_TIMING
+		pixels = qoi_decode_timed(data, bytes_read, desc, channels, opt->timing);
+#else
+		pixels = qoi_decode(data, bytes_read, desc, channels);
+#endif
+	QOI_FREE(data);
+	QOI_TIMING_END(opt->timing);
+	return pixels;
+}
+
+void *qoi_read_preview(const char *filename, qoi_desc *desc, int channels, int level, const options *opt) {
+	FILE *f = fopen(filename, "rb");
+	unsigned char footer[QOI_PREVIEW_FOOTER_SIZE(QOI_PREVIEW_LEVELS_MAX)];
+	unsigned int offs[QOI_PREVIEW_LEVELS_MAX+1], from, to, tail;
+	int size, levels;
+	void *pixels = NULL, *data;
+	UNUSED(opt);
+
+	if (!f)
+		return NULL;
+	QOI_TIMING_BEGIN(opt->timing);
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	tail = size < (int)sizeof(footer) ? (unsigned int)size : sizeof(footer);
+	if (size <= 0 || level < 0 || fseek(f, size-tail, SEEK_SET) != 0 || tail != QOI_FREAD(footer, 1, tail, f))
+		goto BADEXIT0;
+	levels = qoi_preview_index(footer+tail, tail, size, offs);
+	if (level > levels)
+		goto BADEXIT0;
+	from = level ? offs[level-1] : 0;
+	to = levels ? offs[level] : (unsigned int)size;
+	if (fseek(f, from, SEEK_SET) != 0 || !(data = QOI_MALLOC(to-from)))
+		goto BADEXIT0;
+	QOI_TIMING_MARK(opt->timing, QOI_TIMING_HEADER);
+
+	if (to-from == QOI_FREAD(data, 1, to-from, f)) {
+		QOI_TIMING_MARK(opt->timing, QOI_TIMING_READ);
+#ifdef QOI_TIMING
+		pixels = qoi_decode_timed(data, to-from, desc, channels, opt->timing);
+#else
+		pixels = qoi_decode(data, to-from, desc, channels);
+#endif
+	}
 	QOI_FREE(data);
+	BADEXIT0:
+	fclose(f);
+	QOI_TIMING_END(opt->timing);
 	return pixels;
 }
 
+static void qoi_write_le_32(unsigned char *p, unsigned int v) {
+	p[0]=v;
+	p[1]=v>>8;
+	p[2]=v>>16;
+	p[3]=v>>24;
+}
+
+static void qoi_write_le_64(unsigned char *p, unsigned long long v) {
+	qoi_write_le_32(p, (unsigned int)v);
+	qoi_write_le_32(p+4, (unsigned int)(v>>32));
+}
+
+typedef struct {
+	const char *name;//set by qoi_archive_close for the sort
+	unsigned long long offset;
+	unsigned int size, name_off;
+	qoi_desc desc;
+	unsigned short name_len;
+} qoi_archive_rec;
+
+struct qoi_archive_writer {
+	FILE *f;
+	unsigned long long pos;
+	qoi_archive_rec *recs;
+	char *names;
+	size_t count, recs_cap, names_size, names_cap;
+};
+
+//grow *p of *cap bytes to hold at least need, by doubling
+static int qoi_archive_grow(void **p, size_t *cap, size_t used, size_t need) {
+	void *grown;
+	size_t cap_new=*cap?*cap:4096;
+	if(need <= *cap)
+		return 0;
+	while(cap_new < need)
+		cap_new*=2;
+	if(!(grown=QOI_MALLOC(cap_new)))
+		return 1;
+	if(*p){
+		memcpy(grown, *p, used);
+		QOI_FREE(*p);
+	}
+	*p=grown;
+	*cap=cap_new;
+	return 0;
+}
+
+//zeros up to the next multiple of QOI_ARCHIVE_ALIGN
+static int qoi_archive_pad(qoi_archive_writer *aw) {
+	static const unsigned char zero[QOI_ARCHIVE_ALIGN]={0};
+	unsigned int pad=(QOI_ARCHIVE_ALIGN-(aw->pos%QOI_ARCHIVE_ALIGN))%QOI_ARCHIVE_ALIGN;
+	aw->pos+=pad;
+	return pad!=QOI_FWRITE(zero, 1, pad, aw->f);
+}
+
+static int qoi_archive_cmp(const void *a, const void *b) {
+	return strcmp(((const qoi_archive_rec *)a)->name, ((const qoi_archive_rec *)b)->name);
+}
+
+qoi_archive_writer *qoi_archive_create(const char *filename) {
+	static const unsigned char header[QOI_ARCHIVE_HEADER_SIZE]={0};
+	qoi_archive_writer *aw;
+	if(!(aw=QOI_MALLOC(sizeof(qoi_archive_writer))))
+		return NULL;
+	memset(aw, 0, sizeof(qoi_archive_writer));
+	if(!(aw->f=fopen(filename, "wb"))){
+		QOI_FREE(aw);
+		return NULL;
+	}
+	//the header is written by qoi_archive_close once the index is placed
+	aw->pos=QOI_ARCHIVE_HEADER_SIZE;
+	if(QOI_ARCHIVE_HEADER_SIZE!=QOI_FWRITE(header, 1, QOI_ARCHIVE_HEADER_SIZE, aw->f)){
+		fclose(aw->f);
+		QOI_FREE(aw);
+		return NULL;
+	}
+	return aw;
+}
+
+int qoi_archive_add(qoi_archive_writer *aw, const char *name, const void *data, int size) {
+	const unsigned char *bytes=data;
+	qoi_archive_rec *r;
+	unsigned int p=0;
+	size_t name_len=strlen(name);
+	if(size < QOI_HEADER_SIZE || qoi_read_32(bytes, &p) != QOI_MAGIC || name_len > 0xffff)
+		return 1;
+	if(
+		qoi_archive_grow((void **)&aw->recs, &aw->recs_cap, aw->count*sizeof(qoi_archive_rec), (aw->count+1)*sizeof(qoi_archive_rec)) ||
+		qoi_archive_grow((void **)&aw->names, &aw->names_cap, aw->names_size, aw->names_size+name_len+1)
+	)
+		return 1;
+	r=aw->recs+aw->count;
+	r->desc.width=qoi_read_32(bytes, &p);
+	r->desc.height=qoi_read_32(bytes, &p);
+	r->desc.channels=bytes[p++];
+	qoi_header_flags(bytes[p++], &r->desc);
+	if(qoi_archive_pad(aw))
+		return 1;
+	r->offset=aw->pos;
+	r->size=size;
+	r->name_off=aw->names_size;
+	r->name_len=name_len;
+	if((size_t)size!=QOI_FWRITE(data, 1, size, aw->f))
+		return 1;
+	aw->pos+=size;
+	memcpy(aw->names+aw->names_size, name, name_len+1);
+	aw->names_size+=name_len+1;
+	aw->count++;
+	return 0;
+}
+
+int qoi_archive_close(qoi_archive_writer *aw) {
+	unsigned char e[QOI_ARCHIVE_HEADER_SIZE]={0};
+	unsigned long long index;
+	size_t i;
+	int err=(unsigned long long)aw->count > 0xffffffffull;
+
+	for(i=0;i<aw->count;++i)
+		aw->recs[i].name=aw->names+aw->recs[i].name_off;
+	if(aw->count)
+		qsort(aw->recs, aw->count, sizeof(qoi_archive_rec), qoi_archive_cmp);
+	for(i=1;i<aw->count;++i)
+		err|=!strcmp(aw->recs[i-1].name, aw->recs[i].name);
+
+	err|=qoi_archive_pad(aw);
+	index=aw->pos;
+	for(i=0;i<aw->count && !err;++i){
+		const qoi_archive_rec *r=aw->recs+i;
+		qoi_write_le_64(e, r->offset);
+		qoi_write_le_32(e+8, r->size);
+		qoi_write_le_32(e+12, r->desc.width);
+		qoi_write_le_32(e+16, r->desc.height);
+		qoi_write_le_32(e+20, r->name_off);
+		e[24]=r->name_len;
+		e[25]=r->name_len>>8;
+		e[26]=r->desc.channels;
+		e[27]=r->desc.colorspace;
+		err|=QOI_ARCHIVE_INDEX_SIZE!=QOI_FWRITE(e, 1, QOI_ARCHIVE_INDEX_SIZE, aw->f);
+	}
+	if(!err && aw->names_size)
+		err|=aw->names_size!=QOI_FWRITE(aw->names, 1, aw->names_size, aw->f);
+
+	memset(e, 0, sizeof(e));
+	memcpy(e, QOI_ARCHIVE_MAGIC, 4);
+	qoi_write_le_32(e+4, QOI_ARCHIVE_VERSION);
+	qoi_write_le_32(e+8, (unsigned int)aw->count);
+	qoi_write_le_64(e+16, index);
+	qoi_write_le_64(e+24, index+(aw->count*QOI_ARCHIVE_INDEX_SIZE));
+	qoi_write_le_64(e+32, aw->names_size);
+	if(!err)
+		err|=fseek(aw->f, 0, SEEK_SET) || QOI_ARCHIVE_HEADER_SIZE!=QOI_FWRITE(e, 1, QOI_ARCHIVE_HEADER_SIZE, aw->f);
+	err|=fclose(aw->f)!=0;
+
+	if(aw->recs)
+		QOI_FREE(aw->recs);
+	if(aw->names)
+		QOI_FREE(aw->names);
+	QOI_FREE(aw);
+	return err;
+}
+
 #endif /* QOI_NO_STDIO */
 #endif /* QOI_IMPLEMENTATION */
@@ -12,13 +12,30 @@ Compile with:
 
 */
 
+#define _GNU_SOURCE //sched_setaffinity
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <png.h>
 #include "lz4.h"
 #include "zstd.h"
 
+// Allocation accounting, see mem_malloc. libpng, stb and QOI allocate through
+// these so the memory used per call can be reported
+void *mem_malloc(size_t sz);
+void *mem_realloc(void *p, size_t sz);
+void mem_free(void *p);
+#define STBI_MALLOC(sz)       mem_malloc(sz)
+#define STBI_REALLOC(p, sz)   mem_realloc(p, sz)
+#define STBI_FREE(p)          mem_free(p)
+#define STBIW_MALLOC(sz)      mem_malloc(sz)
+#define STBIW_REALLOC(p, sz)  mem_realloc(p, sz)
+#define STBIW_FREE(p)         mem_free(p)
+#define QOI_MALLOC(sz)        mem_malloc(sz)
+#define QOI_FREE(p)           mem_free(p)
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #define STBI_NO_LINEAR
@@ -27,6 +44,12 @@ Compile with:
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+// File I/O of the streaming paths is timed separately, see benchmark_stream
+size_t stream_fread(void *p, size_t sz, size_t n, FILE *f);
+size_t stream_fwrite(const void *p, size_t sz, size_t n, FILE *f);
+#define QOI_FREAD(p, sz, n, f)  stream_fread(p, sz, n, f)
+#define QOI_FWRITE(p, sz, n, f) stream_fwrite(p, sz, n, f)
+
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
 
@@ -92,6 +115,215 @@ static uint64_t ns() {
 #define ERROR(...) printf("abort at line " TOSTRING(__LINE__) ": " __VA_ARGS__); printf("\n"); exit(1)
 
 
+// -----------------------------------------------------------------------------
+// Hardware performance counters via perf_event_open, Linux only. Each counter
+// is opened on its own so that any the PMU or perf_event_paranoid refuses just
+// read as unavailable, and is scaled if the kernel had to multiplex it
+
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCHES,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_ACCESS,
+	PERF_L1D_MISS,
+	PERF_LLC_ACCESS,
+	PERF_LLC_MISS,
+	PERF_DTLB_ACCESS,
+	PERF_DTLB_MISS,
+	PERF_COUNT /* must be the last element */
+};
+
+typedef struct {
+	uint64_t v[PERF_COUNT];
+} perf_counts_t;
+
+static int perf_fd[PERF_COUNT];
+static int perf_available = 0;
+
+#if defined(__linux)
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PERF_CACHE(cache, result) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+int perf_init(void) {
+	static const struct { uint32_t type; uint64_t config; } events[PERF_COUNT] = {
+		[PERF_CYCLES]        = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		[PERF_INSTRUCTIONS]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		[PERF_BRANCHES]      = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+		[PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		[PERF_L1D_ACCESS]    = {PERF_TYPE_HW_CACHE, PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+		[PERF_L1D_MISS]      = {PERF_TYPE_HW_CACHE, PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+		[PERF_LLC_ACCESS]    = {PERF_TYPE_HW_CACHE, PERF_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+		[PERF_LLC_MISS]      = {PERF_TYPE_HW_CACHE, PERF_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+		[PERF_DTLB_ACCESS]   = {PERF_TYPE_HW_CACHE, PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+		[PERF_DTLB_MISS]     = {PERF_TYPE_HW_CACHE, PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+	};
+	perf_available = 0;
+	for (int i = 0; i < PERF_COUNT; ++i) {
+		struct perf_event_attr pe = {0};
+		pe.type = events[i].type;
+		pe.size = sizeof(pe);
+		pe.config = events[i].config;
+		pe.disabled = 1;
+		pe.exclude_kernel = 1;
+		pe.exclude_hv = 1;
+		pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		perf_fd[i] = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+		if (perf_fd[i] >= 0)
+			perf_available++;
+	}
+	return perf_available;
+}
+
+void perf_reset(perf_counts_t *p) {
+	if (!p)
+		return;
+	for (int i = 0; i < PERF_COUNT; ++i) {
+		if (perf_fd[i] >= 0)
+			ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+	}
+}
+
+void perf_start(perf_counts_t *p) {
+	if (!p)
+		return;
+	for (int i = 0; i < PERF_COUNT; ++i) {
+		if (perf_fd[i] >= 0)
+			ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+void perf_stop(perf_counts_t *p) {
+	if (!p)
+		return;
+	for (int i = 0; i < PERF_COUNT; ++i) {
+		if (perf_fd[i] >= 0)
+			ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+}
+
+// Average count per run, scaled up if the counter was multiplexed
+void perf_read(perf_counts_t *p, int runs) {
+	if (!p)
+		return;
+	for (int i = 0; i < PERF_COUNT; ++i) {
+		uint64_t val[3] = {0};
+		p->v[i] = 0;
+		if (perf_fd[i] < 0 || read(perf_fd[i], val, sizeof(val)) != sizeof(val) || !val[2])
+			continue;
+		p->v[i] = (uint64_t)((double)val[0] * ((double)val[1] / (double)val[2])) / runs;
+	}
+}
+#else
+int perf_init(void) {
+	for (int i = 0; i < PERF_COUNT; ++i)
+		perf_fd[i] = -1;
+	return 0;
+}
+void perf_reset(perf_counts_t *p) { (void)p; }
+void perf_start(perf_counts_t *p) { (void)p; }
+void perf_stop(perf_counts_t *p) { (void)p; }
+void perf_read(perf_counts_t *p, int runs) { (void)p; (void)runs; }
+#endif
+
+
+// -----------------------------------------------------------------------------
+// allocation accounting
+
+// Blocks are sized with malloc_usable_size so they can still be released with
+// plain free() (e.g. the pixels returned by stbi_load) and no header is needed.
+// Without it only the allocation count and total are meaningful
+#if defined(__linux)
+#include <malloc.h>
+#define mem_size(p) malloc_usable_size(p)
+#else
+#define mem_size(p) 0
+#endif
+
+// Only counted while tracking, which a single threaded benchmark turns on around
+// its calls. --mem is refused with --threads so these need no synchronization
+static int mem_tracking = 0;
+static int64_t mem_cur, mem_peak;
+static uint64_t mem_allocs, mem_total;
+
+static void mem_add(int64_t size) {
+	mem_cur += size;
+	if (mem_cur > mem_peak)
+		mem_peak = mem_cur;
+}
+
+void *mem_malloc(size_t sz) {
+	void *p = malloc(sz);
+	if (mem_tracking && p) {
+		size_t size = mem_size(p) ? mem_size(p) : sz;
+		mem_allocs++;
+		mem_total += size;
+		mem_add(size);
+	}
+	return p;
+}
+
+void *mem_realloc(void *p, size_t sz) {
+	int64_t old = p ? mem_size(p) : 0;
+	void *q = realloc(p, sz);
+	if (mem_tracking && q) {
+		size_t size = mem_size(q) ? mem_size(q) : sz;
+		mem_allocs++;
+		mem_total += size;
+		mem_add(size - old);
+	}
+	return q;
+}
+
+void mem_free(void *p) {
+	if (mem_tracking && p)
+		mem_cur -= mem_size(p);
+	free(p);
+}
+
+png_voidp mem_png_malloc(png_structp png, png_alloc_size_t sz) {
+	(void)png;
+	return mem_malloc(sz);
+}
+
+void mem_png_free(png_structp png, png_voidp p) {
+	(void)png;
+	mem_free(p);
+}
+
+// Per call allocations of one benchmark, peak is the largest amount held at
+// any time during a call
+typedef struct {
+	uint64_t allocs;
+	uint64_t peak;
+	uint64_t total;
+} benchmark_mem_t;
+
+void mem_begin(benchmark_mem_t *m) {
+	if (!m)
+		return;
+	mem_allocs = mem_total = 0;
+	mem_cur = mem_peak = 0;
+	mem_tracking = 1;
+}
+
+void mem_end(benchmark_mem_t *m, int calls) {
+	if (!m)
+		return;
+	mem_tracking = 0;
+	m->allocs = mem_allocs / calls;
+	m->total = mem_total / calls;
+	m->peak = mem_peak;
+}
+
+
 // -----------------------------------------------------------------------------
 // libpng encode/decode wrappers
 // Seriously, who thought this was a good abstraction for an API to read/write
@@ -113,7 +345,7 @@ void libpng_encode_callback(png_structp png_ptr, png_bytep data, png_size_t leng
 }
 
 void *libpng_encode(void *pixels, int w, int h, int channels, int *out_len) {
-	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_structp png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, NULL, mem_png_malloc, mem_png_free);
 	if (!png) {
 		ERROR("png_create_write_struct");
 	}
@@ -147,7 +379,7 @@ void *libpng_encode(void *pixels, int w, int h, int channels, int *out_len) {
 	libpng_write_t write_data = {
 		.size = 0,
 		.capacity = w * h * channels,
-		.data = malloc(w * h * channels)
+		.data = mem_malloc(w * h * channels)
 	};
 
 	png_set_rows(png, info, row_pointers);
@@ -181,7 +413,7 @@ void png_warning_callback(png_structp png_ptr, png_const_charp warning_msg) {
 }
 
 void *libpng_decode(void *data, int size, int *out_w, int *out_h) {
-	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, png_warning_callback);
+	png_structp png = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, png_warning_callback, NULL, mem_png_malloc, mem_png_free);
 	if (!png) {
 		ERROR("png_create_read_struct");
 	}
@@ -233,7 +465,7 @@ void *libpng_decode(void *data, int size, int *out_w, int *out_h) {
 
 	png_read_update_info(png, info);
 
-	unsigned char* out = malloc(w * h * 4);
+	unsigned char* out = mem_malloc(w * h * 4);
 	*out_w = w;
 	*out_h = h;
 
@@ -290,6 +522,220 @@ void *fload(const char *path, int *out_size) {
 }
 
 
+// -----------------------------------------------------------------------------
+// deterministic synthetic corpus, generated straight into memory so results
+// can be reproduced without a PNG corpus. The same class, size and seed always
+// produce the same pixels
+
+enum {
+	SYNTH_FLAT,
+	SYNTH_GRADIENT,
+	SYNTH_PHOTO,
+	SYNTH_UI,
+	SYNTH_UI_RGBA,
+	SYNTH_SPRITE,
+	SYNTH_GRAY,
+	SYNTH_COUNT /* must be the last element */
+};
+static const char *const synth_names[SYNTH_COUNT] = {
+	[SYNTH_FLAT]     = "flat",
+	[SYNTH_GRADIENT] = "gradient",
+	[SYNTH_PHOTO]    = "photo",
+	[SYNTH_UI]       = "ui",
+	[SYNTH_UI_RGBA]  = "ui_rgba",
+	[SYNTH_SPRITE]   = "sprite",
+	[SYNTH_GRAY]     = "gray",
+};
+static const int synth_channels[SYNTH_COUNT] = {
+	[SYNTH_FLAT]     = 3,
+	[SYNTH_GRADIENT] = 3,
+	[SYNTH_PHOTO]    = 3,
+	[SYNTH_UI]       = 3,
+	[SYNTH_UI_RGBA]  = 4,//opaque, like screen captures forced to RGBA
+	[SYNTH_SPRITE]   = 4,
+	[SYNTH_GRAY]     = 3,//gray stored as RGB
+};
+// Odd sizes exercise the scalar tail after the CHUNK sized bulk encode
+static const int synth_sizes[][2] = {
+	{8, 8}, {16, 16}, {31, 7}, {64, 64}, {333, 217}, {1024, 768},
+	{1920, 1080}, {4096, 4096}, {16384, 16384}
+};
+
+static uint32_t synth_hash(uint32_t x, uint32_t y, uint32_t seed) {
+	uint32_t h = seed ^ (x * 0x9E3779B1u) ^ (y * 0x85EBCA77u);
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	h *= 0x297A2D39u;
+	h ^= h >> 15;
+	return h;
+}
+
+static inline unsigned char synth_clamp(int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Smooth value noise in 0..255 with features of roughly cell pixels
+static int synth_value_noise(int x, int y, int cell, uint32_t seed) {
+	int cx = x / cell, cy = y / cell;
+	int fx = x % cell, fy = y % cell;
+	int v00 = synth_hash(cx, cy, seed) & 255;
+	int v10 = synth_hash(cx + 1, cy, seed) & 255;
+	int v01 = synth_hash(cx, cy + 1, seed) & 255;
+	int v11 = synth_hash(cx + 1, cy + 1, seed) & 255;
+	int top = v00 * (cell - fx) + v10 * fx;
+	int bot = v01 * (cell - fx) + v11 * fx;
+	return (top * (cell - fy) + bot * fy) / (cell * cell);
+}
+
+static inline void synth_put(unsigned char *p, int channels, int r, int g, int b, int a) {
+	p[0] = r;
+	p[1] = g;
+	p[2] = b;
+	if (channels == 4)
+		p[3] = a;
+}
+
+static void synth_fill_rect(unsigned char *pixels, int w, int h, int channels, int x0, int y0, int rw, int rh, int r, int g, int b) {
+	for (int y = y0 < 0 ? 0 : y0; y < y0 + rh && y < h; ++y) {
+		for (int x = x0 < 0 ? 0 : x0; x < x0 + rw && x < w; ++x)
+			synth_put(pixels + ((size_t)y * w + x) * channels, channels, r, g, b, 255);
+	}
+}
+
+// Windows with a title bar and border, some containing lines of glyph-like text
+static void synth_ui(unsigned char *pixels, int w, int h, int channels, uint32_t seed) {
+	static const unsigned char palette[][3] = {
+		{255, 255, 255}, {246, 246, 246}, {60, 120, 215}, {220, 80, 60}, {90, 170, 90}, {45, 45, 48}
+	};
+	synth_fill_rect(pixels, w, h, channels, 0, 0, w, h, 236, 236, 236);
+	int windows = 1 + (int)((uint64_t)w * h / 40000);
+	if (windows > 4000)
+		windows = 4000;
+	for (int i = 0; i < windows; ++i) {
+		uint32_t r = synth_hash(i, 1, seed);
+		int rw = 16 + (r & 511) % (w > 16 ? w : 16);
+		int rh = 12 + (r >> 9 & 511) % (h > 12 ? h : 12);
+		int x0 = synth_hash(i, 2, seed) % w, y0 = synth_hash(i, 3, seed) % h;
+		const unsigned char *c = palette[(r >> 18) % 6];
+		synth_fill_rect(pixels, w, h, channels, x0 - 1, y0 - 1, rw + 2, rh + 2, 160, 160, 160);
+		synth_fill_rect(pixels, w, h, channels, x0, y0, rw, rh, c[0], c[1], c[2]);
+		synth_fill_rect(pixels, w, h, channels, x0, y0, rw, rh < 20 ? rh / 4 : 5, 60, 90, 160);
+		if (c[0] < 128)
+			continue;
+		//text on light windows, 6x9 glyph cells with a 5x7 bitmap
+		for (int ty = y0 + 8; ty + 9 <= y0 + rh && ty + 9 <= h; ty += 12) {
+			for (int tx = x0 + 4; tx + 6 <= x0 + rw && tx + 6 <= w; tx += 6) {
+				uint32_t glyph = synth_hash(tx, ty, seed);
+				if ((glyph & 15) == 0)
+					continue;//space
+				for (int gy = 0; gy < 7; ++gy) {
+					for (int gx = 0; gx < 5; ++gx) {
+						if (synth_hash(glyph & 63, gy * 5 + gx, seed) % 5 < 2)
+							synth_put(pixels + ((size_t)(ty + gy) * w + tx + gx) * channels, channels, 30, 30, 30, 255);
+					}
+				}
+			}
+		}
+	}
+}
+
+// Shaded discs with anti-aliased alpha edges and translucent shadows on a
+// transparent background, one per cell
+static void synth_sprite(unsigned char *pixels, int w, int h, uint32_t seed) {
+	int cell = w < 48 || h < 48 ? (w < h ? w : h) : 48;
+	memset(pixels, 0, (size_t)w * h * 4);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			int cx = x / cell, cy = y / cell;
+			uint32_t r = synth_hash(cx, cy, seed);
+			if ((r & 7) == 0)
+				continue;//empty cell
+			int radius = cell / 4 + (r >> 3) % (cell / 4 + 1);
+			int dx = x % cell - cell / 2, dy = y % cell - cell / 2;
+			int d2 = dx * dx + dy * dy;
+			unsigned char *p = pixels + ((size_t)y * w + x) * 4;
+			if (d2 > (radius + 3) * (radius + 3))
+				continue;
+			if (d2 > radius * radius) {
+				synth_put(p, 4, 0, 0, 0, 64);//shadow
+				continue;
+			}
+			int shade = 255 - (d2 * 128) / (radius * radius + 1);
+			int edge = radius * radius - d2;
+			synth_put(p, 4,
+				(shade * ((r >> 8) & 255)) >> 8,
+				(shade * ((r >> 16) & 255)) >> 8,
+				(shade * ((r >> 24) & 255)) >> 8,
+				edge < radius ? 255 * edge / radius : 255
+			);
+		}
+	}
+}
+
+void synth_generate(int cls, unsigned char *pixels, int w, int h, uint32_t seed) {
+	int channels = synth_channels[cls];
+	uint32_t c = synth_hash(w, h, seed);
+	switch (cls) {
+		case SYNTH_FLAT:
+			synth_fill_rect(pixels, w, h, channels, 0, 0, w, h, c & 255, c >> 8 & 255, c >> 16 & 255);
+			break;
+		case SYNTH_GRADIENT:
+			for (int y = 0; y < h; ++y) {
+				for (int x = 0; x < w; ++x) {
+					synth_put(pixels + ((size_t)y * w + x) * channels, channels,
+						w > 1 ? x * 255 / (w - 1) : 0,
+						h > 1 ? y * 255 / (h - 1) : 0,
+						(x + y) * 255 / (w + h - 1), 255);
+				}
+			}
+			break;
+		case SYNTH_PHOTO:
+		case SYNTH_GRAY:
+			// Octaves of value noise for luma plus low frequency chroma and a
+			// little per pixel sensor noise
+			for (int y = 0; y < h; ++y) {
+				for (int x = 0; x < w; ++x) {
+					int l = (synth_value_noise(x, y, 256, seed) * 6 +
+						synth_value_noise(x, y, 32, seed + 1) * 3 +
+						synth_value_noise(x, y, 4, seed + 2)) / 10;
+					l += (int)(synth_hash(x, y, seed + 3) % 7) - 3;
+					if (cls == SYNTH_GRAY) {
+						synth_put(pixels + ((size_t)y * w + x) * channels, channels, synth_clamp(l), synth_clamp(l), synth_clamp(l), 255);
+						continue;
+					}
+					int cr = (synth_value_noise(x, y, 128, seed + 4) - 128) / 3;
+					int cb = (synth_value_noise(x, y, 128, seed + 5) - 128) / 3;
+					synth_put(pixels + ((size_t)y * w + x) * channels, channels,
+						synth_clamp(l + cr),
+						synth_clamp(l - (cr + cb) / 2),
+						synth_clamp(l + cb), 255);
+				}
+			}
+			break;
+		case SYNTH_UI:
+		case SYNTH_UI_RGBA:
+			synth_ui(pixels, w, h, channels, seed);
+			break;
+		case SYNTH_SPRITE:
+			synth_sprite(pixels, w, h, seed);
+			break;
+	}
+}
+
+// Allocate and generate an image with the 64 bytes of leading space qoi_encode
+// needs
+void *synth_image(int cls, int w, int h) {
+	size_t size = (size_t)w * h * synth_channels[cls];
+	unsigned char *pixels = malloc(size + 65);
+	if (!pixels) {
+		ERROR("Malloc for %zu bytes failed", size + 65);
+	}
+	synth_generate(cls, pixels + 64, w, h, 0x51F15EEDu + cls);
+	return pixels;
+}
+
+
 // -----------------------------------------------------------------------------
 // benchmark runner
 
@@ -307,17 +753,71 @@ int opt_nozstd1 = 0;
 int opt_nozstd3 = 0;
 int opt_nozstd9 = 0;
 int opt_nozstd19 = 0;
+int opt_threads = 0;
+int opt_synthetic = 0;
+double opt_synthetic_max = 16.8;
+int opt_synthetic_w = 0;
+int opt_synthetic_h = 0;
+int opt_perf = 0;
+int opt_kernels = 0;
+int opt_pin = -1;
+int opt_cold = 0;
+double opt_adaptive = 0;
+int opt_max_runs = 1000;
+int opt_keep_outliers = 0;
+int opt_dist = 0;
+int opt_stream = 0;
+int opt_mem = 0;
+const char *opt_stream_dir = ".";
+const char *opt_stream_tmpfs = "/dev/shm";
+const char *opt_json = NULL;
+const char *opt_csv = NULL;
+const char *opt_compare = NULL;
+double opt_compare_threshold = 5.0;
+#ifdef QOI_STATS
+int opt_stats = 0;
+qoi_stats stats_total_enc, stats_total_dec;
+#endif
 options opt={0};
 
+#ifdef QOI_SSE
+	#define CODEPATH "sse"
+#elif defined QOI_AVX2
+	#define CODEPATH "avx2"
+#elif defined QOI_AVX512
+	#define CODEPATH "avx512"
+#else
+	#define CODEPATH "scalar"
+#endif
+
 enum {
 	LIBPNG,
 	STBI,
 	QOILIKE,
+	KERNEL_SCALAR,
+	KERNEL_MLUT,
+	KERNEL_SSE,
+	KERNEL_AVX2,
+	KERNEL_AVX512,
+	STREAM_FILE,
+	STREAM_TMPFS,
 	LZ4,
 	ZSTD1,
 	ZSTD3,
 	ZSTD9,
 	ZSTD19,
+	FORMAT_QOI,
+	FORMAT_QOI_LZ4,
+	FORMAT_QOI_ZSTD1,
+	FORMAT_QOI_ZSTD3,
+	FORMAT_QOI_ZSTD9,
+	FORMAT_QOI_ZSTD19,
+	FORMAT_SOI,
+	FORMAT_SOI_LZ4,
+	FORMAT_SOI_ZSTD1,
+	FORMAT_SOI_ZSTD3,
+	FORMAT_SOI_ZSTD9,
+	FORMAT_SOI_ZSTD19,
 	BENCH_COUNT /* must be the last element */
 };
 static const char *const lib_names[BENCH_COUNT] = {
@@ -325,17 +825,90 @@ static const char *const lib_names[BENCH_COUNT] = {
 	[LIBPNG] =  "libpng:     ",
 	[STBI]   =  "stbi:       ",
 	[QOILIKE]    =  EXT_STR":        ",
+	[KERNEL_SCALAR] = EXT_STR"-scalar: ",
+	[KERNEL_MLUT]   = EXT_STR"-mlut:   ",
+	[KERNEL_SSE]    = EXT_STR"-sse:    ",
+	[KERNEL_AVX2]   = EXT_STR"-avx2:   ",
+	[KERNEL_AVX512] = EXT_STR"-avx512: ",
+	[STREAM_FILE]   = EXT_STR"-file:   ",
+	[STREAM_TMPFS]  = EXT_STR"-tmpfs:  ",
 	[LZ4]    =  EXT_STR".lz4:    ",
 	[ZSTD1]    =  EXT_STR".zstd1:  ",
 	[ZSTD3]    =  EXT_STR".zstd3:  ",
 	[ZSTD9]    =  EXT_STR".zstd9:  ",
-	[ZSTD19]    =  EXT_STR".zstd19: "
+	[ZSTD19]    =  EXT_STR".zstd19: ",
+	[FORMAT_QOI]        = "qoi:        ",
+	[FORMAT_QOI_LZ4]    = "qoi.lz4:    ",
+	[FORMAT_QOI_ZSTD1]  = "qoi.zstd1:  ",
+	[FORMAT_QOI_ZSTD3]  = "qoi.zstd3:  ",
+	[FORMAT_QOI_ZSTD9]  = "qoi.zstd9:  ",
+	[FORMAT_QOI_ZSTD19] = "qoi.zstd19: ",
+	[FORMAT_SOI]        = "soi:        ",
+	[FORMAT_SOI_LZ4]    = "soi.lz4:    ",
+	[FORMAT_SOI_ZSTD1]  = "soi.zstd1:  ",
+	[FORMAT_SOI_ZSTD3]  = "soi.zstd3:  ",
+	[FORMAT_SOI_ZSTD9]  = "soi.zstd9:  ",
+	[FORMAT_SOI_ZSTD19] = "soi.zstd19: "
+};
+
+// The other formats for the FORMAT_* rows, each compiled into its own object by
+// qoiformat.c under a prefix so they link next to this build's roi
+#ifdef QOI_BENCH_FORMATS
+#ifndef ROI
+#error "QOI_BENCH_FORMATS adds the qoi and soi rows to a roi build, build with -DROI"
+#endif
+void *qoifmt_encode(const void *data, const qoi_desc *desc, int *out_len);
+void *qoifmt_decode(const void *data, int size, qoi_desc *desc, int channels);
+void *soifmt_encode(const void *data, const qoi_desc *desc, int *out_len);
+void *soifmt_decode(const void *data, int size, qoi_desc *desc, int channels);
+#endif
+
+typedef struct {
+	void *(*encode)(const void *data, const qoi_desc *desc, int *out_len);
+	void *(*decode)(const void *data, int size, qoi_desc *desc, int channels);
+} bench_format_t;
+
+#define FORMAT_COUNT 2
+#define FORMAT_CHAINS 6 // rows per format, the format alone then lz4 and each zstd level
+static const bench_format_t formats[FORMAT_COUNT] = {
+#ifdef QOI_BENCH_FORMATS
+	{qoifmt_encode, qoifmt_decode},
+	{soifmt_encode, soifmt_decode}
+#else
+	{NULL, NULL},
+	{NULL, NULL}
+#endif
 };
 
+// Second stage of a FORMAT_* row: 0 none, -1 lz4, otherwise the zstd level
+static const int format_chains[FORMAT_CHAINS] = {0, -1, 1, 3, 9, 19};
+#define FORMAT_OF(i) (((i) - FORMAT_QOI) / FORMAT_CHAINS)
+#define FORMAT_CHAIN(i) format_chains[((i) - FORMAT_QOI) % FORMAT_CHAINS]
+
+// Distribution of the per run times of one benchmark. In totals the fields
+// are summed per image like the mean times
+typedef struct {
+	uint64_t min;
+	uint64_t median;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t runs;
+	uint64_t outliers;
+	double ci; // 95% confidence half width in percent of the mean
+} benchmark_dist_t;
+
 typedef struct {
 	uint64_t size;
 	uint64_t encode_time;
 	uint64_t decode_time;
+	perf_counts_t encode_perf;
+	perf_counts_t decode_perf;
+	benchmark_dist_t encode_dist;
+	benchmark_dist_t decode_dist;
+	uint64_t encode_io_time; // part of encode_time spent in fread/fwrite
+	uint64_t decode_io_time;
+	benchmark_mem_t encode_mem;
+	benchmark_mem_t decode_mem;
 } benchmark_lib_result_t;
 
 typedef struct {
@@ -348,24 +921,167 @@ typedef struct {
 } benchmark_result_t;
 
 
+// The QOI_KERNEL_* for a KERNEL_* row
+#define LIB_KERNEL(i) ((i) - KERNEL_SCALAR + QOI_KERNEL_SCALAR)
+
+// The --nolz4/--nozstd* flags for a FORMAT_* chain
+int chain_enabled(int chain) {
+	switch (chain) {
+		case -1: return !opt_nolz4;
+		case 1: return !opt_nozstd1;
+		case 3: return !opt_nozstd3;
+		case 9: return !opt_nozstd9;
+		case 19: return !opt_nozstd19;
+		default: return 1;
+	}
+}
+
+int lib_enabled(int i) {
+	if (i >= KERNEL_SCALAR && i <= KERNEL_AVX512)
+		return opt_kernels && qoi_kernel_available(LIB_KERNEL(i));
+	if (i == STREAM_FILE)
+		return opt_stream;
+	if (i == STREAM_TMPFS)
+		return opt_stream && opt_stream_tmpfs;
+	if (i >= FORMAT_QOI) {
+#ifdef QOI_BENCH_FORMATS
+		return chain_enabled(FORMAT_CHAIN(i));
+#else
+		return 0;
+#endif
+	}
+	if (opt_nopng && (i == LIBPNG || i == STBI))
+		return 0;
+	if(opt_nolz4 && (i == LZ4) )
+		return 0;
+	if(opt_nozstd1 && (i == ZSTD1) )
+		return 0;
+	if(opt_nozstd3 && (i == ZSTD3) )
+		return 0;
+	if(opt_nozstd9 && (i == ZSTD9) )
+		return 0;
+	if(opt_nozstd19 && (i == ZSTD19) )
+		return 0;
+	return 1;
+}
+
+// lib_names without the alignment padding
+void lib_name(int i, char *out) {
+	int j;
+	for (j = 0; lib_names[i][j] && lib_names[i][j] != ':'; ++j)
+		out[j] = lib_names[i][j];
+	out[j] = 0;
+}
+
+// Events per pixel and miss rates for the rows that collected counters
+void perf_print_result(benchmark_result_t res) {
+	const char *na = "       -";
+	printf("              cycles/px  instr/px     IPC  br-miss%%  L1d-miss%%  LLC-miss%%  dTLB-miss%%\n");
+	for (int i = 0; i < BENCH_COUNT; ++i) {
+		for (int dir = 0; dir < 2; ++dir) {
+			perf_counts_t *p = dir ? &res.libs[i].decode_perf : &res.libs[i].encode_perf;
+			double px = res.px;
+			char col[7][16], name[16];
+			if (!lib_enabled(i) || !p->v[PERF_CYCLES])
+				continue;
+			lib_name(i, name);
+			strcat(name, dir ? " dec" : " enc");
+#define PERF_COL(n, cond, fmt, val) \
+	do { if (cond) snprintf(col[n], 16, fmt, val); else strcpy(col[n], na); } while (0)
+			PERF_COL(0, perf_fd[PERF_CYCLES] >= 0, "%8.2f", p->v[PERF_CYCLES] / px);
+			PERF_COL(1, perf_fd[PERF_INSTRUCTIONS] >= 0, "%8.2f", p->v[PERF_INSTRUCTIONS] / px);
+			PERF_COL(2, perf_fd[PERF_INSTRUCTIONS] >= 0, "%6.2f", (double)p->v[PERF_INSTRUCTIONS] / p->v[PERF_CYCLES]);
+			PERF_COL(3, p->v[PERF_BRANCHES] && perf_fd[PERF_BRANCH_MISSES] >= 0, "%7.2f%%", p->v[PERF_BRANCH_MISSES] * 100.0 / p->v[PERF_BRANCHES]);
+			PERF_COL(4, p->v[PERF_L1D_ACCESS] && perf_fd[PERF_L1D_MISS] >= 0, "%8.2f%%", p->v[PERF_L1D_MISS] * 100.0 / p->v[PERF_L1D_ACCESS]);
+			PERF_COL(5, p->v[PERF_LLC_ACCESS] && perf_fd[PERF_LLC_MISS] >= 0, "%8.2f%%", p->v[PERF_LLC_MISS] * 100.0 / p->v[PERF_LLC_ACCESS]);
+			PERF_COL(6, p->v[PERF_DTLB_ACCESS] && perf_fd[PERF_DTLB_MISS] >= 0, "%9.2f%%", p->v[PERF_DTLB_MISS] * 100.0 / p->v[PERF_DTLB_ACCESS]);
+#undef PERF_COL
+			printf("%-12s  %s  %s  %s  %s   %s   %s   %s\n",
+				name, col[0], col[1], col[2], col[3], col[4], col[5], col[6]);
+		}
+	}
+	printf("\n");
+}
+
+// Run time distribution per image for --dist. Totals show the per image
+// average of each statistic
+void dist_print_result(benchmark_result_t res) {
+	printf("                  min ms  median ms     p90 ms     p99 ms    ci95   runs  outliers\n");
+	for (int i = 0; i < BENCH_COUNT; ++i) {
+		for (int dir = 0; dir < 2; ++dir) {
+			benchmark_dist_t *d = dir ? &res.libs[i].decode_dist : &res.libs[i].encode_dist;
+			char name[16];
+			if (!lib_enabled(i) || !d->runs)
+				continue;
+			lib_name(i, name);
+			strcat(name, dir ? " dec" : " enc");
+			printf("%-16s  %7.2f    %7.2f    %7.2f    %7.2f  %5.1f%%  %5"PRIu64"  %8"PRIu64"\n",
+				name,
+				(double)d->min / res.count / 1000000.0,
+				(double)d->median / res.count / 1000000.0,
+				(double)d->p90 / res.count / 1000000.0,
+				(double)d->p99 / res.count / 1000000.0,
+				d->ci / res.count,
+				d->runs / res.count,
+				d->outliers / res.count
+			);
+		}
+	}
+	printf("\n");
+}
+
+// Allocations per call for --mem. Totals show the per image average count
+// and bytes, and the largest peak of any image
+void mem_print_result(benchmark_result_t res) {
+	printf("              enc allocs   peak kb  total kb   dec allocs   peak kb  total kb\n");
+	for (int i = 0; i < BENCH_COUNT; ++i) {
+		benchmark_lib_result_t *l = &res.libs[i];
+		if (!lib_enabled(i))
+			continue;
+		printf("%s   %7"PRIu64"  %8"PRIu64"  %8"PRIu64"      %7"PRIu64"  %8"PRIu64"  %8"PRIu64"\n",
+			lib_names[i],
+			l->encode_mem.allocs / res.count,
+			l->encode_mem.peak / 1024,
+			l->encode_mem.total / res.count / 1024,
+			l->decode_mem.allocs / res.count,
+			l->decode_mem.peak / 1024,
+			l->decode_mem.total / res.count / 1024
+		);
+	}
+	printf("\n");
+}
+
+// Streaming time split into file I/O and the rest (codec, header parsing,
+// open/close), per CHUNK pixels since that is the unit of the streaming loop
+void stream_print_result(benchmark_result_t res) {
+	double chunks = (double)res.px / CHUNK;
+	printf("              enc us/chunk       io    codec   dec us/chunk       io    codec\n");
+	for (int i = STREAM_FILE; i <= STREAM_TMPFS; ++i) {
+		benchmark_lib_result_t *l = &res.libs[i];
+		if (!lib_enabled(i))
+			continue;
+		printf("%s    %9.1f %8.1f %8.1f      %9.1f %8.1f %8.1f\n",
+			lib_names[i],
+			l->encode_time / chunks / 1000.0,
+			l->encode_io_time / chunks / 1000.0,
+			(l->encode_time - l->encode_io_time) / chunks / 1000.0,
+			l->decode_time / chunks / 1000.0,
+			l->decode_io_time / chunks / 1000.0,
+			(l->decode_time - l->decode_io_time) / chunks / 1000.0
+		);
+	}
+	printf("\n");
+}
+
 void benchmark_print_result(benchmark_result_t res) {
+	benchmark_result_t total = res;
 	res.px /= res.count;
 	res.raw_size /= res.count;
 
 	double px = res.px;
 	printf("              decode ms   encode ms   decode mpps   encode mpps   size kb    rate\n");
 	for (int i = 0; i < BENCH_COUNT; ++i) {
-		if (opt_nopng && (i == LIBPNG || i == STBI))
-			continue;
-		if(opt_nolz4 && (i == LZ4) )
-			continue;
-		if(opt_nozstd1 && (i == ZSTD1) )
-			continue;
-		if(opt_nozstd3 && (i == ZSTD3) )
-			continue;
-		if(opt_nozstd9 && (i == ZSTD9) )
-			continue;
-		if(opt_nozstd19 && (i == ZSTD19) )
+		if (!lib_enabled(i))
 			continue;
 		res.libs[i].encode_time /= res.count;
 		res.libs[i].decode_time /= res.count;
@@ -382,201 +1098,920 @@ void benchmark_print_result(benchmark_result_t res) {
 		);
 	}
 	printf("\n");
+	if (opt_mem)
+		mem_print_result(total);
+	if (opt_stream)
+		stream_print_result(total);
+	if (opt_dist)
+		dist_print_result(total);
+	if (opt_perf)
+		perf_print_result(total);
 }
 
-// Run __VA_ARGS__ a number of times and measure the time taken. The first
-// run is ignored.
-#define BENCHMARK_FN(NOWARMUP, RUNS, AVG_TIME, ...) \
-	do { \
-		uint64_t time = 0; \
-		for (int i = NOWARMUP; i <= RUNS; i++) { \
-			uint64_t time_start = ns(); \
-			__VA_ARGS__ \
-			uint64_t time_end = ns(); \
-			if (i > 0) { \
-				time += time_end - time_start; \
-			} \
-		} \
-		AVG_TIME = time / RUNS; \
-	} while (0)
-
-
-benchmark_result_t benchmark_image(const char *path) {
-	int encoded_png_size;
-	int encoded_qoi_size;
-	int encoded_qoi_lz4_size=0;
-	int encoded_qoi_zstd1_size=0;
-	int encoded_qoi_zstd3_size=0;
-	int encoded_qoi_zstd9_size=0;
-	int encoded_qoi_zstd19_size=0;
-	int w;
-	int h;
-	int channels;
+// -----------------------------------------------------------------------------
+// machine-readable output and baseline comparison
 
-	// Load the encoded PNG, encoded QOI and raw pixels into memory
-	if(!stbi_info(path, &w, &h, &channels)) {
-		ERROR("Error decoding header %s", path);
+// Per image results kept for --json, --csv and --compare. The class of an
+// image is the directory it was found in
+typedef struct {
+	char *path;
+	char *class;
+	benchmark_result_t res;
+} benchmark_record_t;
+
+benchmark_record_t *records = NULL;
+int records_len = 0;
+int records_cap = 0;
+
+void record_add(benchmark_record_t **arr, int *len, int *cap, const char *path, const char *class, benchmark_result_t res) {
+	if (*len == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		*arr = realloc(*arr, *cap * sizeof(benchmark_record_t));
+		if (!*arr) {
+			ERROR("Malloc for %d records failed", *cap);
+		}
 	}
+	(*arr)[*len].path = strdup(path);
+	(*arr)[*len].class = strdup(class);
+	(*arr)[*len].res = res;
+	(*len)++;
+}
 
-	if (channels != 3)
-		channels = 4;
-	void *pixels = (void *)stbi_load(path, &w, &h, NULL, channels);
-	pixels=realloc(pixels, (w*h*channels)+65);
-
-	memmove(pixels+64, pixels, w*h*channels);//hack to simplify simd code, qoi_encode requires leading allocated space
-	void *encoded_png = fload(path, &encoded_png_size);
+void record_free(benchmark_record_t *arr, int len) {
+	for (int i = 0; i < len; ++i) {
+		free(arr[i].path);
+		free(arr[i].class);
+	}
+	free(arr);
+}
 
-	void *encoded_qoi = qoi_encode(pixels+64, &(qoi_desc){
-			.width = w,
-			.height = h, 
-			.channels = channels,
-			.colorspace = QOI_SRGB
-		}, &encoded_qoi_size, &opt);
+void json_write_str(FILE *fo, const char *str) {
+	fputc('"', fo);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', fo);
+		fputc(*str, fo);
+	}
+	fputc('"', fo);
+}
 
-	void *encoded_qoi_lz4=NULL;
-	void *encoded_qoi_zstd1=NULL;
-	void *encoded_qoi_zstd3=NULL;
-	void *encoded_qoi_zstd9=NULL;
-	void *encoded_qoi_zstd19=NULL;
-	if(!opt_nolz4) {
-		encoded_qoi_lz4 = malloc(LZ4_compressBound(encoded_qoi_size));
-		encoded_qoi_lz4_size = LZ4_compress_default(encoded_qoi, encoded_qoi_lz4, encoded_qoi_size, LZ4_compressBound(encoded_qoi_size));
+// Parse a string written by json_write_str, returns a pointer past the closing quote
+const char *json_read_str(const char *in, char *out, int out_len) {
+	int j = 0;
+	if (*in++ != '"')
+		return NULL;
+	for (; *in && *in != '"'; ++in) {
+		if (*in == '\\' && in[1])
+			++in;
+		if (j < out_len - 1)
+			out[j++] = *in;
 	}
-	if(!opt_nozstd1) {
-		encoded_qoi_zstd1 = malloc(ZSTD_compressBound(encoded_qoi_size));
-		encoded_qoi_zstd1_size = ZSTD_compress(encoded_qoi_zstd1, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 1);
+	out[j] = 0;
+	return *in ? in + 1 : NULL;
+}
+
+// One image per line so --compare can read it back without a full json parser
+void json_write_result(FILE *fo, benchmark_result_t res) {
+	double px = (double)res.px / res.count;
+	fprintf(fo, "\"w\": %d, \"h\": %d, \"count\": %d, \"px\": %"PRIu64", \"raw_size\": %"PRIu64", \"libs\": {", res.w, res.h, res.count, res.px, res.raw_size);
+	for (int i = 0, first = 1; i < BENCH_COUNT; ++i) {
+		char name[16];
+		uint64_t enc = res.libs[i].encode_time / res.count;
+		uint64_t dec = res.libs[i].decode_time / res.count;
+		if (!lib_enabled(i))
+			continue;
+		lib_name(i, name);
+		fprintf(fo, "%s\"%s\": {\"encode_ns\": %"PRIu64", \"decode_ns\": %"PRIu64", \"encode_mpps\": %.3f, \"decode_mpps\": %.3f, \"size\": %"PRIu64", \"encode_peak\": %"PRIu64", \"decode_peak\": %"PRIu64"}",
+			first ? "" : ", ", name, enc, dec,
+			enc > 0 ? px / ((double)enc/1000.0) : 0,
+			dec > 0 ? px / ((double)dec/1000.0) : 0,
+			res.libs[i].size / res.count,
+			res.libs[i].encode_mem.peak,
+			res.libs[i].decode_mem.peak
+		);
+		first = 0;
 	}
-	if(!opt_nozstd3) {
-		encoded_qoi_zstd3 = malloc(ZSTD_compressBound(encoded_qoi_size));
-		encoded_qoi_zstd3_size = ZSTD_compress(encoded_qoi_zstd3, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 3);
+	fprintf(fo, "}");
+}
+
+void benchmark_write_json(const char *path, benchmark_result_t grand_total) {
+	FILE *fo = fopen(path, "w");
+	if (!fo) {
+		ERROR("Can't open %s", path);
 	}
-	if(!opt_nozstd9) {
-		encoded_qoi_zstd9 = malloc(ZSTD_compressBound(encoded_qoi_size));
-		encoded_qoi_zstd9_size = ZSTD_compress(encoded_qoi_zstd9, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 9);
+	fprintf(fo, "{\n\"format\": \""EXT_STR"\",\n\"codepath\": \""CODEPATH"%s\",\n\"runs\": %d,\n\"images\": [\n", opt.mlut ? "+mlut" : "", opt_runs);
+	for (int i = 0; i < records_len; ++i) {
+		fprintf(fo, "{\"path\": ");
+		json_write_str(fo, records[i].path);
+		fprintf(fo, ", \"class\": ");
+		json_write_str(fo, records[i].class);
+		fprintf(fo, ", ");
+		json_write_result(fo, records[i].res);
+		fprintf(fo, "}%s\n", i + 1 < records_len ? "," : "");
 	}
-	if(!opt_nozstd19) {
-		encoded_qoi_zstd19 = malloc(ZSTD_compressBound(encoded_qoi_size));
-		encoded_qoi_zstd19_size = ZSTD_compress(encoded_qoi_zstd19, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 19);
+	fprintf(fo, "],\n\"total\": {");
+	json_write_result(fo, grand_total);
+	fprintf(fo, "}\n}\n");
+	fclose(fo);
+}
+
+// Quoted with embedded quotes doubled, as RFC 4180 has it
+void csv_write_str(FILE *fo, const char *str) {
+	fputc('"', fo);
+	for (; *str; ++str) {
+		if (*str == '"')
+			fputc('"', fo);
+		fputc(*str, fo);
 	}
+	fputc('"', fo);
+}
 
-	if (!pixels || !encoded_qoi || !encoded_png) {
-		ERROR("Error encoding %s", path);
+void csv_write_result(FILE *fo, const char *path, const char *class, benchmark_result_t res) {
+	double px = (double)res.px / res.count;
+	for (int i = 0; i < BENCH_COUNT; ++i) {
+		char name[16];
+		uint64_t enc = res.libs[i].encode_time / res.count;
+		uint64_t dec = res.libs[i].decode_time / res.count;
+		if (!lib_enabled(i))
+			continue;
+		lib_name(i, name);
+		csv_write_str(fo, path);
+		fputc(',', fo);
+		csv_write_str(fo, class);
+		fprintf(fo, ","CODEPATH"%s,%d,%d,%d,%s,%"PRIu64",%"PRIu64",%.3f,%.3f,%"PRIu64",%"PRIu64"\n",
+			opt.mlut ? "+mlut" : "", res.w, res.h, res.count, name, enc, dec,
+			enc > 0 ? px / ((double)enc/1000.0) : 0,
+			dec > 0 ? px / ((double)dec/1000.0) : 0,
+			res.libs[i].size / res.count, res.raw_size / res.count
+		);
 	}
+}
 
-	// Verify QOI Output
+void benchmark_write_csv(const char *path, benchmark_result_t grand_total) {
+	FILE *fo = fopen(path, "w");
+	if (!fo) {
+		ERROR("Can't open %s", path);
+	}
+	fprintf(fo, "path,class,codepath,w,h,count,lib,encode_ns,decode_ns,encode_mpps,decode_mpps,size,raw_size\n");
+	for (int i = 0; i < records_len; ++i)
+		csv_write_result(fo, records[i].path, records[i].class, records[i].res);
+	csv_write_result(fo, "total", "", grand_total);
+	fclose(fo);
+}
 
-	if (!opt_noverify) {
-		qoi_desc dc;
-		void *pixels_qoi = qoi_decode(encoded_qoi, encoded_qoi_size, &dc, channels);
-		if (memcmp(pixels+64, pixels_qoi, w * h * channels) != 0) {
-			ERROR(EXT_STR" roundtrip pixel mismatch for %s", path);
+// Read back the per image lines of a file written by --json
+int benchmark_read_json(const char *path, benchmark_record_t **arr, int *len) {
+	char line[8192], img_path[1024], class[1024], name[16];
+	int cap = 0;
+	FILE *fi = fopen(path, "r");
+	if (!fi)
+		return 1;
+	while (fgets(line, sizeof(line), fi)) {
+		benchmark_result_t res = {0};
+		const char *p;
+		if (strncmp(line, "{\"path\": ", 9) != 0)
+			continue;
+		if (!(p = json_read_str(line + 9, img_path, sizeof(img_path))))
+			continue;
+		if (strncmp(p, ", \"class\": ", 11) != 0 || !(p = json_read_str(p + 11, class, sizeof(class))))
+			continue;
+		if (sscanf(p, ", \"w\": %d, \"h\": %d, \"count\": %d, \"px\": %"SCNu64", \"raw_size\": %"SCNu64, &res.w, &res.h, &res.count, &res.px, &res.raw_size) != 5)
+			continue;
+		for (int i = 0; i < BENCH_COUNT; ++i) {
+			char key[32];
+			const char *l;
+			lib_name(i, name);
+			snprintf(key, sizeof(key), "\"%s\": {", name);
+			if (!(l = strstr(p, key)))
+				continue;
+			sscanf(l + strlen(key), "\"encode_ns\": %"SCNu64", \"decode_ns\": %"SCNu64", \"encode_mpps\": %*f, \"decode_mpps\": %*f, \"size\": %"SCNu64", \"encode_peak\": %"SCNu64", \"decode_peak\": %"SCNu64,
+				&res.libs[i].encode_time, &res.libs[i].decode_time, &res.libs[i].size, &res.libs[i].encode_mem.peak, &res.libs[i].decode_mem.peak);
 		}
-		free(pixels_qoi);
+		record_add(arr, len, &cap, img_path, class, res);
 	}
+	fclose(fi);
+	return 0;
+}
 
-	benchmark_result_t res = {0};
-	res.count = 1;
+// Student-t critical value for df degrees of freedom at the 97.5% one-sided
+// level, 1.96 in the limit. Beyond the table it steps down to the next smaller
+// tabled df, which errs towards not flagging
+double student_t(int df) {
+	static const double t[] = {
+		INFINITY, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+	};
+	if (df < 1)
+		return INFINITY;
+	if (df < (int)(sizeof(t) / sizeof(t[0])))
+		return t[df];
+	return df < 40 ? 2.042 : df < 60 ? 2.021 : df < 120 ? 2.000 : df < 1000 ? 1.980 : 1.960;
+}
+
+// Per class and lib, compare each image against the baseline. A timing change
+// is flagged when the geometric mean slowdown exceeds the threshold and a
+// one-sided t-test on the per image log ratios is significant, against the
+// Student-t value for the class size so a couple of images rarely pass. Sizes and peak
+// memory are deterministic so any growth of a class total is flagged.
+// Returns the number of regressions found
+int benchmark_compare(const char *path) {
+	benchmark_record_t *base = NULL;
+	int base_len = 0, regressions = 0;
+
+	if (benchmark_read_json(path, &base, &base_len)) {
+		ERROR("Can't read baseline %s", path);
+	}
+	printf("## Compare against %s (threshold %.1f%%)\n\n", path, opt_compare_threshold);
+	printf("class                             lib        metric   images     change        t\n");
+
+	for (int c = 0; c < records_len; ++c) {
+		int seen = 0;
+		for (int k = 0; k < c; ++k) {
+			if (strcmp(records[k].class, records[c].class) == 0) {
+				seen = 1;
+				break;
+			}
+		}
+		if (seen)
+			continue;
+
+		for (int lib = 0; lib < BENCH_COUNT; ++lib) {
+			char name[16];
+			if (!lib_enabled(lib))
+				continue;
+			lib_name(lib, name);
+			static const char *const metric_names[] = {"encode", "decode", "size", "enc mem", "dec mem"};
+			for (int metric = 0; metric < 5; ++metric) {
+				double sum = 0, sum2 = 0;
+				uint64_t size_new = 0, size_base = 0;
+				int n = 0;
+				for (int i = c; i < records_len; ++i) {
+					if (strcmp(records[i].class, records[c].class) != 0)
+						continue;
+					for (int j = 0; j < base_len; ++j) {
+						if (strcmp(records[i].path, base[j].path) != 0)
+							continue;
+						benchmark_lib_result_t *r = &records[i].res.libs[lib], *b = &base[j].res.libs[lib];
+						uint64_t vn[] = {r->encode_time, r->decode_time, r->size, r->encode_mem.peak, r->decode_mem.peak};
+						uint64_t vb[] = {b->encode_time, b->decode_time, b->size, b->encode_mem.peak, b->decode_mem.peak};
+						if (vn[metric] && vb[metric]) {
+							double d = log((double)vn[metric] / (double)vb[metric]);
+							sum += d;
+							sum2 += d * d;
+							size_new += vn[metric];
+							size_base += vb[metric];
+							n++;
+						}
+						break;
+					}
+				}
+				if (!n)
+					continue;
+
+				double change, t = 0;
+				int flag;
+				if (metric >= 2) {
+					change = ((double)size_new / (double)size_base - 1.0) * 100.0;
+					flag = size_new > size_base;
+				}
+				else {
+					double mean = sum / n;
+					double var = n > 1 ? (sum2 - n * mean * mean) / (n - 1) : 0;
+					change = (exp(mean) - 1.0) * 100.0;
+					if (var > 0)
+						t = mean / sqrt(var / n);
+					else if (n > 1 && mean > 0)
+						t = INFINITY;
+					flag = change > opt_compare_threshold && t > student_t(n - 1);
+				}
+				if (flag) {
+					regressions++;
+					printf("%-32s  %-10s %-8s %6d   %+7.2f%%   %6.2f  %s\n",
+						records[c].class, name, metric_names[metric],
+						n, change, t, metric == 2 ? "SIZE REGRESSION" : metric > 2 ? "MEMORY REGRESSION" : "SLOWDOWN");
+				}
+			}
+		}
+	}
+	printf("\n%d regression%s\n\n", regressions, regressions == 1 ? "" : "s");
+	record_free(base, base_len);
+	return regressions;
+}
+
+// -----------------------------------------------------------------------------
+// op stream statistics, requires a QOI_STATS build
+
+#ifdef QOI_STATS
+void stats_add(qoi_stats *total, const qoi_stats *st) {
+	for (int i = 0; i < QOI_STATS_OPS; ++i) {
+		total->op_cnt[i] += st->op_cnt[i];
+		total->op_bytes[i] += st->op_bytes[i];
+	}
+	for (int i = 0; i < 64; ++i)
+		total->run_op_hist[i] += st->run_op_hist[i];
+	for (int i = 0; i < 32; ++i)
+		total->run_hist[i] += st->run_hist[i];
+	total->sse_blocks += st->sse_blocks;
+	total->sse_alpha_fallback += st->sse_alpha_fallback;
+}
+
+void stats_print(const qoi_stats *enc, const qoi_stats *dec) {
+	uint64_t ops = 0, bytes = 0, dec_ops = 0;
+	for (int i = 0; i < QOI_STATS_OPS; ++i) {
+		ops += enc->op_cnt[i];
+		bytes += enc->op_bytes[i];
+		dec_ops += dec->op_cnt[i];
+	}
+	printf("op            enc ops    ops%%     enc bytes  bytes%%   dec ops\n");
+	for (int i = 0; i < QOI_STATS_OPS; ++i) {
+		if (!qoi_stats_op_names[i][0])
+			continue;
+		printf("%-9s %11llu  %5.1f%%  %12llu  %5.1f%%  %8llu\n",
+			qoi_stats_op_names[i],
+			enc->op_cnt[i], ops ? enc->op_cnt[i] * 100.0 / ops : 0,
+			enc->op_bytes[i], bytes ? enc->op_bytes[i] * 100.0 / bytes : 0,
+			dec->op_cnt[i]
+		);
+	}
+	printf("total     %11"PRIu64"          %12"PRIu64"          %8"PRIu64"\n", ops, bytes, dec_ops);
+
+	printf("run op pixels:");
+	for (int i = 0; i < 64; ++i) {
+		if (enc->run_op_hist[i])
+			printf(" %d:%llu", i + 1, enc->run_op_hist[i]);
+	}
+	printf("\nrun pixels:   ");
+	for (int i = 0; i < 32; ++i) {
+		if (enc->run_hist[i])
+			printf(" %u-%u:%llu", 1u << i, (2u << i) - 1, enc->run_hist[i]);
+	}
+	printf("\n");
+	if (enc->sse_blocks) {
+		printf("sse blocks: %llu, alpha fallback to scalar: %llu (%.1f%%)\n",
+			enc->sse_blocks, enc->sse_alpha_fallback, enc->sse_alpha_fallback * 100.0 / enc->sse_blocks);
+	}
+	printf("\n");
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// I/O hooks of the streaming benchmark
+
+uint64_t stream_io_time = 0;
+int stream_timing = 0;
+const char *stream_cold_path = NULL;
+
+size_t stream_fread(void *p, size_t sz, size_t n, FILE *f) {
+	if (!stream_timing)
+		return fread(p, sz, n, f);
+	uint64_t t = ns();
+	size_t r = fread(p, sz, n, f);
+	stream_io_time += ns() - t;
+	return r;
+}
+
+size_t stream_fwrite(const void *p, size_t sz, size_t n, FILE *f) {
+	if (!stream_timing)
+		return fwrite(p, sz, n, f);
+	uint64_t t = ns();
+	size_t r = fwrite(p, sz, n, f);
+	stream_io_time += ns() - t;
+	return r;
+}
+
+// Write back and drop a file from the page cache so the next read comes from
+// the disk. Has no effect on tmpfs, where the page cache is the storage
+void stream_drop_cache(const char *path) {
+#if defined(__linux)
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+#else
+	(void)path;
+#endif
+}
+
+
+// -----------------------------------------------------------------------------
+// run control and timing statistics
+
+// Evict the caches between runs for --cold by writing a buffer larger than
+// the last level cache. The streaming benchmark also drops its input file
+// from the page cache
+#define COLD_FLUSH_SIZE (256 << 20)
+void cache_flush(void) {
+	static unsigned char *buf = NULL;
+	if (!buf && !(buf = malloc(COLD_FLUSH_SIZE))) {
+		ERROR("Malloc for %d bytes failed", COLD_FLUSH_SIZE);
+	}
+	for (size_t i = 0; i < COLD_FLUSH_SIZE; i += 64)
+		buf[i]++;
+}
+
+void cpu_pin(int cpu) {
+#if defined(__linux)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		ERROR("Could not pin to cpu %d", cpu);
+	}
+#else
+	printf("CPU pinning is not supported on this platform, --pin ignored\n\n");
+	(void)cpu;
+#endif
+}
+
+typedef struct {
+	uint64_t *t;
+	int n;
+	int cap;
+	int target;
+	int step;
+} benchmark_samples_t;
+
+benchmark_samples_t samples_begin(int runs) {
+	benchmark_samples_t bs = {.target = runs, .step = runs};
+	bs.cap = runs > opt_max_runs ? runs : opt_max_runs;
+	if (!(bs.t = malloc(bs.cap * sizeof(uint64_t)))) {
+		ERROR("Malloc for %d samples failed", bs.cap);
+	}
+	return bs;
+}
+
+int samples_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Mean and 95% confidence half width (percent of the mean) of t[0..n)
+static double samples_mean(const uint64_t *t, int n, double *ci) {
+	double sum = 0, var = 0;
+	for (int i = 0; i < n; ++i)
+		sum += t[i];
+	double mean = sum / n;
+	for (int i = 0; i < n; ++i)
+		var += (t[i] - mean) * (t[i] - mean);
+	*ci = n > 1 && mean > 0 ? 1.96 * sqrt(var / (n - 1) / n) / mean * 100.0 : 0;
+	return mean;
+}
+
+// With --adaptive keep adding runs until the confidence interval is within
+// opt_adaptive percent of the mean or opt_max_runs is reached
+void samples_extend(benchmark_samples_t *bs) {
+	double ci;
+	if (!opt_adaptive || bs->n >= bs->cap)
+		return;
+	samples_mean(bs->t, bs->n, &ci);
+	if (bs->n < 3 || ci > opt_adaptive)
+		bs->target = bs->n + bs->step < bs->cap ? bs->n + bs->step : bs->cap;
+}
+
+// Sort the samples, fill in dist and return the mean. Unless
+// --keep-outliers is given, runs outside the Tukey fences (1.5 times the
+// interquartile range beyond the quartiles) are left out of the mean
+uint64_t samples_end(benchmark_samples_t *bs, benchmark_dist_t *dist) {
+	uint64_t *t = bs->t;
+	int n = bs->n, lo = 0, hi = n;
+	qsort(t, n, sizeof(uint64_t), samples_cmp);
+	if (!opt_keep_outliers && n >= 5) {
+		double q1 = t[n / 4], q3 = t[(3 * n) / 4];
+		while (lo < n && t[lo] < q1 - 1.5 * (q3 - q1))
+			lo++;
+		while (hi > lo && t[hi - 1] > q3 + 1.5 * (q3 - q1))
+			hi--;
+	}
+	double ci;
+	uint64_t mean = samples_mean(t + lo, hi - lo, &ci);
+	if (dist) {
+		dist->min = t[0];
+		dist->median = t[n / 2];
+		dist->p90 = t[(n * 90) / 100];
+		dist->p99 = t[(n * 99) / 100];
+		dist->runs = n;
+		dist->outliers = n - (hi - lo);
+		dist->ci = ci;
+	}
+	free(t);
+	return mean;
+}
+
+// Run __VA_ARGS__ a number of times and measure the time taken. The first
+// run is ignored. With a non-NULL PERF the hardware counters are collected
+// over the timed runs too, with a non-NULL DIST the min/median/percentiles
+// are stored there and with a non-NULL MEM the allocations per run.
+#define BENCHMARK_PERF_FN(NOWARMUP, RUNS, AVG_TIME, DIST, MEM, PERF, ...) \
+	do { \
+		benchmark_samples_t samples = samples_begin(RUNS); \
+		perf_reset(PERF); \
+		mem_begin(MEM); \
+		for (int i = NOWARMUP; i <= samples.target; i++) { \
+			if (opt_cold) \
+				cache_flush(); \
+			if (stream_cold_path) \
+				stream_drop_cache(stream_cold_path); \
+			if (i > 0) \
+				perf_start(PERF); \
+			uint64_t time_start = ns(); \
+			__VA_ARGS__ \
+			uint64_t time_end = ns(); \
+			if (i > 0) { \
+				perf_stop(PERF); \
+				samples.t[samples.n++] = time_end - time_start; \
+				if (i == samples.target) \
+					samples_extend(&samples); \
+			} \
+		} \
+		perf_read(PERF, samples.n); \
+		mem_end(MEM, samples.n + !(NOWARMUP)); \
+		AVG_TIME = samples_end(&samples, DIST); \
+	} while (0)
+
+#define BENCHMARK_FN(NOWARMUP, RUNS, AVG_TIME, DIST, MEM, ...) \
+	BENCHMARK_PERF_FN(NOWARMUP, RUNS, AVG_TIME, DIST, MEM, NULL, __VA_ARGS__)
+
+
+// Time qoi_write_from_ppm/pam and qoi_read_to_ppm/pam file to file in dir.
+// The part of the time spent in fread/fwrite is kept as the I/O time
+void benchmark_stream(benchmark_result_t *res, int lib, const char *dir, const char *path, void *pixels, int w, int h, int channels) {
+	char raw_path[1024], enc_path[1024], dec_path[1024];
+	const char *ext = channels == 3 ? "ppm" : "pam";
+	int (*enc_fn)(const char *, const char *, const options *) = channels == 3 ? qoi_write_from_ppm : qoi_write_from_pam;
+	int (*dec_fn)(const char *, const char *, const options *) = channels == 3 ? qoi_read_to_ppm : qoi_read_to_pam;
+	uint64_t io_sum, total_sum;
+	snprintf(raw_path, sizeof(raw_path), "%s/qoibench_stream.%s", dir, ext);
+	snprintf(enc_path, sizeof(enc_path), "%s/qoibench_stream."EXT_STR, dir);
+	snprintf(dec_path, sizeof(dec_path), "%s/qoibench_stream_out.%s", dir, ext);
+
+	// Same header as qoi_read_to_ppm/pam write, so the roundtrip can be compared
+	FILE *fh = fopen(raw_path, "wb");
+	if (!fh) {
+		ERROR("Can't open %s", raw_path);
+	}
+	if (channels == 3)
+		fprintf(fh, "P6 %u %u 255\n", w, h);
+	else
+		fprintf(fh, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", w, h);
+	if (fwrite(pixels+64, 1, w * h * channels, fh) != (size_t)(w * h * channels)) {
+		ERROR("Can't write %s", raw_path);
+	}
+	fclose(fh);
+	if (enc_fn(raw_path, enc_path, &opt)) {
+		ERROR("Error streaming %s to %s", path, enc_path);
+	}
+
+	stream_timing = 1;
+	if (!opt_noencode) {
+		io_sum = total_sum = 0;
+		stream_cold_path = opt_cold ? raw_path : NULL;
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res->libs[lib].encode_time, &res->libs[lib].encode_dist, &res->libs[lib].encode_mem, {
+			uint64_t io = stream_io_time, t = ns();
+			if (enc_fn(raw_path, enc_path, &opt)) {
+				ERROR("Error streaming %s to %s", path, enc_path);
+			}
+			io_sum += stream_io_time - io;
+			total_sum += ns() - t;
+		});
+		res->libs[lib].encode_io_time = total_sum ? (double)res->libs[lib].encode_time * io_sum / total_sum : 0;
+	}
+	if (!opt_nodecode) {
+		io_sum = total_sum = 0;
+		stream_cold_path = opt_cold ? enc_path : NULL;
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res->libs[lib].decode_time, &res->libs[lib].decode_dist, &res->libs[lib].decode_mem, {
+			uint64_t io = stream_io_time, t = ns();
+			if (dec_fn(enc_path, dec_path, &opt)) {
+				ERROR("Error streaming %s to %s", enc_path, dec_path);
+			}
+			io_sum += stream_io_time - io;
+			total_sum += ns() - t;
+		});
+		res->libs[lib].decode_io_time = total_sum ? (double)res->libs[lib].decode_time * io_sum / total_sum : 0;
+	}
+	stream_cold_path = NULL;
+	stream_timing = 0;
+
+	int raw_size, enc_size, dec_size;
+	void *enc = fload(enc_path, &enc_size);
+	res->libs[lib].size = enc_size;
+	free(enc);
+	if (!opt_noverify && !opt_nodecode) {
+		void *raw = fload(raw_path, &raw_size);
+		void *dec = fload(dec_path, &dec_size);
+		if (raw_size != dec_size || memcmp(raw, dec, raw_size) != 0) {
+			ERROR("%s streaming roundtrip mismatch for %s", dir, path);
+		}
+		free(raw);
+		free(dec);
+	}
+	remove(raw_path);
+	remove(enc_path);
+	remove(dec_path);
+}
+
+// Second stage of a FORMAT_* row, see format_chains. Returns a mem_malloc'd
+// buffer
+void *chain_compress(int chain, const void *src, int size, int *out_size) {
+	if (chain < 0) {
+		void *dst = mem_malloc(LZ4_compressBound(size));
+		*out_size = LZ4_compress_default(src, dst, size, LZ4_compressBound(size));
+		return dst;
+	}
+	void *dst = mem_malloc(ZSTD_compressBound(size));
+	*out_size = ZSTD_compress(dst, ZSTD_compressBound(size), src, size, chain);
+	return dst;
+}
+
+void chain_decompress(int chain, const void *src, int size, void *dst, int dst_size) {
+	if (chain < 0)
+		LZ4_decompress_safe(src, dst, size, dst_size);
+	else
+		ZSTD_decompress(dst, dst_size, src, size);
+}
+
+// Benchmark raw pixels already in memory. pixels must have 64 bytes of leading
+// allocated space, encoded_png may be NULL when there is no PNG to compare
+// against. Takes ownership of both buffers
+benchmark_result_t benchmark_pixels(const char *path, void *pixels, int w, int h, int channels, void *encoded_png, int encoded_png_size) {
+	int encoded_qoi_size;
+	int encoded_qoi_lz4_size=0;
+	int encoded_qoi_zstd1_size=0;
+	int encoded_qoi_zstd3_size=0;
+	int encoded_qoi_zstd9_size=0;
+	int encoded_qoi_zstd19_size=0;
+	int nopng = opt_nopng || !encoded_png;
+
+#ifdef QOI_STATS
+	if (opt_stats)
+		qoi_stats_reset();
+#endif
+
+	void *encoded_qoi = qoi_encode(pixels+64, &(qoi_desc){
+			.width = w,
+			.height = h, 
+			.channels = channels,
+			.colorspace = QOI_SRGB
+		}, &encoded_qoi_size, &opt);
+
+	void *encoded_qoi_lz4=NULL;
+	void *encoded_qoi_zstd1=NULL;
+	void *encoded_qoi_zstd3=NULL;
+	void *encoded_qoi_zstd9=NULL;
+	void *encoded_qoi_zstd19=NULL;
+	if(!opt_nolz4) {
+		encoded_qoi_lz4 = malloc(LZ4_compressBound(encoded_qoi_size));
+		encoded_qoi_lz4_size = LZ4_compress_default(encoded_qoi, encoded_qoi_lz4, encoded_qoi_size, LZ4_compressBound(encoded_qoi_size));
+	}
+	if(!opt_nozstd1) {
+		encoded_qoi_zstd1 = malloc(ZSTD_compressBound(encoded_qoi_size));
+		encoded_qoi_zstd1_size = ZSTD_compress(encoded_qoi_zstd1, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 1);
+	}
+	if(!opt_nozstd3) {
+		encoded_qoi_zstd3 = malloc(ZSTD_compressBound(encoded_qoi_size));
+		encoded_qoi_zstd3_size = ZSTD_compress(encoded_qoi_zstd3, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 3);
+	}
+	if(!opt_nozstd9) {
+		encoded_qoi_zstd9 = malloc(ZSTD_compressBound(encoded_qoi_size));
+		encoded_qoi_zstd9_size = ZSTD_compress(encoded_qoi_zstd9, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 9);
+	}
+	if(!opt_nozstd19) {
+		encoded_qoi_zstd19 = malloc(ZSTD_compressBound(encoded_qoi_size));
+		encoded_qoi_zstd19_size = ZSTD_compress(encoded_qoi_zstd19, ZSTD_compressBound(encoded_qoi_size), encoded_qoi, encoded_qoi_size, 19);
+	}
+
+	if (!encoded_qoi) {
+		ERROR("Error encoding %s", path);
+	}
+
+	// Verify QOI Output
+
+	if (!opt_noverify) {
+		qoi_desc dc;
+		void *pixels_qoi = qoi_decode(encoded_qoi, encoded_qoi_size, &dc, channels);
+		if (memcmp(pixels+64, pixels_qoi, w * h * channels) != 0) {
+			ERROR(EXT_STR" roundtrip pixel mismatch for %s", path);
+		}
+		free(pixels_qoi);
+	}
+
+#ifdef QOI_STATS
+	if (opt_stats) {
+		qoi_stats st_enc, st_dec;
+		if (opt_noverify) {
+			qoi_desc dc;
+			free(qoi_decode(encoded_qoi, encoded_qoi_size, &dc, channels));
+		}
+		qoi_stats_get(&st_enc, &st_dec);
+		stats_add(&stats_total_enc, &st_enc);
+		stats_add(&stats_total_dec, &st_dec);
+		if (!opt_onlytotals) {
+			printf("## %s op stats\n", path);
+			stats_print(&st_enc, &st_dec);
+		}
+	}
+#endif
+
+	// Every kernel must produce exactly the bytes of the scalar kernel
+	void *encoded_kernel[BENCH_COUNT] = {0};
+	int encoded_kernel_size[BENCH_COUNT] = {0};
+	for (int k = KERNEL_SCALAR; k <= KERNEL_AVX512; ++k) {
+		if (!lib_enabled(k))
+			continue;
+		options kopt = opt;
+		kopt.kernel = LIB_KERNEL(k);
+		encoded_kernel[k] = qoi_encode(pixels+64, &(qoi_desc){
+				.width = w,
+				.height = h,
+				.channels = channels,
+				.colorspace = QOI_SRGB
+			}, &encoded_kernel_size[k], &kopt);
+		char name[16];
+		lib_name(k, name);
+		if (!encoded_kernel[k]) {
+			ERROR("Error encoding %s with %s", path, name);
+		}
+		if (
+			encoded_kernel_size[k] != encoded_kernel_size[KERNEL_SCALAR] ||
+			memcmp(encoded_kernel[k], encoded_kernel[KERNEL_SCALAR], encoded_kernel_size[k]) != 0
+		) {
+			ERROR("%s output differs from scalar for %s", name, path);
+		}
+	}
+
+	// The other formats on the same pixels, verified like the main one. The
+	// first row of each format holds its own encoding, the rest the chains
+	void *encoded_format[BENCH_COUNT] = {0};
+	int encoded_format_size[BENCH_COUNT] = {0};
+	for (int f = 0; f < FORMAT_COUNT; ++f) {
+		int row = FORMAT_QOI + f * FORMAT_CHAINS;
+		if (!lib_enabled(row))
+			continue;
+		char name[16];
+		lib_name(row, name);
+		encoded_format[row] = formats[f].encode(pixels+64, &(qoi_desc){
+				.width = w,
+				.height = h,
+				.channels = channels,
+				.colorspace = QOI_SRGB
+			}, &encoded_format_size[row]);
+		if (!encoded_format[row]) {
+			ERROR("Error encoding %s with %s", path, name);
+		}
+		if (!opt_noverify) {
+			qoi_desc dc;
+			void *pixels_format = formats[f].decode(encoded_format[row], encoded_format_size[row], &dc, channels);
+			if (!pixels_format || memcmp(pixels+64, pixels_format, w * h * channels) != 0) {
+				ERROR("%s roundtrip pixel mismatch for %s", name, path);
+			}
+			mem_free(pixels_format);
+		}
+		for (int c = 1; c < FORMAT_CHAINS; ++c) {
+			if (lib_enabled(row + c))
+				encoded_format[row + c] = chain_compress(format_chains[c], encoded_format[row], encoded_format_size[row], &encoded_format_size[row + c]);
+		}
+	}
+
+	benchmark_result_t res = {0};
+	res.count = 1;
 	res.raw_size = w * h * channels;
 	res.px = w * h;
 	res.w = w;
 	res.h = h;
 
+	if (opt_stream) {
+		benchmark_stream(&res, STREAM_FILE, opt_stream_dir, path, pixels, w, h, channels);
+		if (opt_stream_tmpfs)
+			benchmark_stream(&res, STREAM_TMPFS, opt_stream_tmpfs, path, pixels, w, h, channels);
+	}
+
 	// Decoding
 	if (!opt_nodecode) {
-		if (!opt_nopng) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].decode_time, {
+		if (!nopng) {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].decode_time, &res.libs[LIBPNG].decode_dist, &res.libs[LIBPNG].decode_mem, {
 				int dec_w, dec_h;
 				void *dec_p = libpng_decode(encoded_png, encoded_png_size, &dec_w, &dec_h);
-				free(dec_p);
+				mem_free(dec_p);
 			});
 
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].decode_time, &res.libs[STBI].decode_dist, &res.libs[STBI].decode_mem, {
 				int dec_w, dec_h, dec_channels;
 				void *dec_p = stbi_load_from_memory(encoded_png, encoded_png_size, &dec_w, &dec_h, &dec_channels, 4);
-				free(dec_p);
+				mem_free(dec_p);
 			});
 		}
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOILIKE].decode_time, {
+		BENCHMARK_PERF_FN(opt_nowarmup, opt_runs, res.libs[QOILIKE].decode_time, &res.libs[QOILIKE].decode_dist, &res.libs[QOILIKE].decode_mem, opt_perf ? &res.libs[QOILIKE].decode_perf : NULL, {
 			qoi_desc desc;
 			void *dec_p = qoi_decode(encoded_qoi, encoded_qoi_size, &desc, channels);
-			free(dec_p);
+			mem_free(dec_p);
 		});
 
+		for (int k = KERNEL_SCALAR; k <= KERNEL_AVX512; ++k) {
+			if (!encoded_kernel[k])
+				continue;
+			BENCHMARK_PERF_FN(opt_nowarmup, opt_runs, res.libs[k].decode_time, &res.libs[k].decode_dist, &res.libs[k].decode_mem, opt_perf ? &res.libs[k].decode_perf : NULL, {
+				qoi_desc desc;
+				void *dec_p = qoi_decode(encoded_kernel[k], encoded_kernel_size[k], &desc, channels);
+				mem_free(dec_p);
+			});
+		}
+
 		if (!opt_nolz4) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LZ4].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LZ4].decode_time, &res.libs[LZ4].decode_dist, &res.libs[LZ4].decode_mem, {
 				qoi_desc desc;
-				void *dec_lz4=malloc(encoded_qoi_size);
+				void *dec_lz4=mem_malloc(encoded_qoi_size);
 				LZ4_decompress_safe(encoded_qoi_lz4, dec_lz4, encoded_qoi_lz4_size, encoded_qoi_size);
 				void *dec_p = qoi_decode(dec_lz4, encoded_qoi_size, &desc, channels);
-				free(dec_p);
-				free(dec_lz4);
+				mem_free(dec_p);
+				mem_free(dec_lz4);
 			});
 		}
 
 		if (!opt_nozstd1) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD1].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD1].decode_time, &res.libs[ZSTD1].decode_dist, &res.libs[ZSTD1].decode_mem, {
 				qoi_desc desc;
-				void *dec=malloc(encoded_qoi_size);
+				void *dec=mem_malloc(encoded_qoi_size);
 				ZSTD_decompress(dec, encoded_qoi_size, encoded_qoi_zstd1, encoded_qoi_zstd1_size);
 				void *dec_p = qoi_decode(dec, encoded_qoi_size, &desc, channels);
-				free(dec_p);
-				free(dec);
+				mem_free(dec_p);
+				mem_free(dec);
 			});
 		}
 
 		if (!opt_nozstd3) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD3].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD3].decode_time, &res.libs[ZSTD3].decode_dist, &res.libs[ZSTD3].decode_mem, {
 				qoi_desc desc;
-				void *dec=malloc(encoded_qoi_size);
+				void *dec=mem_malloc(encoded_qoi_size);
 				ZSTD_decompress(dec, encoded_qoi_size, encoded_qoi_zstd3, encoded_qoi_zstd3_size);
 				void *dec_p = qoi_decode(dec, encoded_qoi_size, &desc, channels);
-				free(dec_p);
-				free(dec);
+				mem_free(dec_p);
+				mem_free(dec);
 			});
 		}
 
 		if (!opt_nozstd9) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD9].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD9].decode_time, &res.libs[ZSTD9].decode_dist, &res.libs[ZSTD9].decode_mem, {
 				qoi_desc desc;
-				void *dec=malloc(encoded_qoi_size);
+				void *dec=mem_malloc(encoded_qoi_size);
 				ZSTD_decompress(dec, encoded_qoi_size, encoded_qoi_zstd9, encoded_qoi_zstd9_size);
 				void *dec_p = qoi_decode(dec, encoded_qoi_size, &desc, channels);
-				free(dec_p);
-				free(dec);
+				mem_free(dec_p);
+				mem_free(dec);
 			});
 		}
 
 		if (!opt_nozstd19) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD19].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD19].decode_time, &res.libs[ZSTD19].decode_dist, &res.libs[ZSTD19].decode_mem, {
 				qoi_desc desc;
-				void *dec=malloc(encoded_qoi_size);
+				void *dec=mem_malloc(encoded_qoi_size);
 				ZSTD_decompress(dec, encoded_qoi_size, encoded_qoi_zstd19, encoded_qoi_zstd19_size);
 				void *dec_p = qoi_decode(dec, encoded_qoi_size, &desc, channels);
-				free(dec_p);
-				free(dec);
+				mem_free(dec_p);
+				mem_free(dec);
+			});
+		}
+
+		for (int k = FORMAT_QOI; k < BENCH_COUNT; ++k) {
+			if (!encoded_format[k])
+				continue;
+			const bench_format_t *fmt = &formats[FORMAT_OF(k)];
+			int chain = FORMAT_CHAIN(k);
+			int size = encoded_format_size[FORMAT_QOI + FORMAT_OF(k) * FORMAT_CHAINS];
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[k].decode_time, &res.libs[k].decode_dist, &res.libs[k].decode_mem, {
+				qoi_desc desc;
+				void *dec = NULL;
+				if (chain) {
+					dec = mem_malloc(size);
+					chain_decompress(chain, encoded_format[k], encoded_format_size[k], dec, size);
+				}
+				void *dec_p = fmt->decode(dec ? dec : encoded_format[k], size, &desc, channels);
+				mem_free(dec_p);
+				mem_free(dec);
 			});
 		}
 	}
 
 	// Encoding
 	if (!opt_noencode) {
-		if (!opt_nopng) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].encode_time, {
+		if (!nopng) {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].encode_time, &res.libs[LIBPNG].encode_dist, &res.libs[LIBPNG].encode_mem, {
 				int enc_size;
 				void *enc_p = libpng_encode(pixels, w, h, channels, &enc_size);
 				res.libs[LIBPNG].size = enc_size;
-				free(enc_p);
+				mem_free(enc_p);
 			});
 
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].encode_time, &res.libs[STBI].encode_dist, &res.libs[STBI].encode_mem, {
 				int enc_size = 0;
 				stbi_write_png_to_func(stbi_write_callback, &enc_size, w, h, channels, pixels, 0);
 				res.libs[STBI].size = enc_size;
 			});
 		}
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOILIKE].encode_time, {
+		BENCHMARK_PERF_FN(opt_nowarmup, opt_runs, res.libs[QOILIKE].encode_time, &res.libs[QOILIKE].encode_dist, &res.libs[QOILIKE].encode_mem, opt_perf ? &res.libs[QOILIKE].encode_perf : NULL, {
 			int enc_size;
 			void *enc_p = qoi_encode(pixels+64, &(qoi_desc){
 				.width = w,
@@ -585,11 +2020,29 @@ benchmark_result_t benchmark_image(const char *path) {
 					.colorspace = QOI_SRGB
 			}, &enc_size, &opt);
 			res.libs[QOILIKE].size = enc_size;
-			free(enc_p);
+			mem_free(enc_p);
 		});
 
+		for (int k = KERNEL_SCALAR; k <= KERNEL_AVX512; ++k) {
+			if (!encoded_kernel[k])
+				continue;
+			options kopt = opt;
+			kopt.kernel = LIB_KERNEL(k);
+			BENCHMARK_PERF_FN(opt_nowarmup, opt_runs, res.libs[k].encode_time, &res.libs[k].encode_dist, &res.libs[k].encode_mem, opt_perf ? &res.libs[k].encode_perf : NULL, {
+				int enc_size;
+				void *enc_p = qoi_encode(pixels+64, &(qoi_desc){
+					.width = w,
+					.height = h,
+					.channels = channels,
+					.colorspace = QOI_SRGB
+				}, &enc_size, &kopt);
+				res.libs[k].size = enc_size;
+				mem_free(enc_p);
+			});
+		}
+
 		if (!opt_nolz4) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LZ4].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LZ4].encode_time, &res.libs[LZ4].encode_dist, &res.libs[LZ4].encode_mem, {
 				int enc_size;
 				void *enc;
 				void *enc_p = qoi_encode(pixels+64, &(qoi_desc){
@@ -598,15 +2051,15 @@ benchmark_result_t benchmark_image(const char *path) {
 					.channels = channels,
 					.colorspace = QOI_SRGB
 				}, &enc_size, &opt);
-				enc = malloc(LZ4_compressBound(enc_size));
+				enc = mem_malloc(LZ4_compressBound(enc_size));
 				res.libs[LZ4].size = LZ4_compress_default(enc_p, enc, enc_size, LZ4_compressBound(enc_size));
-				free(enc_p);
-				free(enc);
+				mem_free(enc_p);
+				mem_free(enc);
 			});
 		}
 
 		if (!opt_nozstd1) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD1].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD1].encode_time, &res.libs[ZSTD1].encode_dist, &res.libs[ZSTD1].encode_mem, {
 				int enc_size;
 				void *enc;
 				void *enc_p = qoi_encode(pixels+64, &(qoi_desc){
@@ -615,15 +2068,15 @@ benchmark_result_t benchmark_image(const char *path) {
 					.channels = channels,
 					.colorspace = QOI_SRGB
 				}, &enc_size, &opt);
-				enc = malloc(ZSTD_compressBound(enc_size));
+				enc = mem_malloc(ZSTD_compressBound(enc_size));
 				res.libs[ZSTD1].size = ZSTD_compress(enc, ZSTD_compressBound(enc_size), enc_p, enc_size, 1);
-				free(enc_p);
-				free(enc);
+				mem_free(enc_p);
+				mem_free(enc);
 			});
 		}
 
 		if (!opt_nozstd3) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD3].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD3].encode_time, &res.libs[ZSTD3].encode_dist, &res.libs[ZSTD3].encode_mem, {
 				int enc_size;
 				void *enc;
 				void *enc_p = qoi_encode(pixels+64, &(qoi_desc){
@@ -632,15 +2085,15 @@ benchmark_result_t benchmark_image(const char *path) {
 					.channels = channels,
 					.colorspace = QOI_SRGB
 				}, &enc_size, &opt);
-				enc = malloc(ZSTD_compressBound(enc_size));
+				enc = mem_malloc(ZSTD_compressBound(enc_size));
 				res.libs[ZSTD3].size = ZSTD_compress(enc, ZSTD_compressBound(enc_size), enc_p, enc_size, 3);
-				free(enc_p);
-				free(enc);
+				mem_free(enc_p);
+				mem_free(enc);
 			});
 		}
 
 		if (!opt_nozstd9) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD9].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD9].encode_time, &res.libs[ZSTD9].encode_dist, &res.libs[ZSTD9].encode_mem, {
 				int enc_size;
 				void *enc;
 				void *enc_p = qoi_encode(pixels+64, &(qoi_desc){
@@ -649,15 +2102,15 @@ benchmark_result_t benchmark_image(const char *path) {
 					.channels = channels,
 					.colorspace = QOI_SRGB
 				}, &enc_size, &opt);
-				enc = malloc(ZSTD_compressBound(enc_size));
+				enc = mem_malloc(ZSTD_compressBound(enc_size));
 				res.libs[ZSTD9].size = ZSTD_compress(enc, ZSTD_compressBound(enc_size), enc_p, enc_size, 9);
-				free(enc_p);
-				free(enc);
+				mem_free(enc_p);
+				mem_free(enc);
 			});
 		}
 
 		if (!opt_nozstd19) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD19].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[ZSTD19].encode_time, &res.libs[ZSTD19].encode_dist, &res.libs[ZSTD19].encode_mem, {
 				int enc_size;
 				void *enc;
 				void *enc_p = qoi_encode(pixels+64, &(qoi_desc){
@@ -666,17 +2119,43 @@ benchmark_result_t benchmark_image(const char *path) {
 					.channels = channels,
 					.colorspace = QOI_SRGB
 				}, &enc_size, &opt);
-				enc = malloc(ZSTD_compressBound(enc_size));
+				enc = mem_malloc(ZSTD_compressBound(enc_size));
 				res.libs[ZSTD19].size = ZSTD_compress(enc, ZSTD_compressBound(enc_size), enc_p, enc_size, 19);
-				free(enc_p);
-				free(enc);
+				mem_free(enc_p);
+				mem_free(enc);
+			});
+		}
+
+		for (int k = FORMAT_QOI; k < BENCH_COUNT; ++k) {
+			if (!encoded_format[k])
+				continue;
+			const bench_format_t *fmt = &formats[FORMAT_OF(k)];
+			int chain = FORMAT_CHAIN(k);
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[k].encode_time, &res.libs[k].encode_dist, &res.libs[k].encode_mem, {
+				int enc_size;
+				void *enc = NULL;
+				void *enc_p = fmt->encode(pixels+64, &(qoi_desc){
+					.width = w,
+					.height = h,
+					.channels = channels,
+					.colorspace = QOI_SRGB
+				}, &enc_size);
+				if (chain)
+					enc = chain_compress(chain, enc_p, enc_size, &enc_size);
+				res.libs[k].size = enc_size;
+				mem_free(enc_p);
+				mem_free(enc);
 			});
 		}
 	}
 
-	free(pixels);
-	free(encoded_png);
+	mem_free(pixels);
+	mem_free(encoded_png);
 	free(encoded_qoi);
+	for (int k = 0; k < BENCH_COUNT; ++k) {
+		free(encoded_kernel[k]);
+		mem_free(encoded_format[k]);
+	}
 	free(encoded_qoi_lz4);
 	free(encoded_qoi_zstd1);
 	free(encoded_qoi_zstd3);
@@ -686,6 +2165,80 @@ benchmark_result_t benchmark_image(const char *path) {
 	return res;
 }
 
+benchmark_result_t benchmark_image(const char *path) {
+	int encoded_png_size;
+	int w;
+	int h;
+	int channels;
+
+	// Load the encoded PNG, encoded QOI and raw pixels into memory
+	if(!stbi_info(path, &w, &h, &channels)) {
+		ERROR("Error decoding header %s", path);
+	}
+
+	if (channels != 3)
+		channels = 4;
+	void *pixels = (void *)stbi_load(path, &w, &h, NULL, channels);
+	if (!pixels) {
+		ERROR("Error decoding %s", path);
+	}
+	pixels=realloc(pixels, (w*h*channels)+65);
+
+	memmove(pixels+64, pixels, w*h*channels);//hack to simplify simd code, qoi_encode requires leading allocated space
+	void *encoded_png = fload(path, &encoded_png_size);
+
+	return benchmark_pixels(path, pixels, w, h, channels, encoded_png, encoded_png_size);
+}
+
+void benchmark_result_add(benchmark_result_t *total, benchmark_result_t res) {
+	total->count++;
+	total->raw_size += res.raw_size;
+	total->px += res.px;
+	for (int i = 0; i < BENCH_COUNT; ++i) {
+		total->libs[i].encode_time += res.libs[i].encode_time;
+		total->libs[i].decode_time += res.libs[i].decode_time;
+		total->libs[i].size += res.libs[i].size;
+		for (int dir = 0; dir < 2; ++dir) {
+			benchmark_mem_t *t = dir ? &total->libs[i].decode_mem : &total->libs[i].encode_mem;
+			benchmark_mem_t *m = dir ? &res.libs[i].decode_mem : &res.libs[i].encode_mem;
+			t->allocs += m->allocs;
+			t->total += m->total;
+			if (m->peak > t->peak)
+				t->peak = m->peak;
+		}
+		total->libs[i].encode_io_time += res.libs[i].encode_io_time;
+		total->libs[i].decode_io_time += res.libs[i].decode_io_time;
+		for (int dir = 0; dir < 2; ++dir) {
+			benchmark_dist_t *t = dir ? &total->libs[i].decode_dist : &total->libs[i].encode_dist;
+			benchmark_dist_t *d = dir ? &res.libs[i].decode_dist : &res.libs[i].encode_dist;
+			t->min += d->min;
+			t->median += d->median;
+			t->p90 += d->p90;
+			t->p99 += d->p99;
+			t->runs += d->runs;
+			t->outliers += d->outliers;
+			t->ci += d->ci;
+		}
+		for (int j = 0; j < PERF_COUNT; ++j) {
+			total->libs[i].encode_perf.v[j] += res.libs[i].encode_perf.v[j];
+			total->libs[i].decode_perf.v[j] += res.libs[i].decode_perf.v[j];
+		}
+	}
+}
+
+// Print and record a single image result and add it to the running totals
+void benchmark_report_image(const char *path, const char *class, benchmark_result_t res, benchmark_result_t *class_total, benchmark_result_t *grand_total) {
+	if (!opt_onlytotals) {
+		printf("## %s size: %dx%d\n", path, res.w, res.h);
+		benchmark_print_result(res);
+	}
+	if (opt_json || opt_csv || opt_compare)
+		record_add(&records, &records_len, &records_cap, path, class, res);
+
+	benchmark_result_add(class_total, res);
+	benchmark_result_add(grand_total, res);
+}
+
 void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 	DIR *dir = opendir(path);
 	if (!dir) {
@@ -726,48 +2279,332 @@ void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 		sprintf(file_path, "%s/%s", path, file->d_name);
 
 		benchmark_result_t res = benchmark_image(file_path);
+		benchmark_report_image(file_path, path, res, &dir_total, grand_total);
+		free(file_path);
+	}
+	closedir(dir);
 
-		if (!opt_onlytotals) {
-			printf("## %s size: %dx%d\n", file_path, res.w, res.h);
-			benchmark_print_result(res);
+	if (dir_total.count > 0) {
+		printf("## Total for %s\n", path);
+		benchmark_print_result(dir_total);
+	}
+}
+
+// Sizes of the synthetic corpus up to --synthetic-max megapixels, followed by
+// --synthetic-size if given. Returns 0 when there are no more sizes
+int synth_size(int i, int *w, int *h) {
+	int n = sizeof(synth_sizes) / sizeof(synth_sizes[0]);
+	for (int j = 0; j < n; ++j) {
+		if ((double)synth_sizes[j][0] * synth_sizes[j][1] > opt_synthetic_max * 1000000.0)
+			continue;
+		if (!i--) {
+			*w = synth_sizes[j][0];
+			*h = synth_sizes[j][1];
+			return 1;
 		}
+	}
+	if (opt_synthetic_w && !i) {
+		*w = opt_synthetic_w;
+		*h = opt_synthetic_h;
+		return 1;
+	}
+	return 0;
+}
 
-		free(file_path);
+void benchmark_synthetic(benchmark_result_t *grand_total) {
+	int w, h;
+	for (int cls = 0; cls < SYNTH_COUNT; ++cls) {
+		benchmark_result_t class_total = {0};
+		char class[64];
+		snprintf(class, sizeof(class), "synthetic/%s", synth_names[cls]);
+		printf("## Benchmarking %s -- %d runs\n\n", class, opt_runs);
+
+		for (int i = 0; synth_size(i, &w, &h); ++i) {
+			char path[128];
+			snprintf(path, sizeof(path), "%s/%dx%d", class, w, h);
+			benchmark_result_t res = benchmark_pixels(path, synth_image(cls, w, h), w, h, synth_channels[cls], NULL, 0);
+			benchmark_report_image(path, class, res, &class_total, grand_total);
+		}
 
-		dir_total.count++;
-		dir_total.raw_size += res.raw_size;
-		dir_total.px += res.px;
-		for (int i = 0; i < BENCH_COUNT; ++i) {
-			dir_total.libs[i].encode_time += res.libs[i].encode_time;
-			dir_total.libs[i].decode_time += res.libs[i].decode_time;
-			dir_total.libs[i].size += res.libs[i].size;
+		if (class_total.count > 0) {
+			printf("## Total for %s\n", class);
+			benchmark_print_result(class_total);
 		}
+	}
+}
 
-		grand_total->count++;
-		grand_total->raw_size += res.raw_size;
-		grand_total->px += res.px;
-		for (int i = 0; i < BENCH_COUNT; ++i) {
-			grand_total->libs[i].encode_time += res.libs[i].encode_time;
-			grand_total->libs[i].decode_time += res.libs[i].decode_time;
-			grand_total->libs[i].size += res.libs[i].size;
+
+// -----------------------------------------------------------------------------
+// multi-threaded corpus throughput
+
+typedef struct {
+	void *pixels;//allocation with 64 bytes of leading space, see benchmark_image
+	void *encoded;
+	int encoded_size;
+	int w;
+	int h;
+	int channels;
+} corpus_image_t;
+
+typedef struct {
+	corpus_image_t *images;
+	int count;
+	int capacity;
+	uint64_t px;
+} corpus_t;
+
+// Reusable barrier for count threads. pthread_barrier_t is missing on macOS
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int count, waiting, phase;
+} throughput_barrier_t;
+
+// The workers live for all runs of one throughput_run. Each run they wait on
+// start, process the corpus and wait on done, so the main thread can time
+// between the two without thread start-up
+typedef struct {
+	corpus_t *corpus;
+	int next;
+	int decode;
+	int quit;
+	throughput_barrier_t start, done;
+} throughput_job_t;
+
+// Takes ownership of pixels, which must have 64 bytes of leading space
+void corpus_add_pixels(const char *path, void *pixels, int w, int h, int channels, corpus_t *corpus) {
+	corpus_image_t img = {.pixels = pixels, .w = w, .h = h, .channels = channels};
+	img.encoded = qoi_encode(pixels+64, &(qoi_desc){
+			.width = w,
+			.height = h,
+			.channels = channels,
+			.colorspace = QOI_SRGB
+		}, &img.encoded_size, &opt);
+	if (!img.encoded) {
+		ERROR("Error encoding %s", path);
+	}
+
+	if (!opt_noverify) {
+		qoi_desc dc;
+		void *pixels_qoi = qoi_decode(img.encoded, img.encoded_size, &dc, channels);
+		if (memcmp(pixels+64, pixels_qoi, w * h * channels) != 0) {
+			ERROR(EXT_STR" roundtrip pixel mismatch for %s", path);
+		}
+		free(pixels_qoi);
+	}
+
+	if (corpus->count == corpus->capacity) {
+		corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 64;
+		corpus->images = realloc(corpus->images, corpus->capacity * sizeof(corpus_image_t));
+		if (!corpus->images) {
+			ERROR("Malloc for %d images failed", corpus->capacity);
+		}
+	}
+	corpus->images[corpus->count++] = img;
+	corpus->px += w * h;
+}
+
+void corpus_load_image(const char *path, corpus_t *corpus) {
+	int w, h, channels;
+
+	if(!stbi_info(path, &w, &h, &channels)) {
+		ERROR("Error decoding header %s", path);
+	}
+	if (channels != 3)
+		channels = 4;
+	void *pixels = (void *)stbi_load(path, &w, &h, NULL, channels);
+	if (!pixels) {
+		ERROR("Error decoding %s", path);
+	}
+	pixels = realloc(pixels, (w*h*channels)+65);
+	memmove(pixels+64, pixels, w*h*channels);
+	corpus_add_pixels(path, pixels, w, h, channels, corpus);
+}
+
+void corpus_load_synthetic(corpus_t *corpus) {
+	int w, h;
+	for (int cls = 0; cls < SYNTH_COUNT; ++cls) {
+		for (int i = 0; synth_size(i, &w, &h); ++i)
+			corpus_add_pixels(synth_names[cls], synth_image(cls, w, h), w, h, synth_channels[cls], corpus);
+	}
+}
+
+void corpus_load_directory(const char *path, corpus_t *corpus) {
+	DIR *dir = opendir(path);
+	if (!dir) {
+		ERROR("Couldn't open directory %s", path);
+	}
+
+	struct dirent *file;
+	while ((file = readdir(dir)) != NULL) {
+		if (
+			!opt_norecurse &&
+			file->d_type & DT_DIR &&
+			strcmp(file->d_name, ".") != 0 &&
+			strcmp(file->d_name, "..") != 0
+		) {
+			char subpath[1024];
+			snprintf(subpath, 1024, "%s/%s", path, file->d_name);
+			corpus_load_directory(subpath, corpus);
+			continue;
 		}
+		if (strlen(file->d_name) < 4 || strcmp(file->d_name + strlen(file->d_name) - 4, ".png") != 0) {
+			continue;
+		}
+		char *file_path = malloc(strlen(file->d_name) + strlen(path)+8);
+		sprintf(file_path, "%s/%s", path, file->d_name);
+		corpus_load_image(file_path, corpus);
+		free(file_path);
 	}
 	closedir(dir);
+}
 
-	if (dir_total.count > 0) {
-		printf("## Total for %s\n", path);
-		benchmark_print_result(dir_total);
+void corpus_free(corpus_t *corpus) {
+	for (int i = 0; i < corpus->count; ++i) {
+		free(corpus->images[i].pixels);
+		free(corpus->images[i].encoded);
+	}
+	free(corpus->images);
+}
+
+void barrier_init(throughput_barrier_t *b, int count) {
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	b->count = count;
+	b->waiting = b->phase = 0;
+}
+
+void barrier_destroy(throughput_barrier_t *b) {
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->lock);
+}
+
+void barrier_wait(throughput_barrier_t *b) {
+	pthread_mutex_lock(&b->lock);
+	int phase = b->phase;
+	if (++b->waiting == b->count) {
+		b->waiting = 0;
+		b->phase++;
+		pthread_cond_broadcast(&b->cond);
 	}
+	else {
+		while (phase == b->phase)
+			pthread_cond_wait(&b->cond, &b->lock);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+// Each run the workers claim the next unprocessed image until the corpus is
+// exhausted
+void *throughput_worker(void *arg) {
+	throughput_job_t *job = (throughput_job_t *)arg;
+	int i;
+	for (;;) {
+		barrier_wait(&job->start);
+		if (job->quit)
+			return NULL;
+		while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->corpus->count) {
+			corpus_image_t *img = &job->corpus->images[i];
+			if (job->decode) {
+				qoi_desc desc;
+				void *dec_p = qoi_decode(img->encoded, img->encoded_size, &desc, img->channels);
+				free(dec_p);
+			}
+			else {
+				int enc_size;
+				void *enc_p = qoi_encode(img->pixels+64, &(qoi_desc){
+					.width = img->w,
+					.height = img->h,
+					.channels = img->channels,
+					.colorspace = QOI_SRGB
+				}, &enc_size, &opt);
+				free(enc_p);
+			}
+		}
+		barrier_wait(&job->done);
+	}
+}
+
+// Average wall time for the whole corpus to be processed by nthreads workers.
+// The workers are started before and joined after the timed runs
+uint64_t throughput_run(corpus_t *corpus, int nthreads, int decode) {
+	pthread_t threads[nthreads];
+	throughput_job_t job = {.corpus = corpus, .decode = decode};
+	uint64_t avg_time;
+
+	barrier_init(&job.start, nthreads + 1);
+	barrier_init(&job.done, nthreads + 1);
+	for (int t = 0; t < nthreads; ++t) {
+		if (pthread_create(&threads[t], NULL, throughput_worker, &job)) {
+			ERROR("pthread_create failed");
+		}
+	}
+	BENCHMARK_FN(opt_nowarmup, opt_runs, avg_time, NULL, NULL, {
+		job.next = 0;
+		barrier_wait(&job.start);
+		barrier_wait(&job.done);
+	});
+	job.quit = 1;
+	barrier_wait(&job.start);
+	for (int t = 0; t < nthreads; ++t) {
+		pthread_join(threads[t], NULL);
+	}
+	barrier_destroy(&job.start);
+	barrier_destroy(&job.done);
+	return avg_time;
+}
+
+void benchmark_throughput(const char *path) {
+	corpus_t corpus = {0};
+	if (opt_synthetic)
+		corpus_load_synthetic(&corpus);
+	else
+		corpus_load_directory(path, &corpus);
+	if (!corpus.count) {
+		printf("No images found in %s\n", path);
+		return;
+	}
+
+	printf("## Throughput for %s%s -- %d images, %.1f MP, %d runs\n\n", path, opt_synthetic ? "" : "/*.png", corpus.count, (double)corpus.px/1000000.0, opt_runs);
+	printf("threads   encode img/s   encode mpps  scaling   decode img/s   decode mpps  scaling\n");
+
+	double enc_base = 0, dec_base = 0;
+	for (int t = 1; t <= opt_threads; ++t) {
+		double enc_ips = 0, enc_mpps = 0, dec_ips = 0, dec_mpps = 0;
+		if (!opt_noencode) {
+			uint64_t time = throughput_run(&corpus, t, 0);
+			enc_ips = time > 0 ? corpus.count / ((double)time/1000000000.0) : 0;
+			enc_mpps = time > 0 ? corpus.px / ((double)time/1000.0) : 0;
+			if (t == 1)
+				enc_base = enc_mpps;
+		}
+		if (!opt_nodecode) {
+			uint64_t time = throughput_run(&corpus, t, 1);
+			dec_ips = time > 0 ? corpus.count / ((double)time/1000000000.0) : 0;
+			dec_mpps = time > 0 ? corpus.px / ((double)time/1000.0) : 0;
+			if (t == 1)
+				dec_base = dec_mpps;
+		}
+		printf(
+			"%7d   %12.1f  %12.2f   %5.1f%%   %12.1f  %12.2f   %5.1f%%\n",
+			t,
+			enc_ips, enc_mpps, enc_base > 0 ? (enc_mpps / (enc_base * t)) * 100.0 : 0,
+			dec_ips, dec_mpps, dec_base > 0 ? (dec_mpps / (dec_base * t)) * 100.0 : 0
+		);
+	}
+	printf("\n");
+	corpus_free(&corpus);
 }
 
 int main(int argc, char **argv) {
+	int ret = 0;
 #ifndef QOI_MLUT_EMBED
 #ifdef _WIN32
 	HANDLE fd, file_mapping_object;
 #endif
 #endif
 	if (argc < 3) {
-		printf("Usage: "EXT_STR"bench <iterations> <directory> [options]\n");
+		printf("Usage: "EXT_STR"bench <iterations> <directory|--synthetic> [options]\n");
 		printf("Options:\n");
 		printf(" --nowarmup       don't perform a warmup run\n");
 		printf(" --nopng          don't run png encode/decode\n");
@@ -781,6 +2618,28 @@ int main(int argc, char **argv) {
 		printf(" --nozstd3        don't benchmark chained zstd compression level 3\n");
 		printf(" --nozstd9        don't benchmark chained zstd compression level 9\n");
 		printf(" --nozstd19       don't benchmark chained zstd compression level 19\n");
+		printf(" --synthetic-max mp    largest synthetic image in megapixels, default 16.8\n");
+		printf(" --synthetic-size WxH  add a synthetic image of this size\n");
+		printf(" --threads n      benchmark "EXT_STR" corpus throughput with 1..n worker threads\n");
+		printf(" --perf           report hardware performance counters for "EXT_STR" encode/decode\n");
+		printf(" --kernels        also benchmark each compiled encode kernel, verified against scalar\n");
+		printf(" --dist           report min/median/p90/p99 run times and the 95%% confidence interval\n");
+		printf(" --mem            report allocations, peak and total bytes per encode/decode call\n");
+		printf(" --stream         also benchmark the file to file streaming paths, with --cold from disk\n");
+		printf(" --stream-dir dir directory for the page cache/disk streaming files, default .\n");
+		printf(" --stream-tmpfs d tmpfs directory for streaming files, default /dev/shm\n");
+		printf(" --pin cpu        pin the benchmark to one cpu\n");
+		printf(" --cold           evict the caches before every run\n");
+		printf(" --adaptive pct   add runs until the 95%% confidence interval is within pct%% of the mean\n");
+		printf(" --max-runs n     upper limit of runs for --adaptive, default 1000\n");
+		printf(" --keep-outliers  include runs outside the Tukey fences in the mean\n");
+		printf(" --json file      write per image and total results as json\n");
+		printf(" --csv file       write per image and total results as csv\n");
+		printf(" --compare file   flag slowdowns and size regressions against a --json baseline\n");
+		printf(" --compare-threshold pct  minimum slowdown to flag, default 5\n");
+#ifdef QOI_STATS
+		printf(" --stats          report op mix and run lengths of the "EXT_STR" encode\n");
+#endif
 #ifdef ROI
 		printf(" --mlut           use mlut on encode\n");
 #ifndef QOI_MLUT_EMBED
@@ -790,6 +2649,8 @@ int main(int argc, char **argv) {
 		printf("Examples\n");
 		printf("    "EXT_STR"bench 10 images/textures/\n");
 		printf("    "EXT_STR"bench 1 images/textures/ --nopng --nowarmup\n");
+		printf("    "EXT_STR"bench 5 images/textures/ --threads 8\n");
+		printf("    "EXT_STR"bench 5 --synthetic --synthetic-max 2.1\n");
 		exit(1);
 	}
 
@@ -806,6 +2667,40 @@ int main(int argc, char **argv) {
 		else if (strcmp(argv[i], "--nozstd3") == 0) { opt_nozstd3 = 1; }
 		else if (strcmp(argv[i], "--nozstd9") == 0) { opt_nozstd9 = 1; }
 		else if (strcmp(argv[i], "--nozstd19") == 0) { opt_nozstd19 = 1; }
+		else if (strcmp(argv[i], "--threads") == 0 && (i+1)<argc) {
+			opt_threads = atoi(argv[++i]);
+			if (opt_threads <= 0) {
+				ERROR("Invalid number of threads %d", opt_threads);
+			}
+		}
+		else if (strcmp(argv[i], "--perf") == 0) { opt_perf = 1; }
+		else if (strcmp(argv[i], "--kernels") == 0) { opt_kernels = 1; }
+		else if (strcmp(argv[i], "--dist") == 0) { opt_dist = 1; }
+		else if (strcmp(argv[i], "--mem") == 0) { opt_mem = 1; }
+		else if (strcmp(argv[i], "--stream") == 0) { opt_stream = 1; }
+		else if (strcmp(argv[i], "--stream-dir") == 0 && (i+1)<argc) { opt_stream_dir = argv[++i]; }
+		else if (strcmp(argv[i], "--stream-tmpfs") == 0 && (i+1)<argc) { opt_stream_tmpfs = argv[++i]; }
+		else if (strcmp(argv[i], "--pin") == 0 && (i+1)<argc) { opt_pin = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--cold") == 0) { opt_cold = 1; }
+		else if (strcmp(argv[i], "--adaptive") == 0 && (i+1)<argc) { opt_adaptive = atof(argv[++i]); }
+		else if (strcmp(argv[i], "--max-runs") == 0 && (i+1)<argc) { opt_max_runs = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--keep-outliers") == 0) { opt_keep_outliers = 1; }
+		else if (strcmp(argv[i], "--synthetic-max") == 0 && (i+1)<argc) { opt_synthetic_max = atof(argv[++i]); }
+		else if (strcmp(argv[i], "--synthetic-size") == 0 && (i+1)<argc) {
+			if (sscanf(argv[++i], "%dx%d", &opt_synthetic_w, &opt_synthetic_h) != 2 || opt_synthetic_w <= 0 || opt_synthetic_h <= 0) {
+				ERROR("Invalid synthetic size %s", argv[i]);
+			}
+			if ((unsigned int)opt_synthetic_h >= QOI_PIXELS_MAX / (unsigned int)opt_synthetic_w) {
+				ERROR("Synthetic size %s exceeds the %u pixel limit of "EXT_STR, argv[i], QOI_PIXELS_MAX);
+			}
+		}
+		else if (strcmp(argv[i], "--json") == 0 && (i+1)<argc) { opt_json = argv[++i]; }
+		else if (strcmp(argv[i], "--csv") == 0 && (i+1)<argc) { opt_csv = argv[++i]; }
+		else if (strcmp(argv[i], "--compare") == 0 && (i+1)<argc) { opt_compare = argv[++i]; }
+		else if (strcmp(argv[i], "--compare-threshold") == 0 && (i+1)<argc) { opt_compare_threshold = atof(argv[++i]); }
+#ifdef QOI_STATS
+		else if (strcmp(argv[i], "--stats") == 0) { opt_stats = 1; }
+#endif
 #ifdef ROI
 		else if (strcmp(argv[i], "--mlut") == 0) { opt.mlut = 1; }
 #ifndef QOI_MLUT_EMBED
@@ -838,18 +2733,69 @@ int main(int argc, char **argv) {
 	if (opt_runs <=0) {
 		ERROR("Invalid number of runs %d", opt_runs);
 	}
+	if (strcmp(argv[2], "--synthetic") == 0) {
+		opt_synthetic = 1;
+		opt_nopng = 1;//there is no PNG to decode
+	}
+	if (opt_perf && !perf_init()) {
+		printf("Hardware performance counters unavailable (check /proc/sys/kernel/perf_event_paranoid), --perf ignored\n\n");
+		opt_perf = 0;
+	}
+	if (opt_stream && opt_stream_tmpfs) {
+		DIR *d = opendir(opt_stream_tmpfs);
+		if (d)
+			closedir(d);
+		else {
+			printf("No tmpfs at %s, streaming from tmpfs skipped\n\n", opt_stream_tmpfs);
+			opt_stream_tmpfs = NULL;
+		}
+	}
+	if ((opt_json || opt_csv || opt_compare) && opt_threads) {
+		ERROR("--json, --csv and --compare report per image results, they can't be used with --threads");
+	}
+	if (opt_mem && opt_threads) {
+		ERROR("--mem counts the allocations of one call at a time, it can't be used with --threads");
+	}
+	if (opt_pin >= 0) {
+		if (opt_threads) {
+			ERROR("--pin would put all --threads workers on one cpu");
+		}
+		cpu_pin(opt_pin);
+	}
 
-	benchmark_result_t grand_total = {0};
-	benchmark_directory(argv[2], &grand_total);
-
-	if (grand_total.count > 0) {
-		printf("# Grand total for %s\n", argv[2]);
-		benchmark_print_result(grand_total);
+	if (opt_threads) {
+		benchmark_throughput(argv[2]);
 	}
 	else {
-		printf("No images found in %s\n", argv[2]);
+		benchmark_result_t grand_total = {0};
+		if (opt_synthetic)
+			benchmark_synthetic(&grand_total);
+		else
+			benchmark_directory(argv[2], &grand_total);
+
+		if (grand_total.count > 0) {
+			printf("# Grand total for %s\n", argv[2]);
+			benchmark_print_result(grand_total);
+#ifdef QOI_STATS
+			if (opt_stats) {
+				printf("# Grand total op stats for %s\n", argv[2]);
+				stats_print(&stats_total_enc, &stats_total_dec);
+			}
+#endif
+			if (opt_json)
+				benchmark_write_json(opt_json, grand_total);
+			if (opt_csv)
+				benchmark_write_csv(opt_csv, grand_total);
+			if (opt_compare && benchmark_compare(opt_compare))
+				ret = 2;
+		}
+		else {
+			printf("No images found in %s\n", argv[2]);
+		}
+		record_free(records, records_len);
 	}
 
+#ifdef ROI
 #ifndef QOI_MLUT_EMBED
 	if(qoi_mlut){
 #ifdef _WIN32
@@ -859,7 +2805,8 @@ int main(int argc, char **argv) {
 #endif
 	//munmap TODO maybe, automatically done on exit anyway
 	}
+#endif
 #endif
 
-	return 0;
+	return ret;
 }
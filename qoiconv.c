@@ -12,7 +12,10 @@ Requires:
 	-"qoi.h" (https://github.com/phoboslab/qoi/blob/master/qoi.h)
 
 Compile with: 
-	gcc qoiconv.c -std=c99 -O3 -o qoiconv
+	gcc qoiconv.c -std=c99 -O3 -o qoiconv -lpthread
+
+With -a many images are encoded into one archive, with -x an archive is
+extracted and -l lists it, see qoi_archive in qoi.h
 
 */
 
@@ -27,15 +30,318 @@ Compile with:
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
 
-#ifndef QOI_MLUT_EMBED
+#include <pthread.h>
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-#endif
+#include <direct.h>
+#define archive_mkdir(path) _mkdir(path)
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define archive_mkdir(path) mkdir(path, 0777)
 #endif
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
+//archive modes: the images are spread over threads, each claiming the next one
+//until the batch is done. A build encodes a batch of images in parallel then
+//adds them in command line order, so the archive doesn't depend on the timing
+#define ARCHIVE_BATCH_PER_THREAD 16
+
+typedef struct {
+	char **paths;
+	unsigned char **encoded;
+	int *sizes;
+	const qoi_archive *ar;
+	const char *dir;
+	const options *opt;
+	int count, next, failed;
+} archive_job;
+
+static int archive_cpus(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n=sysconf(_SC_NPROCESSORS_ONLN);
+	return n>0?n:1;
+#endif
+}
+
+static void archive_run(void *(*worker)(void *), archive_job *job, int threads) {
+	pthread_t tid[64];
+	int t, started=0;
+	if(threads>64)
+		threads=64;
+	if(threads>job->count)
+		threads=job->count;
+	for(t=0;t<threads;++t)
+		if(0==pthread_create(&tid[started], NULL, worker, job))
+			++started;
+	if(!started)//no threads, do the work here
+		worker(job);
+	for(t=0;t<started;++t)
+		pthread_join(tid[t], NULL);
+}
+
+//read the whole file into QOI_MALLOC memory
+static unsigned char *archive_slurp(const char *path, int *size) {
+	unsigned char *data=NULL;
+	long len;
+	FILE *f=fopen(path, "rb");
+	if(!f)
+		return NULL;
+	if(fseek(f, 0, SEEK_END)==0 && (len=ftell(f))>0 && len<0x7fffffff && fseek(f, 0, SEEK_SET)==0 && (data=QOI_MALLOC(len))){
+		if((size_t)len!=fread(data, 1, len, f)){
+			QOI_FREE(data);
+			data=NULL;
+		}
+		*size=len;
+	}
+	fclose(f);
+	return data;
+}
+
+//encode one input for the archive, or take it as is when it is already encoded.
+//qoi_encode_strided leaves the memory in front of the pixels alone
+static unsigned char *archive_encode(const char *path, int *size, const options *opt) {
+	unsigned char *pixels=NULL, *encoded=NULL;
+	qoi_desc desc={0};
+	int w, h, channels;
+	FILE *f;
+	if(STR_ENDS_WITH(path, "."EXT_STR))
+		return archive_slurp(path, size);
+	if(STR_ENDS_WITH(path, ".png")){
+		if(!stbi_info(path, &w, &h, &channels))
+			return NULL;
+		if(channels != 3)// Force all odd encodings to be RGBA
+			channels = 4;
+		pixels=stbi_load(path, &w, &h, NULL, channels);
+		desc.width=w;
+		desc.height=h;
+		desc.channels=channels;
+	}
+	else if(STR_ENDS_WITH(path, ".ppm") || STR_ENDS_WITH(path, ".pam")){
+		if(!(f=fopen(path, "rb")))
+			return NULL;
+		if(
+			!(STR_ENDS_WITH(path, ".ppm")?qoi_read_ppm_header(f, &desc):qoi_read_pam_header(f, &desc)) &&
+			desc.height < QOI_PIXELS_MAX / desc.width &&
+			(pixels=malloc((size_t)desc.width*desc.height*desc.channels)) &&
+			(size_t)desc.width*desc.height*desc.channels!=fread(pixels, 1, (size_t)desc.width*desc.height*desc.channels, f)
+		){
+			free(pixels);
+			pixels=NULL;
+		}
+		fclose(f);
+	}
+	if(pixels){
+		encoded=qoi_encode_strided(pixels, desc.width*desc.channels, &desc, size, opt);
+		free(pixels);
+	}
+	return encoded;
+}
+
+static void *archive_build_worker(void *arg) {
+	archive_job *job=arg;
+	int i;
+	while((i=__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+		job->encoded[i]=archive_encode(job->paths[i], &job->sizes[i], job->opt);
+	return NULL;
+}
+
+static int archive_build(const char *out, char **paths, int count, int threads, const options *opt) {
+	int batch=threads*ARCHIVE_BATCH_PER_THREAD, start, i, err=0;
+	unsigned char **encoded=malloc(batch*sizeof(unsigned char *));
+	int *sizes=malloc(batch*sizeof(int));
+	qoi_archive_writer *aw;
+	if(!encoded || !sizes || !(aw=qoi_archive_create(out))){
+		free(encoded);
+		free(sizes);
+		return fprintf(stderr, "Couldn't create %s\n", out);
+	}
+	for(start=0;start<count && !err;start+=batch){
+		archive_job job={paths+start, encoded, sizes, NULL, NULL, opt, count-start<batch?count-start:batch, 0, 0};
+		archive_run(archive_build_worker, &job, threads);
+		for(i=0;i<job.count;++i){
+			if(!encoded[i])
+				err|=fprintf(stderr, "Couldn't load/encode %s\n", paths[start+i]);
+			else{
+				if(!err && qoi_archive_add(aw, paths[start+i], encoded[i], sizes[i]))
+					err|=fprintf(stderr, "Couldn't add %s to %s\n", paths[start+i], out);
+				QOI_FREE(encoded[i]);
+			}
+		}
+	}
+	if(qoi_archive_close(aw) && !err)
+		err=fprintf(stderr, "Couldn't write %s, or a name is in it twice\n", out);
+	if(err)
+		remove(out);
+	free(encoded);
+	free(sizes);
+	return err!=0;
+}
+
+//map the whole archive, it is read straight from the page cache
+static const unsigned char *archive_map(const char *path, size_t *size) {
+	const unsigned char *data;
+#ifdef _WIN32
+	HANDLE fd, mapping;
+	LARGE_INTEGER len;
+	fd=CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fd==INVALID_HANDLE_VALUE)
+		return NULL;
+	if(!GetFileSizeEx(fd, &len) || !len.QuadPart || !(mapping=CreateFileMappingA(fd, NULL, PAGE_READONLY, 0, 0, NULL))){
+		CloseHandle(fd);
+		return NULL;
+	}
+	data=MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	CloseHandle(fd);
+	*size=len.QuadPart;
+	return data;
+#else
+	struct stat st;
+	int fd=open(path, O_RDONLY);
+	if(-1==fd)
+		return NULL;
+	if(fstat(fd, &st) || !st.st_size){
+		close(fd);
+		return NULL;
+	}
+	data=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	*size=st.st_size;
+	return MAP_FAILED==data?NULL:data;
+#endif
+}
+
+static void archive_unmap(const unsigned char *data, size_t size) {
+#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(data);
+#else
+	munmap((void *)data, size);
+#endif
+}
+
+//names are written below the output directory only
+static int archive_name_ok(const char *name) {
+	const char *p;
+	if(!*name || name[0]=='/' || name[0]=='\\' || strchr(name, ':'))
+		return 0;
+	for(p=name;*p;){
+		if(p[0]=='.' && p[1]=='.' && (!p[2] || p[2]=='/' || p[2]=='\\'))
+			return 0;
+		p+=strcspn(p, "/\\");
+		if(*p)
+			++p;
+	}
+	return 1;
+}
+
+static int archive_extract_one(const qoi_archive_entry *e, const char *dir) {
+	char *path=malloc(strlen(dir)+e->name_len+2), *p, head[128];
+	void *pixels=NULL;
+	qoi_desc desc;
+	FILE *f;
+	int ok=0;
+	if(!path)
+		return 0;
+	sprintf(path, "%s/%s", dir, e->name);
+	for(p=path+strlen(dir)+1;*p;++p){//parent directories
+		if(*p=='/' || *p=='\\'){
+			*p=0;
+			archive_mkdir(path);
+			*p='/';
+		}
+	}
+	if(STR_ENDS_WITH(path, ".png")){
+		if((pixels=qoi_decode(e->data, e->size, &desc, 0)))
+			ok=stbi_write_png(path, desc.width, desc.height, desc.channels, pixels, 0);
+	}
+	else if(STR_ENDS_WITH(path, ".ppm") || STR_ENDS_WITH(path, ".pam")){
+		if(STR_ENDS_WITH(path, ".ppm"))
+			pixels=qoi_decode(e->data, e->size, &desc, 3);
+		else
+			pixels=qoi_decode(e->data, e->size, &desc, 0);
+		if(pixels && (f=fopen(path, "wb"))){
+			if(STR_ENDS_WITH(path, ".ppm"))
+				sprintf(head, "P6 %u %u 255\n", desc.width, desc.height);
+			else
+				sprintf(head, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE RGB%s\nENDHDR\n", desc.width, desc.height, desc.channels, desc.channels==3?"":"_ALPHA");
+			ok=strlen(head)==fwrite(head, 1, strlen(head), f) &&
+				(size_t)desc.width*desc.height*desc.channels==fwrite(pixels, 1, (size_t)desc.width*desc.height*desc.channels, f);
+			ok&=0==fclose(f);
+		}
+	}
+	else if((f=fopen(path, "wb"))){//still encoded
+		ok=(size_t)e->size==fwrite(e->data, 1, e->size, f);
+		ok&=0==fclose(f);
+	}
+	if(pixels)
+		QOI_FREE(pixels);
+	free(path);
+	return ok;
+}
+
+static void *archive_extract_worker(void *arg) {
+	archive_job *job=arg;
+	qoi_archive_entry e;
+	int i;
+	while((i=__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count){
+		if(!qoi_archive_get(job->ar, i, &e) || !archive_name_ok(e.name) || !archive_extract_one(&e, job->dir)){
+			fprintf(stderr, "Couldn't extract entry %d %s\n", i, qoi_archive_get(job->ar, i, &e)?e.name:"");
+			__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+static int archive_extract(const char *in, const char *dir, int threads, int list) {
+	qoi_archive ar;
+	qoi_archive_entry e;
+	size_t size;
+	const unsigned char *data=archive_map(in, &size);
+	int failed=0;
+	if(!data)
+		return fprintf(stderr, "Couldn't open %s\n", in);
+	if(!qoi_archive_open(&ar, data, size)){
+		archive_unmap(data, size);
+		return fprintf(stderr, "%s is not an archive\n", in);
+	}
+	if(list){
+		for(unsigned int i=0;i<ar.count;++i){
+			if(qoi_archive_get(&ar, i, &e))
+				printf("%10d %5ux%-5u %u %s\n", e.size, e.desc.width, e.desc.height, e.desc.channels, e.name);
+			else
+				failed=fprintf(stderr, "Entry %u is invalid\n", i);
+		}
+	}
+	else{
+		archive_job job={NULL, NULL, NULL, &ar, dir, NULL, ar.count, 0, 0};
+		archive_mkdir(dir);
+		archive_run(archive_extract_worker, &job, threads);
+		failed=job.failed;
+	}
+	archive_unmap(data, size);
+	return failed!=0;
+}
+
+#ifdef QOI_TIMING
+static void print_timing(const qoi_timing *t, void *user) {
+	(void)user;
+	for(int i=0;i<QOI_TIMING_STAGES;++i)
+		fprintf(stderr, "%-8s %10.3f ms\n", qoi_timing_stage_names[i], (double)t->ns[i]/1000000.0);
+	fprintf(stderr, "total    %10.3f ms, %llu chunks, %llu bytes in, %llu bytes out\n",
+		(double)t->total_ns/1000000.0, t->chunks, t->bytes_in, t->bytes_out);
+}
+#endif
+
 int main(int argc, char **argv) {
 #ifndef QOI_MLUT_EMBED
 #ifdef _WIN32
@@ -43,6 +349,10 @@ int main(int argc, char **argv) {
 #endif
 #endif
 	options opt={0};
+	int threads=0, archive=0, level=0;
+#ifdef QOI_TIMING
+	qoi_timing timing={0};
+#endif
 	if (argc < 3) {
 		puts("Usage: "EXT_STR"conv [ops] <infile> <outfile>");
 		puts("[ops]");
@@ -52,10 +362,26 @@ int main(int argc, char **argv) {
 		puts(" -mlut-path file : File containing mega-LUT");
 		puts(" -mlut-gen file: Generate mega-LUT");
 #endif
+#endif
+		puts(" -near n : Near-lossless, allow each channel to be off by up to n (0..255)");
+		puts(" -longrun : Encode a run of any length as one op (the file needs a decoder that knows the variant)");
+		puts(" -raw : Store blocks that don't compress as they are (the file needs a decoder that knows the variant)");
+		printf(" -preview n : Append n preview levels (1..%d), each 1/4 the width and height of the one before (png input)\n", QOI_PREVIEW_LEVELS_MAX);
+		puts(" -level n : Decode preview level n instead of the image (png output)");
+		puts(" -scale n : Decode box filtered down by 2, 4 or 8");
+		puts(" -orient n : Decode turned upright for EXIF orientation n (1..8, png output)");
+		puts(" -j n : Threads for the archive modes, default one per cpu");
+		puts("Archive modes, each in place of <infile> <outfile>:");
+		puts(" -a archive."EXT_STR"a infile... : Encode png, ppm, pam and "EXT_STR" files into an archive");
+		puts(" -x archive."EXT_STR"a dir : Extract into dir, to the format of each name's extension");
+		puts(" -l archive."EXT_STR"a : List the images in an archive");
+#ifdef QOI_TIMING
+		puts(" -v : Print per-stage timing to stderr");
 #endif
 		puts("Examples:");
 		puts("  "EXT_STR"conv input.png output."EXT_STR"");
 		puts("  "EXT_STR"conv input."EXT_STR" output.png");
+		puts("  "EXT_STR"conv -a sprites."EXT_STR"a sprites/*.png");
 		exit(1);
 	}
 
@@ -92,6 +418,58 @@ int main(int argc, char **argv) {
 			return gen_mlut(argv[i+1]);
 #endif
 #endif
+		else if(strcmp(argv[i], "-near")==0 && i<(argc-3)){
+			int tol=atoi(argv[++i]);
+			if(tol<0 || tol>255)
+				return fprintf(stderr, "-near must be 0..255\n");
+			opt.tolerance=tol;
+		}
+		else if(strcmp(argv[i], "-longrun")==0 && i<(argc-2))
+			opt.long_run=1;
+		else if(strcmp(argv[i], "-raw")==0 && i<(argc-2))
+			opt.raw_blocks=1;
+#ifdef QOI_TIMING
+		else if(strcmp(argv[i], "-v")==0){
+			timing.callback=print_timing;
+			opt.timing=&timing;
+		}
+#endif
+		else if(strcmp(argv[i], "-preview")==0 && i<(argc-3)){
+			int levels=atoi(argv[++i]);
+			if(levels<0 || levels>QOI_PREVIEW_LEVELS_MAX)
+				return fprintf(stderr, "-preview must be 0..%d\n", QOI_PREVIEW_LEVELS_MAX);
+			opt.preview=levels;
+		}
+		else if(strcmp(argv[i], "-level")==0 && i<(argc-3)){
+			level=atoi(argv[++i]);
+			if(level<0 || level>QOI_PREVIEW_LEVELS_MAX)
+				return fprintf(stderr, "-level must be 0..%d\n", QOI_PREVIEW_LEVELS_MAX);
+		}
+		else if(strcmp(argv[i], "-scale")==0 && i<(argc-3)){
+			int scale=atoi(argv[++i]);
+			if(scale!=1 && scale!=2 && scale!=4 && scale!=8)
+				return fprintf(stderr, "-scale must be 1, 2, 4 or 8\n");
+			opt.scale=scale;
+		}
+		else if(strcmp(argv[i], "-orient")==0 && i<(argc-3)){
+			int orientation=atoi(argv[++i]);
+			if(orientation<1 || orientation>8)
+				return fprintf(stderr, "-orient must be 1..8\n");
+			opt.orientation=orientation;
+		}
+		else if(strcmp(argv[i], "-j")==0 && i<(argc-2)){
+			threads=atoi(argv[++i]);
+			if(threads<1)
+				return fprintf(stderr, "-j must be at least 1\n");
+		}
+		else if((strcmp(argv[i], "-a")==0 || strcmp(argv[i], "-x")==0) && i<(argc-2)){
+			archive=i;
+			break;
+		}
+		else if(strcmp(argv[i], "-l")==0 && i==(argc-2)){
+			archive=i;
+			break;
+		}
 		else if(i<(argc-2))
 			return fprintf(stderr, "Unknown option '%s'\n", argv[i]);
 	}
@@ -100,6 +478,19 @@ int main(int argc, char **argv) {
 	if(opt.mlut && !qoi_mlut)
 		return fprintf(stderr, "mlut path requires mlut to be present (built into executable or defined with -mlut-path file)\n");
 #endif
+	if(archive){
+		if(!threads)
+			threads=archive_cpus();
+		if(argv[archive][1]=='a')
+			return archive_build(argv[archive+1], argv+archive+2, argc-archive-2, threads, &opt);
+		return archive_extract(argv[archive+1], argv[archive][1]=='x'?argv[archive+2]:NULL, threads, argv[archive][1]=='l');
+	}
+	if(opt.preview && !STR_ENDS_WITH(argv[argc-2], ".png"))
+		return fprintf(stderr, "-preview needs png input\n");
+	if(level && !STR_ENDS_WITH(argv[argc-1], ".png"))
+		return fprintf(stderr, "-level needs png output\n");
+	if(opt.orientation>1 && (opt.scale>1 || !STR_ENDS_WITH(argv[argc-1], ".png")))
+		return fprintf(stderr, "-orient needs png output and no -scale\n");
 	if ((STR_ENDS_WITH(argv[argc-2], ".ppm")) && ((STR_ENDS_WITH(argv[argc-1], "."EXT_STR))||(0==strcmp(argv[argc-1], "-"))) )
 		return qoi_write_from_ppm(argv[argc-2], argv[argc-1], &opt);
 	else if ( ((STR_ENDS_WITH(argv[argc-2], "."EXT_STR))||(0==strcmp(argv[argc-2], "-"))) && (STR_ENDS_WITH(argv[argc-1], ".ppm")))
@@ -126,7 +517,10 @@ int main(int argc, char **argv) {
 		}
 		else if (STR_ENDS_WITH(argv[argc-2], "."EXT_STR)) {
 			qoi_desc desc;
-			pixels = qoi_read(argv[argc-2], &desc, 0, &opt);
+			if(level)
+				pixels = qoi_read_preview(argv[argc-2], &desc, 0, level, &opt);
+			else
+				pixels = qoi_read(argv[argc-2], &desc, 0, &opt);
 			channels = desc.channels;
 			w = desc.width;
 			h = desc.height;
@@ -0,0 +1,91 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+One format compiled into its own object for qoibench, so that several formats
+can be linked into a single benchmark binary (see the roibench_formats target)
+
+-DROI or -DQOI take the format from qoi.h, -DSOI from soi.h. Every external
+symbol of the format is renamed with FORMAT_PREFIX, and the object exports
+	void *<FORMAT_PREFIX>encode(const void *data, const qoi_desc *desc, int *out_len);
+	void *<FORMAT_PREFIX>decode(const void *data, int size, qoi_desc *desc, int channels);
+which use the default options. data needs the 64 bytes of leading space that
+qoi_encode expects. Both allocate through qoibench's mem_malloc so the results
+are freed with mem_free and show up in --mem, unless QOI_MALLOC is defined.
+
+The qoi.h formats also export the streaming functions as
+<FORMAT_PREFIX>qoi_enc_stream_open etc., which qoitrans.c uses to move pixels
+from one format's decoder straight into another's encoder.
+
+Compile with:
+	gcc -c -O3 -DQOI -DQOI_SCALAR -DFORMAT_PREFIX=qoifmt_ -std=gnu99 qoiformat.c -o qoiformat_qoi.o
+
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifndef FORMAT_PREFIX
+#error "FORMAT_PREFIX must be defined"
+#endif
+#define FORMAT_PASTE(p, n) p##n
+#define FORMAT_PASTE1(p, n) FORMAT_PASTE(p, n)
+#define FORMAT_NAME(n) FORMAT_PASTE1(FORMAT_PREFIX, n)
+
+#ifndef QOI_MALLOC
+void *mem_malloc(size_t sz);
+void mem_free(void *p);
+#define QOI_MALLOC(sz) mem_malloc(sz)
+#define QOI_FREE(p)    mem_free(p)
+#endif
+
+#define qoi_encode           FORMAT_NAME(qoi_encode)
+#define qoi_encode_strided   FORMAT_NAME(qoi_encode_strided)
+#define qoi_estimate_size    FORMAT_NAME(qoi_estimate_size)
+#define qoi_decode           FORMAT_NAME(qoi_decode)
+#define qoi_decode_scaled    FORMAT_NAME(qoi_decode_scaled)
+#define qoi_decode_oriented  FORMAT_NAME(qoi_decode_oriented)
+#define qoi_decode_preview   FORMAT_NAME(qoi_decode_preview)
+#define qoi_preview_levels   FORMAT_NAME(qoi_preview_levels)
+#define qoi_kernel_available FORMAT_NAME(qoi_kernel_available)
+#define qoi_stats_get        FORMAT_NAME(qoi_stats_get)
+#define qoi_stats_reset      FORMAT_NAME(qoi_stats_reset)
+#define qoi_stats_op_names   FORMAT_NAME(qoi_stats_op_names)
+#define qoi_mlut             FORMAT_NAME(qoi_mlut)
+#define gen_mlut             FORMAT_NAME(gen_mlut)
+#define optable              FORMAT_NAME(optable)
+#define qoi_enc_stream_open   FORMAT_NAME(qoi_enc_stream_open)
+#define qoi_enc_stream_buffer FORMAT_NAME(qoi_enc_stream_buffer)
+#define qoi_enc_stream_commit FORMAT_NAME(qoi_enc_stream_commit)
+#define qoi_enc_stream_close  FORMAT_NAME(qoi_enc_stream_close)
+#define qoi_dec_stream_open   FORMAT_NAME(qoi_dec_stream_open)
+#define qoi_dec_stream_read   FORMAT_NAME(qoi_dec_stream_read)
+#define qoi_dec_stream_close  FORMAT_NAME(qoi_dec_stream_close)
+#define qoi_archive_open      FORMAT_NAME(qoi_archive_open)
+#define qoi_archive_find      FORMAT_NAME(qoi_archive_find)
+#define qoi_archive_get       FORMAT_NAME(qoi_archive_get)
+
+#define QOI_IMPLEMENTATION
+#define QOI_NO_STDIO
+#ifdef SOI
+#include "soi.h"
+#else
+#include "qoi.h"
+#endif
+
+void *FORMAT_NAME(encode)(const void *data, const qoi_desc *desc, int *out_len);
+void *FORMAT_NAME(decode)(const void *data, int size, qoi_desc *desc, int channels);
+
+void *FORMAT_NAME(encode)(const void *data, const qoi_desc *desc, int *out_len) {
+#ifdef SOI
+	return qoi_encode(data, desc, out_len);
+#else
+	options opt = {0};
+	return qoi_encode(data, desc, out_len, &opt);
+#endif
+}
+
+void *FORMAT_NAME(decode)(const void *data, int size, qoi_desc *desc, int channels) {
+	return qoi_decode(data, size, desc, channels);
+}
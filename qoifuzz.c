@@ -0,0 +1,835 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+Differential fuzz harness for the encode and decode kernels
+
+Every input is turned into an image (or, for one input class, taken as an op
+stream) and pushed through every path that has to agree:
+	- qoi_encode with every kernel compiled into the build (and with the mlut
+	  when loaded), compared byte for byte against QOI_KERNEL_SCALAR
+	- the streaming encoder qoi_write_from_file with every kernel, which
+	  carries the previous pixel and run across CHUNK boundaries
+	- enc_finish driven over random pixel splits
+	- every dec_arr entry, one-shot through qoi_decode and streaming through
+	  qoi_read_to_file and through random input/output splits of dec_state,
+	  compared against the source pixels
+	- adversarial op streams, where one-shot and split decodes must agree
+	- qoi_encode_strided with padded, top-down and bottom-up rows
+	- BGRA and BGRX input (roi), against the same image given as RGB(A)
+	- qoi_estimate_size of every row against the encoded length
+	- near-lossless encodes, identical across kernels and the streaming encoder
+	  and decoding to within the tolerance of the source pixels
+	- options.long_run and options.raw_blocks, taken at random for each image
+	  by all of the above
+
+Image sizes are biased towards CHUNK multiples plus or minus a few pixels so
+the bulk/tail hand-off is hit, and the pixel generator mixes runs across the 30
+pixel RUN_FULL and 16 pixel SSE boundaries with alpha changes. Any mismatch
+aborts.
+
+Compile with:
+	libFuzzer: clang -g -O1 -fsanitize=fuzzer,address,undefined -fno-sanitize=alignment -DQOI_LIBFUZZER -DROI -DQOI_SSE -msse4 -std=gnu99 qoifuzz.c -o roifuzz
+	AFL:       afl-clang-fast -O2 -DROI -DQOI_SSE -msse4 -std=gnu99 qoifuzz.c -o roifuzz
+	           afl-fuzz -i corpus -o findings ./roifuzz @@
+	replay:    gcc -O1 -g -fsanitize=address,undefined -fno-sanitize=alignment -DROI -DQOI_SSE -msse4 -std=gnu99 qoifuzz.c -o roifuzz
+
+The libFuzzer build takes the mlut from the QOI_FUZZ_MLUT environment variable,
+the standalone build from --mlut-path.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+// The streaming paths read from and write to memory, see fuzz_fread
+static size_t fuzz_fread(void *p, size_t sz, size_t n, FILE *f);
+static size_t fuzz_fwrite(const void *p, size_t sz, size_t n, FILE *f);
+#define QOI_FREAD(p, sz, n, f)  fuzz_fread(p, sz, n, f)
+#define QOI_FWRITE(p, sz, n, f) fuzz_fwrite(p, sz, n, f)
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+
+#if defined ROI && !defined QOI_MLUT_EMBED
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define ERROR(...) fprintf(stderr, "abort at line " TOSTRING(__LINE__) ": " __VA_ARGS__); fprintf(stderr, "\n"); abort()
+#define TOSTRING(x) STRINGIFY(x)
+#define STRINGIFY(x) #x
+
+// Largest image the generator builds, 4 CHUNKs
+#define FUZZ_PIXELS_MAX (4*CHUNK)
+
+
+// -----------------------------------------------------------------------------
+// memory file I/O
+
+// qoi_write_from_file and qoi_read_to_file are run on stdin/stdout ("-"), all
+// their reads come from fuzz_src and all their writes go to fuzz_sink
+static const unsigned char *fuzz_src;
+static size_t fuzz_src_len, fuzz_src_pos;
+static unsigned char *fuzz_sink;
+static size_t fuzz_sink_len, fuzz_sink_cap;
+
+static size_t fuzz_fread(void *p, size_t sz, size_t n, FILE *f) {
+	size_t len = sz * n;
+	(void)f;
+	if (len > fuzz_src_len - fuzz_src_pos)
+		len = fuzz_src_len - fuzz_src_pos;
+	memcpy(p, fuzz_src + fuzz_src_pos, len);
+	fuzz_src_pos += len;
+	return len / sz;
+}
+
+static size_t fuzz_fwrite(const void *p, size_t sz, size_t n, FILE *f) {
+	size_t len = sz * n;
+	(void)f;
+	if (fuzz_sink_len + len > fuzz_sink_cap) {
+		fuzz_sink_cap = (fuzz_sink_len + len) * 2;
+		if (!(fuzz_sink = realloc(fuzz_sink, fuzz_sink_cap))) {
+			ERROR("realloc sink");
+		}
+	}
+	memcpy(fuzz_sink + fuzz_sink_len, p, len);
+	fuzz_sink_len += len;
+	return n;
+}
+
+static void fuzz_io_reset(const void *src, size_t len) {
+	fuzz_src = src;
+	fuzz_src_len = len;
+	fuzz_src_pos = 0;
+	fuzz_sink_len = 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// inputs
+
+static uint64_t rng_state;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+// Random split length, mostly small so boundaries land everywhere
+static unsigned int rng_split(unsigned int max) {
+	unsigned int n = (rng() % 4) ? 1 + rng() % 16 : 1 + rng() % max;
+	return n > max ? max : n;
+}
+
+// Fill n pixels, one control byte from pattern per pixel. The low 3 bits pick
+// a repeat (run), a diff sized for LUMA232/464/777, a random pixel or the raw
+// pattern bytes; bit 7 changes alpha to 0, 255 or a neighbour of the old value
+static void gen_pixels(unsigned char *pixels, unsigned int n, int channels, const unsigned char *pattern, size_t pattern_len) {
+	static const int range[4] = {2, 8, 64, 128};
+	unsigned char px[4] = {0, 0, 0, 255};
+	unsigned int i = 0;
+	while (i < n) {
+		unsigned int ctl = pattern_len ? pattern[i % pattern_len] : rng() & 0xff;
+		unsigned int repeat = 1, cls = ctl & 7;
+		if (cls < 3)
+			repeat = cls == 0 ? 1 + rng() % 300 : 1 + ((ctl >> 3) & 15) * (cls == 1 ? 1 : 4);
+		else if (cls < 6) {
+			int r = range[cls - 3];
+			for (int c = 0; c < 3; ++c)
+				px[c] += (int)(rng() % (2 * r)) - r;
+		}
+		else if (cls == 6) {
+			uint32_t v = rng();
+			memcpy(px, &v, 3);
+		}
+		else {
+			for (int c = 0; c < 3; ++c)
+				px[c] = pattern_len ? pattern[(i + c + 1) % pattern_len] : rng();
+		}
+		if (channels == 4 && (ctl & 0x80) && cls >= 3) {
+			switch (rng() % 4) {
+				case 0: px[3] = 0; break;
+				case 1: px[3] = 255; break;
+				case 2: px[3] += 1; break;
+				default: px[3] -= 1; break;
+			}
+		}
+		for (; repeat && i < n; --repeat, ++i)
+			memcpy(pixels + i * channels, px, channels);
+	}
+}
+
+// Allocate pixels with the 64 bytes qoi_encode may use in front of them, plus
+// the single byte the 3 channel kernels read past the last pixel. Nothing
+// more, so a sanitizer catches reads beyond that
+static unsigned char *pixels_alloc(unsigned int n, int channels) {
+	unsigned char *p = malloc(64 + (size_t)n * channels + (channels == 3));
+	if (!p) {
+		ERROR("malloc pixels");
+	}
+	memset(p, 0, 64 + (size_t)n * channels + (channels == 3));
+	return p + 64;
+}
+
+static void pixels_free(unsigned char *p) {
+	free(p - 64);
+}
+
+
+// -----------------------------------------------------------------------------
+// decode checks
+
+// Decode through dec_arr with random input arrival and random output space,
+// like qoi_read_to_file but with uneven buffer boundaries. Returns the number of
+// pixels decoded, written to out
+static unsigned int dec_split(const unsigned char *enc, unsigned int len, int in_ch, int channels, unsigned int flags, unsigned int pixel_cnt, unsigned char *out) {
+	qoi_desc d = {.channels = in_ch}, *desc = &d;
+	dec_state s = {0};
+	unsigned int src = 0, out_pos = 0, out_max = pixel_cnt * channels;
+	unsigned char *pixels;
+
+	if (!(s.bytes = malloc(len ? len : 1)) || !(pixels = malloc(out_max))) {
+		ERROR("malloc split");
+	}
+	s.pixels = pixels;
+	s.b_limit = len;
+	s.px.rgba.a = 255;
+	s.pixel_cnt = pixel_cnt;
+	s.flags = flags;
+	while (s.pixel_curr != s.pixel_cnt) {
+		if (src < len) {
+			unsigned int n = rng_split(len - src);
+			memcpy(s.bytes + s.b_present, enc + src, n);
+			s.b_present += n;
+			src += n;
+		}
+		s.p_limit = channels * rng_split(pixel_cnt);
+		s = dec_arr[DEC_ARR_INDEX](s);
+		if (out_pos + s.px_pos > out_max) {
+			ERROR("split decode wrote %u bytes past the image", out_pos + s.px_pos - out_max);
+		}
+		memcpy(out + out_pos, s.pixels, s.px_pos);
+		out_pos += s.px_pos;
+		if (!s.px_pos && src == len)//truncated
+			break;
+		memmove(s.bytes, s.bytes + s.b, s.b_present - s.b);
+		s.b_present -= s.b;
+		s.b = 0;
+		s.px_pos = 0;
+	}
+	free(pixels);
+	free(s.bytes);
+	return s.pixel_curr;
+}
+
+// Source pixels of in_ch channels as they should decode to channels
+static void pixels_convert(const unsigned char *in, int in_ch, unsigned char *out, int channels, unsigned int n) {
+	for (unsigned int i = 0; i < n; ++i) {
+		memcpy(out + i * channels, in + i * in_ch, 3);
+		if (channels == 4)
+			out[i * channels + 3] = in_ch == 4 ? in[i * in_ch + 3] : 255;
+	}
+}
+
+// Box filter down by scale, the plain way
+static unsigned char *box_shrink(const unsigned char *src, unsigned int w, unsigned int h, int ch, unsigned int scale) {
+	unsigned int ow = (w + scale - 1) / scale, oh = (h + scale - 1) / scale;
+	unsigned char *dst = malloc((size_t)ow * oh * ch);
+	if (!dst) {
+		ERROR("malloc box");
+	}
+	for (unsigned int oy = 0; oy < oh; ++oy)
+		for (unsigned int ox = 0; ox < ow; ++ox)
+			for (int c = 0; c < ch; ++c) {
+				unsigned int sum = 0, cnt = 0;
+				for (unsigned int y = oy * scale; y < oy * scale + scale && y < h; ++y)
+					for (unsigned int x = ox * scale; x < ox * scale + scale && x < w; ++x, ++cnt)
+						sum += src[((size_t)y * w + x) * ch + c];
+				dst[((size_t)oy * ow + ox) * ch + c] = (sum + cnt / 2) / cnt;
+			}
+	return dst;
+}
+
+// Decode a valid stream of the image through every dec_arr entry it can use
+static void check_decode(const unsigned char *enc, int len, const unsigned char *pixels, const qoi_desc *desc, const options *opt) {
+	unsigned int n = desc->width * desc->height;
+	unsigned char *expect = malloc(n * 4), *out = malloc(n * 4);
+	if (!expect || !out) {
+		ERROR("malloc decode");
+	}
+	for (int channels = 3; channels <= 4; ++channels) {
+		qoi_desc dd;
+		unsigned int flags;
+		pixels_convert(pixels, desc->channels, expect, channels, n);
+
+		unsigned char *dec = qoi_decode(enc, len, &dd, channels);
+		if (!dec) {
+			ERROR("qoi_decode %d->%d failed", desc->channels, channels);
+		}
+		if (dd.width != desc->width || dd.height != desc->height || dd.channels != desc->channels) {
+			ERROR("qoi_decode %d->%d header mismatch", desc->channels, channels);
+		}
+		if (memcmp(dec, expect, n * channels)) {
+			ERROR("qoi_decode %d->%d pixel mismatch", desc->channels, channels);
+		}
+		QOI_FREE(dec);
+
+		if (dec_split(enc + QOI_HEADER_SIZE, len - QOI_HEADER_SIZE, desc->channels, channels, qoi_header_flags(enc[QOI_HEADER_SIZE - 1], &dd), n, out) != n) {
+			ERROR("split decode %d->%d stopped early", desc->channels, channels);
+		}
+		if (memcmp(out, expect, n * channels)) {
+			ERROR("split decode %d->%d pixel mismatch", desc->channels, channels);
+		}
+
+		fuzz_io_reset(enc, len);
+		if (file_to_desc(stdin, &dd, &flags) || qoi_read_to_file(stdin, "-", NULL, 0, &dd, flags, channels, opt)) {
+			ERROR("qoi_read_to_file %d->%d failed", desc->channels, channels);
+		}
+		if (fuzz_sink_len != n * channels || memcmp(fuzz_sink, expect, n * channels)) {
+			ERROR("qoi_read_to_file %d->%d pixel mismatch", desc->channels, channels);
+		}
+
+		options sopt = *opt;
+		sopt.scale = 2 << rng() % 3;
+		unsigned char *box = box_shrink(expect, desc->width, desc->height, channels, sopt.scale);
+		size_t box_len = (size_t)((desc->width + sopt.scale - 1) / sopt.scale) * ((desc->height + sopt.scale - 1) / sopt.scale) * channels;
+		dec = qoi_decode_scaled(enc, len, &dd, channels, sopt.scale);
+		if (!dec || dd.width != (desc->width + sopt.scale - 1) / sopt.scale || memcmp(dec, box, box_len)) {
+			ERROR("qoi_decode_scaled %d->%d by %d mismatch", desc->channels, channels, sopt.scale);
+		}
+		QOI_FREE(dec);
+		fuzz_io_reset(enc, len);
+		if (file_to_desc(stdin, &dd, &flags) || qoi_read_to_file(stdin, "-", NULL, 0, &dd, flags, channels, &sopt)) {
+			ERROR("qoi_read_to_file %d->%d by %d failed", desc->channels, channels, sopt.scale);
+		}
+		if (fuzz_sink_len != box_len || memcmp(fuzz_sink, box, box_len)) {
+			ERROR("qoi_read_to_file %d->%d by %d mismatch", desc->channels, channels, sopt.scale);
+		}
+		free(box);
+
+		int orientation = 2 + rng() % 7;
+		unsigned int ow = orientation >= 5 ? desc->height : desc->width;
+		dec = qoi_decode_oriented(enc, len, &dd, channels, orientation);
+		if (!dec || dd.width != ow || dd.height != n / ow) {
+			ERROR("qoi_decode_oriented %d->%d orientation %d failed", desc->channels, channels, orientation);
+		}
+		for (unsigned int y = 0; y < desc->height; ++y)
+			for (unsigned int x = 0; x < desc->width; ++x) {
+				unsigned int tx = orientation == 2 || orientation == 3 ? desc->width - 1 - x : x;
+				unsigned int ty = orientation == 3 || orientation == 4 ? desc->height - 1 - y : y;
+				if (orientation >= 5) {
+					tx = orientation == 6 || orientation == 7 ? desc->height - 1 - y : y;
+					ty = orientation == 7 || orientation == 8 ? desc->width - 1 - x : x;
+				}
+				if (memcmp(dec + ((size_t)ty * ow + tx) * channels, expect + ((size_t)y * desc->width + x) * channels, channels)) {
+					ERROR("qoi_decode_oriented %d->%d orientation %d pixel %u,%u misplaced", desc->channels, channels, orientation, x, y);
+				}
+			}
+		QOI_FREE(dec);
+	}
+	free(out);
+	free(expect);
+}
+
+// Arbitrary op stream: the one-shot and split decodes have to agree on how
+// far they get and on every pixel up to there
+static void check_decode_raw(const unsigned char *ops, size_t len, unsigned int width, unsigned int height, int in_ch, unsigned int flags) {
+	qoi_desc d = {.channels = in_ch}, *desc = &d;
+	unsigned int n = width * height;
+	unsigned char *bytes = malloc(len ? len : 1), *ref = malloc(n * 4), *out = malloc(n * 4);
+	if (!bytes || !ref || !out) {
+		ERROR("malloc raw");
+	}
+	memcpy(bytes, ops, len);
+	for (int channels = 3; channels <= 4; ++channels) {
+		dec_state s = {0};
+		s.bytes = bytes;
+		s.pixels = ref;
+		s.b_limit = s.b_present = len;
+		s.p_limit = n * channels;
+		s.px.rgba.a = 255;
+		s.pixel_cnt = n;
+		s.flags = flags;
+		s = dec_arr[DEC_ARR_INDEX](s);
+		if (s.b > len) {
+			ERROR("raw decode %d->%d read %u bytes past the input", in_ch, channels, (unsigned int)(s.b - len));
+		}
+		if (dec_split(ops, len, in_ch, channels, flags, n, out) != s.pixel_curr) {
+			ERROR("raw decode %d->%d split stopped at a different pixel", in_ch, channels);
+		}
+		if (memcmp(out, ref, s.pixel_curr * channels)) {
+			ERROR("raw decode %d->%d split pixel mismatch", in_ch, channels);
+		}
+	}
+	free(out);
+	free(ref);
+	free(bytes);
+}
+
+
+// -----------------------------------------------------------------------------
+// encode checks
+
+// the finish kernels of opt over random pixel splits, the run carries between
+// calls and each split picks its own kernel like the streaming encoder does per
+// CHUNK. Splits stop at the end of each CHUNK for qoi_raw_block
+static void check_encode_split(const unsigned char *pixels, const qoi_desc *desc, const options *opt, const unsigned char *ref, int ref_len) {
+	unsigned int n = desc->width * desc->height, block = 0;
+	enc_state s = {0}, before;
+	if (!(s.bytes = malloc(n * QOI_PIXEL_WORST_CASE + QOI_HEADER_SIZE + sizeof(qoi_padding)))) {
+		ERROR("malloc split encode");
+	}
+	if (!qoi_kernel_select(opt, &s)) {
+		ERROR("split encode kernel");
+	}
+	s.pixels = (unsigned char *)pixels;
+	memset(s.pixels - 4, 0, 4);
+	if (desc->channels == 4)
+		*(s.pixels - 1) = 255;
+	qoi_encode_init(&s, desc, opt);
+	before = s;
+	while (s.pixel_cnt != n) {
+		unsigned int from = s.pixel_cnt, end = n - block < CHUNK ? n : block + CHUNK;
+		s.pixel_cnt += rng_split(end - s.pixel_cnt);
+		s = s.finish[qoi_enc_index(s.pixels + from * desc->channels, s.pixel_cnt - from, desc->channels, QOI_INPUT_RGB, (s.pixels + from * desc->channels)[-1])](s);
+		if (s.pixel_cnt == end) {
+			s = qoi_raw_block(before, s, s.pixels + block * desc->channels, end - block, desc->channels, QOI_INPUT_RGB);
+			before = s;
+			block = end;
+		}
+	}
+	DUMP_RUN(s.run);
+	memcpy(s.bytes + s.b, qoi_padding, sizeof(qoi_padding));
+	s.b += sizeof(qoi_padding);
+	if ((int)s.b != ref_len || memcmp(s.bytes, ref, ref_len)) {
+		ERROR("split encode %d mismatch", desc->channels);
+	}
+	free(s.bytes);
+}
+
+// qoi_encode_strided from a copy of the image with random row padding, top-down
+// or bottom-up. The copy has nothing around the rows so a sanitizer catches any
+// read outside them
+static void check_strided(const unsigned char *pixels, const qoi_desc *desc, const options *opt, const unsigned char *ref, int ref_len, const char *name) {
+	unsigned int rowbytes = desc->width * (opt->input ? 4 : desc->channels);
+	unsigned int pitch = rowbytes + (rng() & 1 ? 0 : rng() % 17);
+	size_t size = (size_t)pitch * (desc->height - 1) + rowbytes;
+	unsigned char *buf = malloc(size), *top;
+	int stride = pitch, len;
+	if (!buf) {
+		ERROR("malloc strided");
+	}
+	memset(buf, 0xa5, size);
+	top = buf;
+	if (rng() & 1) {
+		top = buf + (size_t)pitch * (desc->height - 1);
+		stride = -stride;
+	}
+	for (unsigned int y = 0; y < desc->height; ++y)
+		memcpy(top + (ptrdiff_t)y * stride, pixels + (size_t)y * rowbytes, rowbytes);
+
+	unsigned char *enc = qoi_encode_strided(top, stride, desc, &len, opt);
+	if (!enc || len != ref_len || memcmp(enc, ref, len)) {
+		ERROR("%s strided encode %ux%u %d stride %d differs from scalar", name, desc->width, desc->height, desc->channels, stride);
+	}
+	QOI_FREE(enc);
+	free(buf);
+}
+
+#ifdef ROI
+// The image as 4 byte BGRA input, or as BGRX with random X bytes where it is
+// stored opaque or without alpha, through qoi_encode and qoi_encode_strided
+static void check_swizzle(const unsigned char *pixels, const qoi_desc *desc, options opt, const unsigned char *ref, int ref_len, const char *name) {
+	unsigned int n = desc->width * desc->height;
+	unsigned char *bgr = pixels_alloc(n, 4);
+	int len;
+	opt.input = QOI_INPUT_BGRA;
+	if ((desc->channels == 3 || qoi_opaque(pixels, n)) && (rng() & 1))
+		opt.input = QOI_INPUT_BGRX;
+	for (unsigned int i = 0; i < n; ++i) {
+		bgr[i * 4] = pixels[i * desc->channels + 2];
+		bgr[i * 4 + 1] = pixels[i * desc->channels + 1];
+		bgr[i * 4 + 2] = pixels[i * desc->channels];
+		bgr[i * 4 + 3] = desc->channels == 4 && opt.input == QOI_INPUT_BGRA ? pixels[i * 4 + 3] : rng();
+	}
+
+	unsigned char *enc = qoi_encode(bgr, desc, &len, &opt);
+	if (!enc || len != ref_len || memcmp(enc, ref, len)) {
+		ERROR("%s %s encode %ux%u %d differs from scalar", name, opt.input == QOI_INPUT_BGRA ? "bgra" : "bgrx", desc->width, desc->height, desc->channels);
+	}
+	QOI_FREE(enc);
+	check_strided(bgr, desc, &opt, ref, ref_len, name);
+
+	int plen, rlen;
+	options ropt = opt;
+	ropt.input = QOI_INPUT_RGB;
+	opt.preview = ropt.preview = 1;
+	enc = qoi_encode(bgr, desc, &len, &opt);
+	unsigned char *penc = qoi_encode(pixels, desc, &plen, &ropt);
+	rlen = len;
+	if (!enc || !penc || len != plen || memcmp(enc, penc, len)) {
+		ERROR("%s %s preview %ux%u %d differs from rgb", name, opt.input == QOI_INPUT_BGRA ? "bgra" : "bgrx", desc->width, desc->height, desc->channels);
+	}
+	QOI_FREE(enc);
+	enc = qoi_encode_strided(bgr, desc->width * 4, desc, &len, &opt);
+	if (!enc || len != rlen || memcmp(enc, penc, len)) {
+		ERROR("%s %s strided preview %ux%u %d differs from rgb", name, opt.input == QOI_INPUT_BGRA ? "bgra" : "bgrx", desc->width, desc->height, desc->channels);
+	}
+	QOI_FREE(enc);
+	QOI_FREE(penc);
+	pixels_free(bgr);
+}
+#endif
+
+// options.preview through qoi_encode and qoi_encode_strided: the image is
+// unchanged in front of the levels and level l is the image box filtered by
+// 4^l directly, not by 4 from the rounded level above
+static void check_preview(const unsigned char *pixels, const qoi_desc *desc, options opt, const unsigned char *ref, int ref_len, const char *name) {
+	int len, slen, levels;
+	qoi_desc dd;
+	unsigned char *level, *out;
+	unsigned int w, h, scale = 1;
+	opt.preview = 1 + rng() % QOI_PREVIEW_LEVELS_MAX;
+	unsigned char *enc = qoi_encode(pixels, desc, &len, &opt);
+	if (!enc || len <= ref_len || memcmp(enc, ref, ref_len)) {
+		ERROR("%s preview %d encode %ux%u %d changed the image", name, opt.preview, desc->width, desc->height, desc->channels);
+	}
+	unsigned char *senc = qoi_encode_strided(pixels, desc->width * desc->channels, desc, &slen, &opt);
+	if (!senc || slen != len || memcmp(senc, enc, len)) {
+		ERROR("%s preview %d strided encode %ux%u %d differs", name, opt.preview, desc->width, desc->height, desc->channels);
+	}
+	QOI_FREE(senc);
+	if ((levels = qoi_preview_levels(enc, len)) != opt.preview) {
+		ERROR("%s preview %d found %d levels", name, opt.preview, levels);
+	}
+	if (qoi_decode_preview(enc, len, &dd, 0, levels + 1)) {
+		ERROR("%s preview decoded a missing level", name);
+	}
+	for (int l = 1; l <= levels; ++l) {
+		scale *= 4;
+		level = box_shrink(pixels, desc->width, desc->height, desc->channels, scale);
+		w = (desc->width + scale - 1) / scale;
+		h = (desc->height + scale - 1) / scale;
+		out = qoi_decode_preview(enc, len, &dd, 0, l);
+		if (!out || dd.width != w || dd.height != h || dd.channels != desc->channels || memcmp(out, level, (size_t)w * h * desc->channels)) {
+			ERROR("%s preview level %d of %ux%u %d differs", name, l, desc->width, desc->height, desc->channels);
+		}
+		QOI_FREE(out);
+		free(level);
+	}
+	QOI_FREE(qoi_decode_preview(enc, len - 1 - rng() % 8, &dd, 0, 1 + rng() % 3));
+	QOI_FREE(enc);
+}
+
+static const char *const kernel_names[QOI_KERNEL_COUNT] = {"auto", "scalar", "mlut", "sse", "avx2", "avx512"};
+
+// Every kernel, one-shot and streaming, against the scalar reference
+static void check_image(unsigned char *pixels, const qoi_desc *desc) {
+	unsigned int n = desc->width * desc->height;
+	options opt = {.kernel = QOI_KERNEL_SCALAR, .long_run = rng() & 1, .raw_blocks = rng() & 1};
+	int ref_len, len;
+	unsigned char *ref = qoi_encode(pixels, desc, &ref_len, &opt);
+	if (!ref) {
+		ERROR("scalar encode %ux%u %d failed", desc->width, desc->height, desc->channels);
+	}
+	len = qoi_estimate_size(pixels, desc, 1);
+	if (!opt.long_run && !opt.raw_blocks && len != ref_len) {//the estimate is of the plain variant
+		ERROR("estimate %d for %ux%u %d, encoded %d", len, desc->width, desc->height, desc->channels, ref_len);
+	}
+	if (qoi_estimate_size(pixels, desc, 1 + rng() % 8) <= 0) {
+		ERROR("sampled estimate %ux%u %d failed", desc->width, desc->height, desc->channels);
+	}
+
+	for (int kernel = QOI_KERNEL_AUTO; kernel < QOI_KERNEL_COUNT; ++kernel) {
+		if (!qoi_kernel_available(kernel))
+			continue;
+		for (int mlut = 0; mlut < 2; ++mlut) {
+#ifdef ROI
+			if (mlut && !qoi_mlut)
+				continue;
+#else
+			if (mlut)
+				continue;
+#endif
+			opt.kernel = kernel;
+			opt.mlut = mlut;
+
+			unsigned char *enc = qoi_encode(pixels, desc, &len, &opt);
+			if (!enc) {
+				ERROR("%s%s encode failed", kernel_names[kernel], mlut ? "+mlut" : "");
+			}
+			if (len != ref_len || memcmp(enc, ref, len)) {
+				ERROR("%s%s encode %ux%u %d differs from scalar", kernel_names[kernel], mlut ? "+mlut" : "", desc->width, desc->height, desc->channels);
+			}
+			QOI_FREE(enc);
+
+			fuzz_io_reset(pixels, (size_t)n * desc->channels);
+			if (qoi_write_from_file(stdin, "-", (qoi_desc *)desc, &opt)) {
+				ERROR("%s%s streaming encode failed", kernel_names[kernel], mlut ? "+mlut" : "");
+			}
+			if ((int)fuzz_sink_len != ref_len || memcmp(fuzz_sink, ref, ref_len)) {
+				ERROR("%s%s streaming encode %ux%u %d differs from scalar", kernel_names[kernel], mlut ? "+mlut" : "", desc->width, desc->height, desc->channels);
+			}
+
+			check_strided(pixels, desc, &opt, ref, ref_len, kernel_names[kernel]);
+			check_preview(pixels, desc, opt, ref, ref_len, kernel_names[kernel]);
+#ifdef ROI
+			check_swizzle(pixels, desc, opt, ref, ref_len, kernel_names[kernel]);
+#endif
+
+			check_encode_split(pixels, desc, &opt, ref, ref_len);
+		}
+	}
+
+	opt.kernel = QOI_KERNEL_AUTO;
+	opt.mlut = 0;
+	check_decode(ref, ref_len, pixels, desc, &opt);
+	QOI_FREE(ref);
+}
+
+// options.tolerance through every kernel and the streaming encoder, and the
+// decoded pixels against the bound
+static void check_near(const unsigned char *pixels, const qoi_desc *desc, int tolerance) {
+	unsigned int n = desc->width * desc->height;
+	options opt = {.kernel = QOI_KERNEL_SCALAR, .tolerance = tolerance, .long_run = rng() & 1, .raw_blocks = rng() & 1};
+	int ref_len, len;
+	qoi_desc dd;
+	unsigned char *ref = qoi_encode(pixels, desc, &ref_len, &opt);
+	if (!ref) {
+		ERROR("near %d encode %ux%u %d failed", tolerance, desc->width, desc->height, desc->channels);
+	}
+
+	for (int kernel = QOI_KERNEL_AUTO; kernel < QOI_KERNEL_COUNT; ++kernel) {
+		if (!qoi_kernel_available(kernel))
+			continue;
+		for (int mlut = 0; mlut < 2; ++mlut) {
+#ifdef ROI
+			if (mlut && !qoi_mlut)
+				continue;
+#else
+			if (mlut)
+				continue;
+#endif
+			opt.kernel = kernel;
+			opt.mlut = mlut;
+
+			unsigned char *enc = qoi_encode(pixels, desc, &len, &opt);
+			if (!enc || len != ref_len || memcmp(enc, ref, len)) {
+				ERROR("%s%s near %d encode %ux%u %d differs from scalar", kernel_names[kernel], mlut ? "+mlut" : "", tolerance, desc->width, desc->height, desc->channels);
+			}
+			QOI_FREE(enc);
+
+			fuzz_io_reset(pixels, (size_t)n * desc->channels);
+			if (qoi_write_from_file(stdin, "-", (qoi_desc *)desc, &opt) || (int)fuzz_sink_len != ref_len || memcmp(fuzz_sink, ref, ref_len)) {
+				ERROR("%s%s near %d streaming encode %ux%u %d differs from scalar", kernel_names[kernel], mlut ? "+mlut" : "", tolerance, desc->width, desc->height, desc->channels);
+			}
+			check_strided(pixels, desc, &opt, ref, ref_len, kernel_names[kernel]);
+		}
+	}
+
+	//previews are of the input, not the quantized pixels
+	opt.preview = 1;
+	unsigned char *enc = qoi_encode(pixels, desc, &len, &opt), *box = box_shrink(pixels, desc->width, desc->height, desc->channels, 4);
+	unsigned char *out = enc ? qoi_decode_preview(enc, len, &dd, 0, 1) : NULL;
+	if (!out || len <= ref_len || memcmp(enc, ref, ref_len) || memcmp(out, box, (size_t)dd.width * dd.height * desc->channels)) {
+		ERROR("near %d preview %ux%u %d differs", tolerance, desc->width, desc->height, desc->channels);
+	}
+	QOI_FREE(out);
+	QOI_FREE(enc);
+	free(box);
+
+	out = qoi_decode(ref, ref_len, &dd, 0);
+	if (!out) {
+		ERROR("near %d decode failed", tolerance);
+	}
+	for (size_t i = 0; i < (size_t)n * desc->channels; ++i) {
+		if (abs(out[i] - pixels[i]) > tolerance) {
+			ERROR("near %d pixel %zu channel %zu off by %d", tolerance, i / desc->channels, i % desc->channels, abs(out[i] - pixels[i]));
+		}
+	}
+	QOI_FREE(out);
+	QOI_FREE(ref);
+}
+
+
+// -----------------------------------------------------------------------------
+// entry
+
+/* The first 8 bytes of an input select what to build, the rest is the pixel
+pattern (or the op stream):
+	data[0]  bits 0-1: shape, 0 small, 1 CHUNK multiple +-128, 2 large,
+	         3 op stream; bit 2: op stream channels; bits 3-4: 1 RGBA fully
+	         opaque, 2 RGBA opaque over the first half; bits 5-6: op stream
+	         read as QOI_FLAG_LONG_RUN and QOI_FLAG_RAW_BLOCKS
+	data[1..3]: size parameters
+	data[4..7]: rng seed */
+static void fuzz_one(const uint8_t *data, size_t size) {
+	uint8_t head[8] = {0};
+	unsigned int width, height;
+	memcpy(head, data, size < 8 ? size : 8);
+	const uint8_t *pattern = data + (size < 8 ? size : 8);
+	size_t pattern_len = size < 8 ? 0 : size - 8;
+
+	rng_state = 0x9E3779B97F4A7C15ull ^ ((uint64_t)head[4] | head[5] << 8 | head[6] << 16 | (uint64_t)head[7] << 24);
+	switch (head[0] & 3) {
+		case 0:
+			width = 1 + head[1] % 64;
+			height = 1 + head[3] % 64;
+			break;
+		case 1: {
+			int n = (1 + head[3] % 3) * CHUNK + (signed char)head[1];
+			width = n;
+			height = 1;
+			if (head[2] & 1) {//about the same pixel count over 16 rows
+				width = n / 16;
+				height = 16;
+			}
+			break;
+		}
+		case 2:
+			width = 1 + (head[1] | head[2] << 8) % 2048;
+			height = 1 + head[3];
+			break;
+		default:
+			check_decode_raw(pattern, pattern_len, 1 + head[1] % 64, 1 + head[3] % 64, 3 + ((head[0] >> 2) & 1), ((head[0] >> 5) & 3) << 4);
+			return;
+	}
+	if (width * height > FUZZ_PIXELS_MAX)
+		height = FUZZ_PIXELS_MAX / width;
+
+	unsigned char *rgba = pixels_alloc(width * height, 4), *rgb = pixels_alloc(width * height, 3);
+	gen_pixels(rgba, width * height, 4, pattern, pattern_len);
+	if ((head[0] >> 3 & 3) == 1 || (head[0] >> 3 & 3) == 2) {//opaque RGBA takes the chunk4o kernels
+		unsigned int opaque = (head[0] >> 3 & 3) == 1 ? width * height : width * height / 2;
+		for (unsigned int i = 0; i < opaque; ++i)
+			rgba[i * 4 + 3] = 255;
+	}
+	pixels_convert(rgba, 4, rgb, 3, width * height);
+	check_image(rgb, &(qoi_desc){.width = width, .height = height, .channels = 3, .colorspace = QOI_SRGB});
+	check_image(rgba, &(qoi_desc){.width = width, .height = height, .channels = 4, .colorspace = QOI_SRGB});
+	check_near(rgb, &(qoi_desc){.width = width, .height = height, .channels = 3, .colorspace = QOI_SRGB}, 1 + (head[2] >> 5));
+	check_near(rgba, &(qoi_desc){.width = width, .height = height, .channels = 4, .colorspace = QOI_SRGB}, 1 + (head[2] >> 5));
+	pixels_free(rgb);
+	pixels_free(rgba);
+}
+
+#if defined ROI && !defined QOI_MLUT_EMBED
+static int mlut_map(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	qoi_mlut = mmap(NULL, 256*256*256*5, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (qoi_mlut == MAP_FAILED) {
+		qoi_mlut = NULL;
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef QOI_LIBFUZZER
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+	(void)argc;
+	(void)argv;
+#if defined ROI && !defined QOI_MLUT_EMBED
+	const char *path = getenv("QOI_FUZZ_MLUT");
+	if (path && mlut_map(path)) {
+		ERROR("Can't map mlut %s", path);
+	}
+#endif
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	fuzz_one(data, size);
+	return 0;
+}
+#else
+static void fuzz_file(FILE *f, const char *name) {
+	uint8_t *data = NULL;
+	size_t size = 0, cap = 0, n;
+	do {
+		if (size == cap && !(data = realloc(data, cap = cap ? cap * 2 : 65536))) {
+			ERROR("realloc input");
+		}
+		n = fread(data + size, 1, cap - size, f);
+		size += n;
+	} while (n);
+	fuzz_one(data, size);
+	free(data);
+	printf("%s ok\n", name);
+}
+
+int main(int argc, char **argv) {
+	int files = 0;
+	unsigned int random = 0;
+	uint64_t seed = 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--random") == 0 && (i+1)<argc) {
+			random = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && (i+1)<argc) {
+			seed = strtoull(argv[++i], NULL, 10);
+		}
+#if defined ROI && !defined QOI_MLUT_EMBED
+		else if (strcmp(argv[i], "--mlut-path") == 0 && (i+1)<argc) {
+			if (mlut_map(argv[++i])) {
+				ERROR("Can't map mlut %s", argv[i]);
+			}
+		}
+#endif
+		else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			printf("Usage: "EXT_STR"fuzz [options] [file...]\n");
+			printf("Replays each file (stdin if none, for AFL) through every kernel\n");
+			printf("Options:\n");
+			printf("    --random n ...... run n generated inputs instead\n");
+			printf("    --seed s ........ seed for --random, default 1\n");
+#if defined ROI && !defined QOI_MLUT_EMBED
+			printf("    --mlut-path file  also check the mlut kernels\n");
+#endif
+			return 0;
+		}
+		else if (argv[i][0] == '-' && argv[i][1]) {
+			ERROR("Unknown option %s", argv[i]);
+		}
+		else
+			files++;
+	}
+
+	if (random) {
+		for (unsigned int k = 0; k < random; ++k) {
+			uint8_t data[4096];
+			size_t size;
+			rng_state = seed * 0x9E3779B97F4A7C15ull + k;
+			size = rng() % sizeof(data);
+			for (size_t j = 0; j < size; ++j)
+				data[j] = rng();
+			fuzz_one(data, size);
+		}
+		printf("%u random inputs ok\n", random);
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--seed") == 0 || strcmp(argv[i], "--random") == 0 || strcmp(argv[i], "--mlut-path") == 0) {
+			i++;
+			continue;
+		}
+		FILE *f = fopen(argv[i], "rb");
+		if (!f) {
+			ERROR("Can't open %s", argv[i]);
+		}
+		fuzz_file(f, argv[i]);
+		fclose(f);
+	}
+	if (!files)
+		fuzz_file(stdin, "stdin");
+	return 0;
+}
+#endif
@@ -0,0 +1,373 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+Microbenchmark of the individual roi kernels on generated inputs
+
+Every stage runs in isolation on CHUNK pixels whose op mix and run density are
+controlled, so a kernel change can be checked in seconds:
+	- RGB classification and op writing: RGB_ENC_SCALAR, the mlut lookup and
+	  SSE_COMMON, on inputs that only produce one op size
+	- QOI_SSE_RUNWRITER against the scalar run handling at different run
+	  densities
+	- the qoi_estimate_size kernels next to the encode kernels they count for
+	- each dec_in*out* decoder
+	- the PAM and PPM header parsers
+
+Compile with:
+	gcc qoikernel.c -std=gnu99 -O3 -DROI -DQOI_SSE -msse4 -o roikernel
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+
+#ifndef ROI
+#error "qoikernel measures the roi kernels, build with -DROI"
+#endif
+
+#ifndef QOI_MLUT_EMBED
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define ERROR(...) printf("abort at line " TOSTRING(__LINE__) ": " __VA_ARGS__); printf("\n"); exit(1)
+#define TOSTRING(x) #x
+
+int opt_runs = 50;
+
+static uint64_t ns() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec * 1000000000ull + spec.tv_nsec;
+}
+
+// Fastest of opt_runs calls, after one warmup call
+#define KERNEL_TIME(BEST, ...) do { \
+	BEST = UINT64_MAX; \
+	for (int run = 0; run <= opt_runs; ++run) { \
+		uint64_t time_start = ns(); \
+		__VA_ARGS__ \
+		uint64_t time = ns() - time_start; \
+		if (run && time < BEST) \
+			BEST = time; \
+	} \
+} while (0)
+
+
+// -----------------------------------------------------------------------------
+// inputs
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+// Op size class of a diff, as decided by RGB_ENC_SCALAR: 0..3 for
+// LUMA232/464/777/RGB
+static int op_class(signed char vg, signed char vg_r, signed char vg_b) {
+	unsigned char ar = (vg_r<0)?(-vg_r)-1:vg_r;
+	unsigned char ag = (vg<0)?(-vg)-1:vg;
+	unsigned char ab = (vg_b<0)?(-vg_b)-1:vg_b;
+	unsigned char arb = ar|ab;
+	if (arb < 2 && ag < 4)
+		return 0;
+	if (arb < 8 && ag < 32)
+		return 1;
+	if ((arb|ag) < 64)
+		return 2;
+	return 3;
+}
+
+enum {
+	INPUT_LUMA232,
+	INPUT_LUMA464,
+	INPUT_LUMA777,
+	INPUT_RGB,
+	INPUT_MIX,
+	INPUT_COUNT
+};
+static const char *const input_names[INPUT_COUNT] = {"luma232", "luma464", "luma777", "rgb", "mix"};
+
+// Fill pixels so every non-run pixel encodes with the op of cls (or a random
+// op for INPUT_MIX). run is the chance in percent of repeating the previous
+// pixel, alpha the chance of a new alpha value for 4 channels
+static void gen_pixels(unsigned char *pixels, int n, int channels, int cls, int run, int alpha) {
+	static const int range_g[4] = {4, 32, 64, 128}, range_rb[4] = {2, 8, 64, 128};
+	unsigned char prev[4] = {0, 0, 0, 255};
+	rng_state = 0x9E3779B97F4A7C15ull;
+	for (int i = 0; i < n; ++i) {
+		unsigned char *p = pixels + i * channels;
+		if ((int)(rng() % 100) < run) {
+			memcpy(p, prev, channels);
+			continue;
+		}
+		int c = cls == INPUT_MIX ? (int)(rng() % 4) : cls;
+		signed char vg, vg_r, vg_b;
+		do {
+			vg = (int)(rng() % (2 * range_g[c])) - range_g[c];
+			vg_r = (int)(rng() % (2 * range_rb[c])) - range_rb[c];
+			vg_b = (int)(rng() % (2 * range_rb[c])) - range_rb[c];
+		} while ((!vg && !vg_r && !vg_b) || op_class(vg, vg_r, vg_b) != c);
+		prev[0] += vg_r + vg;
+		prev[1] += vg;
+		prev[2] += vg_b + vg;
+		if (channels == 4 && (int)(rng() % 100) < alpha)
+			prev[3] = rng();
+		memcpy(p, prev, channels);
+	}
+}
+
+// Number of ops in an roi op stream
+static unsigned int count_ops(const unsigned char *bytes, unsigned int len) {
+	unsigned int ops = 0, b = 0;
+	while (b < len) {
+		unsigned char op = bytes[b];
+		if ((op & QOI_MASK_1) == QOI_OP_LUMA232)
+			b += 1;
+		else if ((op & QOI_MASK_2) == QOI_OP_LUMA464)
+			b += 2;
+		else if ((op & QOI_MASK_3) == QOI_OP_LUMA777)
+			b += 3;
+		else if (op == QOI_OP_RGB)
+			b += 4;
+		else if (op == QOI_OP_RGBA)
+			b += 2;
+		else
+			b += 1;
+		ops++;
+	}
+	return ops;
+}
+
+
+// -----------------------------------------------------------------------------
+// kernels
+
+typedef enc_state (*enc_fn)(enc_state);
+typedef dec_state (*dec_fn)(dec_state);
+
+static void print_row(const char *kernel, const char *input, uint64_t t, unsigned int px, unsigned int ops) {
+	printf("%-20s %-14s %8.3f %8.3f %9.1f\n", kernel, input,
+		(double)t / px, ops ? (double)t / ops : 0, px / ((double)t / 1000.0));
+}
+
+// pixels need 64 bytes of zeroed leading space, like in qoi_encode. Returns the
+// encoded length with the pending run. The simd 4 channel kernels fall back to
+// the scalar finish kernels on alpha changes
+static unsigned int bench_encode(const char *kernel, const char *input, enc_fn fn, unsigned char *pixels, int channels, unsigned char *bytes) {
+	enc_state s = {0};
+	uint64_t t;
+	if (channels == 4)
+		pixels[-1] = 255;
+	KERNEL_TIME(t, {
+		memset(&s, 0, sizeof(s));
+		s.finish = enc_kernels[QOI_KERNEL_SCALAR];
+		s.pixels = pixels;
+		s.bytes = bytes;
+		s.pixel_cnt = CHUNK;
+		s = fn(s);
+	});
+	unsigned int ops = count_ops(bytes, s.b) + (s.run + QOI_RUN_FULL_VAL - 1) / QOI_RUN_FULL_VAL;//pending run
+	print_row(kernel, input, t, CHUNK, ops);
+	return s.b + (s.run + QOI_RUN_FULL_VAL - 1) / QOI_RUN_FULL_VAL;
+}
+
+// a qoi_estimate_size kernel, whose count must match the encoded length from
+// bench_encode on the same pixels, pending run included. It writes no ops so
+// ns/op is left at 0
+static void bench_size(const char *kernel, const char *input, enc_fn fn, unsigned char *pixels, unsigned int encoded) {
+	enc_state s = {0};
+	uint64_t t;
+	KERNEL_TIME(t, {
+		memset(&s, 0, sizeof(s));
+		s.pixels = pixels;
+		s.pixel_cnt = CHUNK;
+		s = fn(s);
+	});
+	SIZE_RUN(s.run);
+	if (s.b != encoded) {
+		ERROR("%s %s counted %u bytes, encoded %u", kernel, input, s.b, encoded);
+	}
+	print_row(kernel, input, t, CHUNK, 0);
+}
+
+static void bench_decode(const char *kernel, const char *input, dec_fn fn, const unsigned char *encoded, int size, int channels, unsigned char *out) {
+	dec_state s = {0};
+	uint64_t t;
+	KERNEL_TIME(t, {
+		memset(&s, 0, sizeof(s));
+		s.bytes = (unsigned char *)encoded;
+		s.b = QOI_HEADER_SIZE;
+		s.b_limit = size;
+		s.b_present = size;
+		s.pixels = out;
+		s.pixel_cnt = CHUNK;
+		s.p_limit = CHUNK * channels;
+		s.px.rgba.a = 255;
+		s = fn(s);
+	});
+	if (s.pixel_curr != CHUNK) {
+		ERROR("%s decoded %u of %u pixels", kernel, s.pixel_curr, CHUNK);
+	}
+	print_row(kernel, input, t, CHUNK, count_ops(encoded + QOI_HEADER_SIZE, size - QOI_HEADER_SIZE - sizeof(qoi_padding)));
+}
+
+static void bench_header(const char *kernel, const char *head, int (*fn)(FILE *, qoi_desc *)) {
+	qoi_desc desc;
+	uint64_t t;
+	FILE *fi = fmemopen((void *)head, strlen(head), "rb");
+	if (!fi) {
+		ERROR("fmemopen");
+	}
+	KERNEL_TIME(t, {
+		for (int i = 0; i < 1000; ++i) {
+			rewind(fi);
+			if (fn(fi, &desc)) {
+				ERROR("%s rejected its header", kernel);
+			}
+		}
+	});
+	fclose(fi);
+	printf("%-20s %-14s %8s %8.3f %9s  (%.2f ns/byte)\n", kernel, "header", "-", t / 1000.0, "-", t / 1000.0 / strlen(head));
+}
+
+int main(int argc, char **argv) {
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--runs") == 0 && (i+1)<argc) { opt_runs = atoi(argv[++i]); }
+#ifndef QOI_MLUT_EMBED
+		else if (strcmp(argv[i], "--mlut-path") == 0 && (i+1)<argc) {
+			int fd = open(argv[++i], O_RDONLY);
+			if (fd < 0 || (qoi_mlut = mmap(NULL, 256*256*256*5, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+				ERROR("Can't map mlut %s", argv[i]);
+			}
+			close(fd);
+		}
+#endif
+		else {
+			printf("Usage: "EXT_STR"kernel [options]\n");
+			printf("Options\n");
+			printf(" --runs n         number of timed calls per kernel, the fastest is reported, default 50\n");
+#ifndef QOI_MLUT_EMBED
+			printf(" --mlut-path file also measure the mlut kernels\n");
+#endif
+			return 1;
+		}
+	}
+	if (opt_runs <= 0) {
+		ERROR("Invalid number of runs %d", opt_runs);
+	}
+
+	unsigned char *pixels_alloc = calloc(CHUNK * 4 + 128, 1);
+	unsigned char *pixels = pixels_alloc + 64;
+	unsigned char *bytes = malloc(CHUNK * 6 + 64);
+	unsigned char *out = malloc(CHUNK * 4 + 64);
+	char input[32];
+
+	printf("%d pixels per call, fastest of %d calls\n\n", CHUNK, opt_runs);
+	printf("%-20s %-14s %8s %8s %9s\n", "kernel", "input", "ns/px", "ns/op", "mpps");
+
+	// Classification and op writing, no runs
+	for (int cls = 0; cls < INPUT_COUNT; ++cls) {
+		gen_pixels(pixels, CHUNK, 3, cls, 0, 0);
+		bench_encode("enc3 scalar", input_names[cls], qoi_encode_chunk3_scalar, pixels, 3, bytes);
+		if (qoi_mlut)
+			bench_encode("enc3 mlut", input_names[cls], qoi_encode_chunk3_mlut, pixels, 3, bytes);
+#ifdef QOI_SSE
+		bench_encode("enc3 sse", input_names[cls], qoi_encode_chunk3_sse, pixels, 3, bytes);
+#endif
+	}
+	printf("\n");
+
+	// Run handling at increasing run density
+	static const int runs[] = {0, 10, 25, 50, 75, 90, 99, 100};
+	for (int r = 0; r < (int)(sizeof(runs) / sizeof(runs[0])); ++r) {
+		snprintf(input, sizeof(input), "mix run%d%%", runs[r]);
+		gen_pixels(pixels, CHUNK, 3, INPUT_MIX, runs[r], 0);
+		unsigned int encoded = bench_encode("enc3 scalar", input, qoi_encode_chunk3_scalar, pixels, 3, bytes);
+#ifdef QOI_SSE
+		bench_encode("enc3 sse runwriter", input, qoi_encode_chunk3_sse, pixels, 3, bytes);
+#endif
+		bench_size("size3 scalar", input, qoi_size_chunk3_scalar, pixels, encoded);
+#ifdef QOI_SSE
+		bench_size("size3 sse", input, qoi_size_chunk3_sse, pixels, encoded);
+#endif
+	}
+	printf("\n");
+
+	// RGBA, opaque and with alpha changes that force the SSE alpha fallback
+	static const int alphas[] = {0, 1, 10};
+	for (int a = 0; a < (int)(sizeof(alphas) / sizeof(alphas[0])); ++a) {
+		snprintf(input, sizeof(input), "mix alpha%d%%", alphas[a]);
+		gen_pixels(pixels, CHUNK, 4, INPUT_MIX, 25, alphas[a]);
+		unsigned int encoded = bench_encode("enc4 scalar", input, qoi_encode_chunk4_scalar, pixels, 4, bytes);
+		if (qoi_mlut)
+			bench_encode("enc4 mlut", input, qoi_encode_chunk4_mlut, pixels, 4, bytes);
+#ifdef QOI_SSE
+		bench_encode("enc4 sse", input, qoi_encode_chunk4_sse, pixels, 4, bytes);
+#endif
+		bench_size("size4 scalar", input, qoi_size_chunk4_scalar, pixels, encoded);
+#ifdef QOI_SSE
+		bench_size("size4 sse", input, qoi_size_chunk4_sse, pixels, encoded);
+#endif
+		//the same pixels read as BGRA, swizzled in the kernel
+		bench_encode("enc4bgra scalar", input, qoi_encode_chunk4bgra_scalar, pixels, 4, bytes);
+#ifdef QOI_SSE
+		bench_encode("enc4bgra sse", input, qoi_encode_chunk4bgra_sse, pixels, 4, bytes);
+#endif
+		if (alphas[a])
+			continue;
+		//opaque, what qoi_enc_index picks instead
+		bench_encode("enc4o scalar", input, qoi_encode_chunk4o_scalar, pixels, 4, bytes);
+		if (qoi_mlut)
+			bench_encode("enc4o mlut", input, qoi_encode_chunk4o_mlut, pixels, 4, bytes);
+#ifdef QOI_SSE
+		bench_encode("enc4o sse", input, qoi_encode_chunk4o_sse, pixels, 4, bytes);
+#endif
+		bench_encode("enc4bgrx scalar", input, qoi_encode_chunk4bgrx_scalar, pixels, 4, bytes);
+#ifdef QOI_SSE
+		bench_encode("enc4bgrx sse", input, qoi_encode_chunk4bgrx_sse, pixels, 4, bytes);
+#endif
+	}
+	printf("\n");
+
+	// Decoders, on complete streams from qoi_encode
+	options opt = {0};
+	for (int in = 3; in <= 4; ++in) {
+		int size;
+		gen_pixels(pixels, CHUNK, in, INPUT_MIX, 25, 1);
+		void *encoded = qoi_encode(pixels, &(qoi_desc){
+				.width = CHUNK,
+				.height = 1,
+				.channels = in,
+				.colorspace = QOI_SRGB
+			}, &size, &opt);
+		if (!encoded) {
+			ERROR("qoi_encode failed");
+		}
+		snprintf(input, sizeof(input), "mix run25%%");
+		bench_decode(in == 3 ? "dec_in3out3" : "dec_in4out3", input, in == 3 ? dec_in3out3 : dec_in4out3, encoded, size, 3, out);
+		bench_decode(in == 3 ? "dec_in3out4" : "dec_in4out4", input, in == 3 ? dec_in3out4 : dec_in4out4, encoded, size, 4, out);
+		QOI_FREE(encoded);
+	}
+	printf("\n");
+
+	// Header parsers, ns/op is per header
+	bench_header("pam header", "P7\nWIDTH 1920\nHEIGHT 1080\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", qoi_read_pam_header);
+	bench_header("ppm header", "P6 1920 1080 255\n", qoi_read_ppm_header);
+
+	free(pixels_alloc);
+	free(bytes);
+	free(out);
+	return 0;
+}
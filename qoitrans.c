@@ -0,0 +1,151 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+Command line tool to transcode between qoi <> roi without going through a
+full image of pixels
+
+The source format's decoder writes straight into the destination format's
+encoder buffer a CHUNK of pixels at a time, so memory stays bounded whatever
+the image size and each chunk is encoded while it is still in cache. qoi and
+roi are each compiled into their own object by qoiformat.c with prefixed
+names, see the roitrans target.
+
+Compile with:
+	gcc -c -O3 -DQOI -DQOI_SCALAR -DQOI_MALLOC=malloc -DQOI_FREE=free -DFORMAT_PREFIX=qoifmt_ -std=gnu99 qoiformat.c -o qoitrans_qoi.o
+	gcc -c -O3 -DROI -DQOI_SSE -DQOI_MALLOC=malloc -DQOI_FREE=free -DFORMAT_PREFIX=roifmt_ -msse4 -std=gnu99 qoiformat.c -o qoitrans_roi.o
+	gcc -O3 -std=gnu99 qoitrans.c qoitrans_qoi.o qoitrans_roi.o -o roitrans
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qoi.h"
+
+#define FORMAT_DECLARE(p) \
+qoi_enc_stream *p##qoi_enc_stream_open(const qoi_desc *desc, const options *opt, qoi_stream_write write, void *user); \
+unsigned char *p##qoi_enc_stream_buffer(qoi_enc_stream *es, unsigned int *count); \
+int p##qoi_enc_stream_commit(qoi_enc_stream *es, unsigned int count); \
+int p##qoi_enc_stream_close(qoi_enc_stream *es); \
+qoi_dec_stream *p##qoi_dec_stream_open(qoi_desc *desc, int channels, qoi_stream_read read, void *user); \
+unsigned int p##qoi_dec_stream_read(qoi_dec_stream *ds, void *pixels, unsigned int count); \
+int p##qoi_dec_stream_close(qoi_dec_stream *ds);
+
+FORMAT_DECLARE(qoifmt_)
+FORMAT_DECLARE(roifmt_)
+
+#define FORMAT_ENTRY(ext, p) { ext, \
+	p##qoi_enc_stream_open, p##qoi_enc_stream_buffer, p##qoi_enc_stream_commit, p##qoi_enc_stream_close, \
+	p##qoi_dec_stream_open, p##qoi_dec_stream_read, p##qoi_dec_stream_close }
+
+typedef struct {
+	const char *ext;
+	qoi_enc_stream *(*enc_open)(const qoi_desc *desc, const options *opt, qoi_stream_write write, void *user);
+	unsigned char *(*enc_buffer)(qoi_enc_stream *es, unsigned int *count);
+	int (*enc_commit)(qoi_enc_stream *es, unsigned int count);
+	int (*enc_close)(qoi_enc_stream *es);
+	qoi_dec_stream *(*dec_open)(qoi_desc *desc, int channels, qoi_stream_read read, void *user);
+	unsigned int (*dec_read)(qoi_dec_stream *ds, void *pixels, unsigned int count);
+	int (*dec_close)(qoi_dec_stream *ds);
+} trans_format;
+
+static const trans_format formats[]={
+	FORMAT_ENTRY(".qoi", qoifmt_),
+	FORMAT_ENTRY(".roi", roifmt_)
+};
+#define FORMAT_COUNT (int)(sizeof(formats)/sizeof(formats[0]))
+
+static unsigned int file_read(void *user, void *buf, unsigned int len) {
+	return fread(buf, 1, len, (FILE *)user);
+}
+
+static unsigned int file_write(void *user, const void *buf, unsigned int len) {
+	return fwrite(buf, 1, len, (FILE *)user);
+}
+
+static int format_of(const char *path) {
+	for(int i=0;i<FORMAT_COUNT;++i){
+		size_t n=strlen(formats[i].ext);
+		if(strlen(path)>=n && 0==strcmp(path+strlen(path)-n, formats[i].ext))
+			return i;
+	}
+	return -1;
+}
+
+static int transcode(const trans_format *src, const trans_format *dst, FILE *fi, FILE *fo) {
+	options opt={0};
+	qoi_desc desc;
+	qoi_dec_stream *ds;
+	qoi_enc_stream *es;
+	unsigned char *px;
+	unsigned int count, got;
+	int err=0;
+
+	if(!(ds=src->dec_open(&desc, 0, file_read, fi)))
+		return fprintf(stderr, "Couldn't read %s header\n", src->ext);
+	if(!(es=dst->enc_open(&desc, &opt, file_write, fo))){
+		src->dec_close(ds);
+		return fprintf(stderr, "Couldn't write %s header\n", dst->ext);
+	}
+	while((px=dst->enc_buffer(es, &count))){
+		if(!(got=src->dec_read(ds, px, count)))
+			break;
+		if((err=dst->enc_commit(es, got)))
+			break;
+	}
+	if(src->dec_close(ds)){
+		dst->enc_close(es);
+		return fprintf(stderr, "Truncated or invalid %s input\n", src->ext);
+	}
+	if(dst->enc_close(es) || err)
+		return fprintf(stderr, "Couldn't write %s output\n", dst->ext);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int src, dst, ret;
+	FILE *fi, *fo;
+
+	if (argc < 3) {
+		puts("Usage: roitrans <infile> <outfile>");
+		puts("Either file may be - for stdin/stdout when the other names the format");
+		puts("Examples:");
+		puts("  roitrans input.qoi output.roi");
+		puts("  roitrans input.roi output.qoi");
+		exit(1);
+	}
+
+	src=format_of(argv[argc-2]);
+	dst=format_of(argv[argc-1]);
+	if(src==-1 && dst!=-1 && 0==strcmp(argv[argc-2], "-"))
+		src=dst^1;
+	if(dst==-1 && src!=-1 && 0==strcmp(argv[argc-1], "-"))
+		dst=src^1;
+	if(src==-1 || dst==-1)
+		return fprintf(stderr, "Unknown format for '%s' or '%s'\n", argv[argc-2], argv[argc-1]);
+	if(src==dst)
+		return fprintf(stderr, "Input and output are both %s\n", formats[src].ext);
+
+	if(0==strcmp(argv[argc-2], "-"))
+		fi=stdin;
+	else if(!(fi=fopen(argv[argc-2], "rb")))
+		return fprintf(stderr, "Couldn't open %s\n", argv[argc-2]);
+	if(0==strcmp(argv[argc-1], "-"))
+		fo=stdout;
+	else if(!(fo=fopen(argv[argc-1], "wb"))){
+		if(fi!=stdin)
+			fclose(fi);
+		return fprintf(stderr, "Couldn't open %s\n", argv[argc-1]);
+	}
+
+	ret=transcode(formats+src, formats+dst, fi, fo);
+
+	if(fi!=stdin)
+		fclose(fi);
+	if(fo!=stdout && fclose(fo))
+		ret=ret?ret:fprintf(stderr, "Couldn't write %s\n", argv[argc-1]);
+	return ret;
+}
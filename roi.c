@@ -31,6 +31,14 @@ QOI_OP_RUN: xxxxx111
 	1 byte op defining a run of repeating pixels, x=0..29 indicates runs of 1..30
 	respectively. x=30 and x=31 is reserved for use by QOI_OP_RGB and QOI_OP_RGBA
 
+	In a stream with QOI_FLAG_LONG_RUN in its header x=29 (QOI_OP_RUN_FULL) is
+	followed by a varint of 1..5 bytes, the run is 30 plus its value
+
+	In a stream with QOI_FLAG_RAW_BLOCKS in its header x=28 (QOI_OP_RAW) is
+	followed by a varint count of pixels and then the pixels themselves, 3 or 4
+	bytes each as the header's channels, the last one is the previous pixel
+	after it. Runs of 29 are written as a run of 28 and a run of 1
+
 QOI_OP_LUMA232: bbrrggg0
   1 byte op that stores vg_r and vg_b in 2 bits, vg in 3 bits
 
@@ -63,6 +71,7 @@ This allows for optimisations on little-endian hardware, most hardware.
 
 #define QOI_OP_RUN_FULL 0xef /* 11101111 */
 #define QOI_RUN_FULL_VAL (30)
+#define QOI_OP_RAW     0xe7 /* 11100111 */
 
 #define QOI_MASK_1     0x01 /* 00000001 */
 #define QOI_MASK_2     0x03 /* 00000011 */
@@ -75,16 +84,44 @@ This allows for optimisations on little-endian hardware, most hardware.
 #define EXT_STR "roi"
 
 #define QOI_PIXEL_WORST_CASE (desc->channels==4?6:4)
+#define QOI_PIXEL_WORST_CASE_OPAQUE 4
+
+#ifdef QOI_STATS
+//QOI_STATS op indexes, the RGB ops are ordered by encoded length
+enum {QOI_STAT_LUMA232, QOI_STAT_LUMA464, QOI_STAT_LUMA777, QOI_STAT_RGB, QOI_STAT_RGBA, QOI_STAT_RUN, QOI_STAT_RUN_FULL, QOI_STAT_RAW};
+const char *const qoi_stats_op_names[QOI_STATS_OPS]={"LUMA232", "LUMA464", "LUMA777", "RGB", "RGBA", "RUN", "RUN_FULL", "RAW"};
+#endif
+
+//a long run is carried whole until it ends, see DUMP_RUN_LONG
+#define DUMP_RUN_FULL(rrr) do{ \
+	if(!(s.flags&QOI_FLAG_LONG_RUN)){ \
+		for(;rrr>=QOI_RUN_FULL_VAL;rrr-=QOI_RUN_FULL_VAL){ \
+			s.bytes[s.b++] = QOI_OP_RUN_FULL; \
+			QOI_STAT_RUN_OP(qoi_stats_enc, QOI_RUN_FULL_VAL); \
+		} \
+	} \
+}while(0)
 
+//with QOI_FLAG_RAW_BLOCKS the op of a run of 29 is QOI_OP_RAW
 #define DUMP_RUN(rrr) do{ \
-	for(;rrr>=QOI_RUN_FULL_VAL;rrr-=QOI_RUN_FULL_VAL) \
-		s.bytes[s.b++] = QOI_OP_RUN_FULL; \
+	QOI_STAT_RUN(qoi_stats_enc, rrr); \
+	if (rrr>=QOI_RUN_FULL_VAL) \
+		DUMP_RUN_LONG(rrr); \
 	if (rrr) { \
+		if (rrr==QOI_RUN_FULL_VAL-1 && (s.flags&QOI_FLAG_RAW_BLOCKS)) { \
+			s.bytes[s.b++] = QOI_OP_RUN | ((rrr - 2)<<3); \
+			QOI_STAT_RUN_OP(qoi_stats_enc, rrr - 1); \
+			rrr = 1; \
+		} \
 		s.bytes[s.b++] = QOI_OP_RUN | ((rrr - 1)<<3); \
+		QOI_STAT_RUN_OP(qoi_stats_enc, rrr); \
 		rrr = 0; \
 	} \
 }while(0)
 
+//there is no index to put the last pixel of a QOI_OP_RAW in
+#define QOI_RAW_INDEX(index, px) do{ (void)(px); }while(0)
+
 //	px.rgba.r = pixels[px_pos + 0];
 //	px.rgba.g = pixels[px_pos + 1];
 //	px.rgba.b = pixels[px_pos + 2];
@@ -107,23 +144,31 @@ This allows for optimisations on little-endian hardware, most hardware.
 	unsigned char arb = ar|ab;\
 	if ( arb < 2 && ag  < 4 ) {\
 		s.bytes[s.b++]=QOI_OP_LUMA232|((vg_b+2)<<6)|((vg_r+2)<<4)|((vg+4)<<1);\
+		QOI_STAT_OP(qoi_stats_enc, QOI_STAT_LUMA232, 1); \
 	} else if ( arb <  8 && ag  < 32 ) {\
 		*(unsigned int*)(s.bytes+s.b)=QOI_OP_LUMA464|((vg_b+8)<<12)|((vg_r+8)<<8)|((vg+32)<<2); \
 		s.b+=2; \
+		QOI_STAT_OP(qoi_stats_enc, QOI_STAT_LUMA464, 2); \
 	} else if ( (arb|ag) < 64 ) {\
 		*(unsigned int*)(s.bytes+s.b)=QOI_OP_LUMA777|((vg_b+64)<<17)|((vg_r+64)<<10)|((vg+64)<<3); \
 		s.b+=3; \
+		QOI_STAT_OP(qoi_stats_enc, QOI_STAT_LUMA777, 3); \
 	} else {\
 		s.bytes[s.b++]=QOI_OP_RGB; \
 		s.bytes[s.b++]=vg; \
 		s.bytes[s.b++]=vg_r; \
 		s.bytes[s.b++]=vg_b; \
+		QOI_STAT_OP(qoi_stats_enc, QOI_STAT_RGB, 4); \
 	}\
 }while(0)
 
-typedef struct{
+//bulk and finish are the kernel rows picked by qoi_kernel_select, indexed by
+//QOI_ENC_*. They live here rather than in globals so concurrent encodes with
+//different options don't race
+typedef struct enc_state{
 	unsigned char *bytes, *pixels, *pixels_alloc;
-	unsigned int b, px_pos, run, pixel_cnt;
+	struct enc_state (*const *bulk)(struct enc_state), (*const *finish)(struct enc_state);
+	unsigned int b, px_pos, run, pixel_cnt, flags;
 } enc_state;
 
 int gen_mlut(const char *path){
@@ -198,8 +243,7 @@ static enc_state qoi_encode_chunk3_mlut(enc_state s){
 		while(px.v == px_prev.v) {
 			++s.run;
 			if(s.px_pos == px_end){
-				for(;s.run>=QOI_RUN_FULL_VAL;s.run-=QOI_RUN_FULL_VAL)
-					s.bytes[s.b++] = QOI_OP_RUN_FULL;
+				DUMP_RUN_FULL(s.run);
 				s.px_pos+=3;
 				return s;
 			}
@@ -212,43 +256,54 @@ static enc_state qoi_encode_chunk3_mlut(enc_state s){
 		diff.rgba.b=px.rgba.b-px_prev.rgba.b;
 		*(unsigned int*)(s.bytes+s.b)=*(unsigned int*)(qoi_mlut+(diff.v*5)+1);
 		s.b+=qoi_mlut[diff.v*5];
+		QOI_STAT_OP(qoi_stats_enc, qoi_mlut[diff.v*5]-1, qoi_mlut[diff.v*5]);
 		px_prev = px;
 	}
 	return s;
 }
 
-static enc_state qoi_encode_chunk4_mlut(enc_state s){
-	qoi_rgba_t px, px_prev, diff={0};
-	unsigned int px_end=(s.pixel_cnt-1)*4;
-	memcpy(&px_prev, s.pixels+s.px_pos-4, 4);
-	for (; s.px_pos <= px_end; s.px_pos += 4) {
-		ENC_READ_RGBA;
-		while(px.v == px_prev.v) {
-			++s.run;
-			if(s.px_pos == px_end) {
-				for(;s.run>=QOI_RUN_FULL_VAL;s.run-=QOI_RUN_FULL_VAL)
-					s.bytes[s.b++] = QOI_OP_RUN_FULL;
-				s.px_pos+=4;
-				return s;
-			}
-			s.px_pos+=4;
-			ENC_READ_RGBA;
-		}
-		DUMP_RUN(s.run);
-		if(px.rgba.a!=px_prev.rgba.a){
-			s.bytes[s.b++] = QOI_OP_RGBA;
-			s.bytes[s.b++] = px.rgba.a;
-		}
-		diff.rgba.r=px.rgba.r-px_prev.rgba.r;
-		diff.rgba.g=px.rgba.g-px_prev.rgba.g;
-		diff.rgba.b=px.rgba.b-px_prev.rgba.b;
-		*(unsigned int*)(s.bytes+s.b)=*(unsigned int*)(qoi_mlut+(diff.v*5)+1);
-		s.b+=qoi_mlut[diff.v*5];
-		px_prev = px;
-	}
-	return s;
+//the 4 byte per pixel kernels: LOAD reads a pixel in RGBA order and ALPHA is 0
+//for the kernels that only see opaque pixels (previous pixel included), which
+//are then the 3 channel kernels at a stride of 4. BGRX is loaded as opaque
+#define ENC_CHUNK4_MLUT(name, LOAD, ALPHA) \
+static enc_state name(enc_state s){ \
+	qoi_rgba_t px, px_prev, diff={0}; \
+	unsigned int px_end=(s.pixel_cnt-1)*4; \
+	LOAD(px_prev, s.pixels+s.px_pos-4); \
+	for (; s.px_pos <= px_end; s.px_pos += 4) { \
+		LOAD(px, s.pixels+s.px_pos); \
+		while(px.v == px_prev.v) { \
+			++s.run; \
+			if(s.px_pos == px_end) { \
+				DUMP_RUN_FULL(s.run); \
+				s.px_pos+=4; \
+				return s; \
+			} \
+			s.px_pos+=4; \
+			LOAD(px, s.pixels+s.px_pos); \
+		} \
+		DUMP_RUN(s.run); \
+		if(ALPHA && px.rgba.a!=px_prev.rgba.a){ \
+			s.bytes[s.b++] = QOI_OP_RGBA; \
+			s.bytes[s.b++] = px.rgba.a; \
+			QOI_STAT_OP(qoi_stats_enc, QOI_STAT_RGBA, 2); \
+		} \
+		diff.rgba.r=px.rgba.r-px_prev.rgba.r; \
+		diff.rgba.g=px.rgba.g-px_prev.rgba.g; \
+		diff.rgba.b=px.rgba.b-px_prev.rgba.b; \
+		*(unsigned int*)(s.bytes+s.b)=*(unsigned int*)(qoi_mlut+(diff.v*5)+1); \
+		s.b+=qoi_mlut[diff.v*5]; \
+		QOI_STAT_OP(qoi_stats_enc, qoi_mlut[diff.v*5]-1, qoi_mlut[diff.v*5]); \
+		px_prev = px; \
+	} \
+	return s; \
 }
 
+ENC_CHUNK4_MLUT(qoi_encode_chunk4_mlut, QOI_LOAD_RGBA, 1)
+ENC_CHUNK4_MLUT(qoi_encode_chunk4o_mlut, QOI_LOAD_RGBA, 0)
+ENC_CHUNK4_MLUT(qoi_encode_chunk4bgra_mlut, QOI_LOAD_BGRA, 1)
+ENC_CHUNK4_MLUT(qoi_encode_chunk4bgrx_mlut, QOI_LOAD_BGRX, 0)
+
 static enc_state qoi_encode_chunk3_scalar(enc_state s){
 	qoi_rgba_t px, px_prev={0};
 	unsigned int px_end=(s.pixel_cnt-1)*3;
@@ -259,8 +314,7 @@ static enc_state qoi_encode_chunk3_scalar(enc_state s){
 		while(px.v == px_prev.v) {
 			++s.run;
 			if(s.px_pos == px_end){
-				for(;s.run>=QOI_RUN_FULL_VAL;s.run-=QOI_RUN_FULL_VAL)
-					s.bytes[s.b++] = QOI_OP_RUN_FULL;
+				DUMP_RUN_FULL(s.run);
 				s.px_pos+=3;
 				return s;
 			}
@@ -274,35 +328,87 @@ static enc_state qoi_encode_chunk3_scalar(enc_state s){
 	return s;
 }
 
-static enc_state qoi_encode_chunk4_scalar(enc_state s){
-	qoi_rgba_t px, px_prev;
-	unsigned int px_end=(s.pixel_cnt-1)*4;
-	memcpy(&px_prev, s.pixels+s.px_pos-4, 4);
-	for (; s.px_pos <= px_end; s.px_pos += 4) {
-		ENC_READ_RGBA;
-		while(px.v == px_prev.v) {
+#define ENC_CHUNK4_SCALAR(name, LOAD, ALPHA) \
+static enc_state name(enc_state s){ \
+	qoi_rgba_t px, px_prev; \
+	unsigned int px_end=(s.pixel_cnt-1)*4; \
+	LOAD(px_prev, s.pixels+s.px_pos-4); \
+	for (; s.px_pos <= px_end; s.px_pos += 4) { \
+		LOAD(px, s.pixels+s.px_pos); \
+		while(px.v == px_prev.v) { \
+			++s.run; \
+			if(s.px_pos == px_end) { \
+				DUMP_RUN_FULL(s.run); \
+				s.px_pos+=4; \
+				return s; \
+			} \
+			s.px_pos+=4; \
+			LOAD(px, s.pixels+s.px_pos); \
+		} \
+		DUMP_RUN(s.run); \
+		if(ALPHA && px.rgba.a!=px_prev.rgba.a){ \
+			s.bytes[s.b++] = QOI_OP_RGBA; \
+			s.bytes[s.b++] = px.rgba.a; \
+			QOI_STAT_OP(qoi_stats_enc, QOI_STAT_RGBA, 2); \
+		} \
+		RGB_ENC_SCALAR; \
+		px_prev = px; \
+	} \
+	return s; \
+}
+
+ENC_CHUNK4_SCALAR(qoi_encode_chunk4_scalar, QOI_LOAD_RGBA, 1)
+ENC_CHUNK4_SCALAR(qoi_encode_chunk4o_scalar, QOI_LOAD_RGBA, 0)
+ENC_CHUNK4_SCALAR(qoi_encode_chunk4bgra_scalar, QOI_LOAD_BGRA, 1)
+ENC_CHUNK4_SCALAR(qoi_encode_chunk4bgrx_scalar, QOI_LOAD_BGRX, 0)
+
+//size kernels for qoi_estimate_size: s.b advances by the bytes the encode
+//kernels would write, s.bytes is not touched. Pixels are read a byte at a time
+//so the 3 channel kernel stays inside const input
+static inline enc_state qoi_size_chunk_scalar(enc_state s, const unsigned int channels){
+	qoi_rgba_t px={0}, px_prev={0};
+	unsigned int px_end=s.pixel_cnt*channels;
+	const unsigned char *p=s.pixels+s.px_pos-channels;
+	px_prev.rgba.r=p[0];
+	px_prev.rgba.g=p[1];
+	px_prev.rgba.b=p[2];
+	px_prev.rgba.a=channels==4?p[3]:255;
+	px.rgba.a=255;
+	for (; s.px_pos < px_end; s.px_pos += channels) {
+		p=s.pixels+s.px_pos;
+		px.rgba.r=p[0];
+		px.rgba.g=p[1];
+		px.rgba.b=p[2];
+		if(channels==4)
+			px.rgba.a=p[3];
+		if(px.v == px_prev.v) {
 			++s.run;
-			if(s.px_pos == px_end) {
-				for(;s.run>=QOI_RUN_FULL_VAL;s.run-=QOI_RUN_FULL_VAL)
-					s.bytes[s.b++] = QOI_OP_RUN_FULL;
-				s.px_pos+=4;
-				return s;
-			}
-			s.px_pos+=4;
-			ENC_READ_RGBA;
-		}
-		DUMP_RUN(s.run);
-		if(px.rgba.a!=px_prev.rgba.a){
-			s.bytes[s.b++] = QOI_OP_RGBA;
-			s.bytes[s.b++] = px.rgba.a;
+			continue;
 		}
-		RGB_ENC_SCALAR;
+		SIZE_RUN(s.run);
+		signed char vg = px.rgba.g - px_prev.rgba.g;
+		signed char vg_r = (signed char)(px.rgba.r - px_prev.rgba.r) - vg;
+		signed char vg_b = (signed char)(px.rgba.b - px_prev.rgba.b) - vg;
+		unsigned char ag = (vg<0)?(-vg)-1:vg;
+		unsigned char arb = ((vg_r<0)?(-vg_r)-1:vg_r) | ((vg_b<0)?(-vg_b)-1:vg_b);
+		s.b += ( arb < 2 && ag < 4 ) ? 1 : ( arb < 8 && ag < 32 ) ? 2 : ( (arb|ag) < 64 ) ? 3 : 4;
+		if(px.rgba.a!=px_prev.rgba.a)
+			s.b += 2;
 		px_prev = px;
 	}
 	return s;
 }
 
-static enc_state (*enc_finish[])(enc_state)={qoi_encode_chunk3_scalar, qoi_encode_chunk4_scalar};
+static enc_state qoi_size_chunk3_scalar(enc_state s){
+	return qoi_size_chunk_scalar(s, 3);
+}
+
+static enc_state qoi_size_chunk4_scalar(enc_state s){
+	return qoi_size_chunk_scalar(s, 4);
+}
+
+//indexed by channels-3
+static enc_state (*const size_finish[2])(enc_state)={qoi_size_chunk3_scalar, qoi_size_chunk4_scalar};
 
 #ifdef QOI_SSE
 //load the next 16 bytes, diff pixels
@@ -557,11 +663,34 @@ static const uint8_t sse_runwriter_shuffle_lut[10256] = {0,0,0,0,0,0,0,0,0,0, 0,
 	8,9,12,0,0,0,0,0,0,0,0,0,0,0,1,2,4,8,9,12,0,0,0,0,0,0,0,0,0,0,1,2,3,4,8,9,12, 0,0,0,0,0,0,0,0,8,9,12,13,14,0,0,0,0,0,0,0,0,0,0,0,0,4,8,9,12,13,14,0,0,0,0,0,0,
 	0,0,0,0,1,4,8,9,12,13,14,0,0,0,0,0,0,0,0,0,1,2,4,8,9,12,13,14,0,0,0,0,0,0,0, 0,1,2,3,4,8,9,12,13,14,0,0,0,0,0,0,};
 
+#ifdef QOI_STATS
+//ops classified per pixel by SSE_COMMON, 0=run 1..4=RGB op of that length
+#define QOI_STAT_SSE_OPS(ops) do{ \
+	for(int st_i=0;st_i<16;++st_i){ \
+		unsigned char st_op=((unsigned char*)(ops))[st_i]; \
+		if(st_op) \
+			QOI_STAT_OP(qoi_stats_enc, st_op-1, st_op); \
+	} \
+}while(0)
+
+//mid-vec runs are blended in directly rather than going through DUMP_RUN
+#define QOI_STAT_SSE_MID(mid) do{ \
+	if(mid){ \
+		QOI_STAT_RUN_OP(qoi_stats_enc, (mid)==32?2:1); \
+		QOI_STAT_RUN(qoi_stats_enc, (mid)==32?2:1); \
+	} \
+}while(0)
+#else
+#define QOI_STAT_SSE_OPS(ops)
+#define QOI_STAT_SSE_MID(mid)
+#endif
+
 #define QOI_SSE_RUNWRITER(vec, lookup) do{ \
 	/*blend mid-vec run into output if present*/ \
 	w1=_mm_loadu_si128((__m128i const*)(sse_runwriter_blenddata_lut+sse_runwriter_mid_lut[lookup])); \
 	w2=_mm_loadu_si128((__m128i const*)(sse_runwriter_blendmask_lut+sse_runwriter_mid_lut[lookup])); \
 	vec=_mm_blendv_epi8(vec, w1, w2); \
+	QOI_STAT_SSE_MID(sse_runwriter_mid_lut[lookup]); \
 	/*push used bytes to left*/ \
 	w1=_mm_loadu_si128((__m128i const*)(sse_runwriter_shuffle_lut + (lookup<<4))); \
 	vec=_mm_shuffle_epi8(vec, w1); \
@@ -575,8 +704,9 @@ static const uint8_t sse_runwriter_shuffle_lut[10256] = {0,0,0,0,0,0,0,0,0,0, 0,
 	s.run=sse_runwriter_post_lut[lookup]; \
 }while(0)
 
-//Process the pixels in r,g,b and write them out
-#define SSE_COMMON do{ \
+//Classify the pixels in r,g,b: op1 is set for 1 byte ops, op2 for 1 or 2 and
+//op3 for 1, 2 or 3 byte ops. r,g,b are left as vg_r, vg, vg_b
+#define SSE_CLASSIFY do{ \
 	/*convert vr, vb to vg_r, vg_b respectively*/ \
 	r=_mm_sub_epi8(r, g); \
 	b=_mm_sub_epi8(b, g); \
@@ -597,6 +727,11 @@ static const uint8_t sse_runwriter_shuffle_lut[10256] = {0,0,0,0,0,0,0,0,0,0, 0,
 	op2=_mm_or_si128(op2, arb); \
 	op2=_mm_cmpgt_epi8(_mm_set1_epi8(8), op2);/*op1|op2*/ \
 	op3=_mm_cmpgt_epi8(_mm_set1_epi8(64), _mm_or_si128(arb, ag));/*op1|op2|op3*/ \
+}while(0)
+
+//Process the pixels in r,g,b and write them out
+#define SSE_COMMON do{ \
+	SSE_CLASSIFY; \
 	op4=_mm_andnot_si128(op3, _mm_set1_epi8(-1));/*op4*/ \
 	op3=_mm_sub_epi8(op3, op2);/*op3*/ \
 	op2=_mm_sub_epi8(op2, op1);/*op2*/ \
@@ -676,6 +811,7 @@ static const uint8_t sse_runwriter_shuffle_lut[10256] = {0,0,0,0,0,0,0,0,0,0, 0,
 	opuse=_mm_or_si128(opuse, _mm_and_si128(op4, _mm_set1_epi8(4))); \
 	opuse=_mm_blendv_epi8(opuse, _mm_set1_epi8(0), w1); \
 	_mm_storeu_si128((__m128i*)op_index, opuse); \
+	QOI_STAT_SSE_OPS(op_index); \
 	/*write each output vec*/ \
 	if(!op_index[0]) \
 		s.run+=4; \
@@ -720,15 +856,21 @@ static const uint8_t sse_runwriter_shuffle_lut[10256] = {0,0,0,0,0,0,0,0,0,0, 0,
 
 */
 
-static enc_state qoi_encode_chunk4_sse(enc_state s){
+//de-interleave shuffles for the 4 byte kernels, shuf1 gives r4g4b4a4 and shuf2
+//g4r4a4b4. BGRA input only swaps where r and b are picked from
+#define SSE_SHUF1_RGBA _mm_setr_epi8(0,4,8,12,1,5,9,13,2,6,10,14,3,7,11,15)
+#define SSE_SHUF2_RGBA _mm_setr_epi8(1,5,9,13,0,4,8,12,3,7,11,15,2,6,10,14)
+#define SSE_SHUF1_BGRA _mm_setr_epi8(2,6,10,14,1,5,9,13,0,4,8,12,3,7,11,15)
+#define SSE_SHUF2_BGRA _mm_setr_epi8(1,5,9,13,2,6,10,14,3,7,11,15,0,4,8,12)
+
+//finish is the s.finish entry for the same input, used on alpha changes
+static inline enc_state qoi_encode_chunk4_sse_shuf(enc_state s, const __m128i shuf1, const __m128i shuf2, const int finish){
 	__m128i da, db, dc, dd, r, g, b, a, ar, ag, ab, arb, w1, w2, w3, w4, w5, w6;
-	__m128i gshuf, shuf1, shuf2, blend;
+	__m128i gshuf, blend;
 	__m128i op1, op2, op3, op4, opuse, res0, res1, res2, res3;
 	unsigned int op_index[4];
 
 	//constants
-	shuf1=_mm_setr_epi8(0,4,8,12,1,5,9,13,2,6,10,14,3,7,11,15);
-	shuf2=_mm_setr_epi8(1,5,9,13,0,4,8,12,3,7,11,15,2,6,10,14);
 	gshuf=_mm_setr_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
 	blend=_mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1);
 
@@ -747,11 +889,13 @@ static enc_state qoi_encode_chunk4_sse(enc_state s){
 		w5=_mm_unpackhi_epi32(w1, w2);//b8a8
 		w6=_mm_unpackhi_epi32(w3, w4);//a8b8
 		a=_mm_blendv_epi8(w6, w5, blend);//out of order, irrelevant
+		QOI_STAT_INC(qoi_stats_enc.sse_blocks);
 		if(!_mm_test_all_zeros(a, _mm_set1_epi8(-1))){//alpha present, scalar this iteration
+			QOI_STAT_INC(qoi_stats_enc.sse_alpha_fallback);
 			//TODO ditch this scalar code, make a parallel alpha op vector and zip together with rgb vector
 			unsigned int pixel_cnt_store=s.pixel_cnt;
 			s.pixel_cnt=(s.px_pos/4)+16;
-			s=enc_finish[1](s);
+			s=s.finish[finish](s);
 			s.px_pos-=64;
 			s.pixel_cnt=pixel_cnt_store;
 			continue;
@@ -769,6 +913,61 @@ static enc_state qoi_encode_chunk4_sse(enc_state s){
 	return s;
 }
 
+//qoi_encode_chunk4_sse_shuf without the alpha test and its scalar fallback, the
+//alpha (or X) bytes are never looked at
+static inline enc_state qoi_encode_chunk4o_sse_shuf(enc_state s, const __m128i shuf1, const __m128i shuf2){
+	__m128i da, db, dc, dd, r, g, b, ar, ag, ab, arb, w1, w2, w3, w4, w5, w6;
+	__m128i gshuf, blend;
+	__m128i op1, op2, op3, op4, opuse, res0, res1, res2, res3;
+	unsigned int op_index[4];
+
+	//constants
+	gshuf=_mm_setr_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+	blend=_mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1);
+
+	for (; s.px_pos < s.pixel_cnt*4; s.px_pos += 64) {
+		//load pixels
+		LOAD16(da,  0, 4);
+		LOAD16(db, 16, 4);
+		LOAD16(dc, 32, 4);
+		LOAD16(dd, 48, 4);
+		QOI_STAT_INC(qoi_stats_enc.sse_blocks);
+
+		//unpack into rgb vectors, alpha is left out
+		w1=_mm_shuffle_epi8(da, shuf1);//r4g4b4a4
+		w2=_mm_shuffle_epi8(db, shuf1);//r4g4b4a4
+		w3=_mm_shuffle_epi8(dc, shuf2);//g4r4a4b4
+		w4=_mm_shuffle_epi8(dd, shuf2);//g4r4a4b4
+		w5=_mm_unpackhi_epi32(w1, w2);//b8a8
+		w6=_mm_unpackhi_epi32(w3, w4);//a8b8
+		b=_mm_blendv_epi8(w5, w6, blend);
+		w1=_mm_unpacklo_epi32(w1, w2);//r8g8
+		w2=_mm_unpacklo_epi32(w3, w4);//g8r8
+		r=_mm_blendv_epi8(w1, w2, blend);
+		g=_mm_blendv_epi8(w2, w1, blend);//out of order
+		g=_mm_shuffle_epi8(g, gshuf);//in order
+
+		SSE_COMMON;
+	}
+	return s;
+}
+
+static enc_state qoi_encode_chunk4_sse(enc_state s){
+	return qoi_encode_chunk4_sse_shuf(s, SSE_SHUF1_RGBA, SSE_SHUF2_RGBA, QOI_ENC_RGBA);
+}
+
+static enc_state qoi_encode_chunk4o_sse(enc_state s){
+	return qoi_encode_chunk4o_sse_shuf(s, SSE_SHUF1_RGBA, SSE_SHUF2_RGBA);
+}
+
+static enc_state qoi_encode_chunk4bgra_sse(enc_state s){
+	return qoi_encode_chunk4_sse_shuf(s, SSE_SHUF1_BGRA, SSE_SHUF2_BGRA, QOI_ENC_BGRA);
+}
+
+static enc_state qoi_encode_chunk4bgrx_sse(enc_state s){
+	return qoi_encode_chunk4o_sse_shuf(s, SSE_SHUF1_BGRA, SSE_SHUF2_BGRA);
+}
+
 static enc_state qoi_encode_chunk3_sse(enc_state s){
 	__m128i da, db, dc, r, g, b, ar, ag, ab, arb, w1, w2, w3;
 	__m128i rshuf, gshuf, bshuf, blend1, blend2;
@@ -787,6 +986,7 @@ static enc_state qoi_encode_chunk3_sse(enc_state s){
 		LOAD16(da, 0, 3);
 		LOAD16(db, 16, 3);
 		LOAD16(dc, 32, 3);
+		QOI_STAT_INC(qoi_stats_enc.sse_blocks);
 
 		/*convert to rgb vectors*/
 		SHUFFLE16(r, da, db, dc, rshuf);
@@ -797,28 +997,170 @@ static enc_state qoi_encode_chunk3_sse(enc_state s){
 	}
 	return s;
 }
+
+//SSE_CLASSIFY without the packing and writing: the op lengths of 16 pixels are
+//summed into sum, runs come from the run mask. Only the runs touching either
+//end of the 16 pixels can reach 30, each run inside them is one byte
+#define SSE_SIZE(amask) do{ \
+	SSE_CLASSIFY; \
+	/*4 bytes less one for each op class the pixel fits*/ \
+	w1=_mm_add_epi8(_mm_set1_epi8(4), _mm_add_epi8(op1, _mm_add_epi8(op2, op3))); \
+	w1=_mm_add_epi8(w1, _mm_andnot_si128(amask, _mm_set1_epi8(2))); \
+	w2=_mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(r, _mm_or_si128(g, b)), _mm_setzero_si128()), amask); \
+	w1=_mm_andnot_si128(w2, w1); \
+	sum=_mm_add_epi64(sum, _mm_sad_epu8(w1, _mm_setzero_si128())); \
+	run_mask=_mm_movemask_epi8(w2); \
+	if(run_mask==0xffff) \
+		s.run+=16; \
+	else if(!run_mask) \
+		SIZE_RUN(s.run); \
+	else{ \
+		s.run+=__builtin_ctz(~run_mask); \
+		SIZE_RUN(s.run); \
+		s.b+=__builtin_popcount(run_mask&~(run_mask<<1))-(run_mask&1)-(run_mask>>15); \
+		s.run=__builtin_clz(~run_mask&0xffff)-16; \
+	} \
+}while(0)
+
+static enc_state qoi_size_chunk3_sse(enc_state s){
+	__m128i da, db, dc, r, g, b, ar, ag, ab, arb, w1, w2;
+	__m128i rshuf, gshuf, bshuf, blend1, blend2;
+	__m128i op1, op2, op3, sum=_mm_setzero_si128();
+	unsigned int run_mask;
+
+	//constants
+	rshuf=_mm_setr_epi8(0,3,6,9,12,15, 2,5,8,11,14, 1,4,7,10,13);
+	gshuf=_mm_setr_epi8(1,4,7,10,13, 0,3,6,9,12,15, 2,5,8,11,14);
+	bshuf=_mm_setr_epi8(2,5,8,11,14, 1,4,7,10,13, 0,3,6,9,12,15);
+	blend1=_mm_setr_epi8(0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0);
+	blend2=_mm_setr_epi8(0,-1,0,0,-1,0,0,-1,0,0,-1,0,0,-1,0,0);
+
+	for (; s.px_pos < s.pixel_cnt*3; s.px_pos += 48) {
+		LOAD16(da, 0, 3);
+		LOAD16(db, 16, 3);
+		LOAD16(dc, 32, 3);
+		SHUFFLE16(r, da, db, dc, rshuf);
+		SHUFFLE16(g, db, dc, da, gshuf);
+		SHUFFLE16(b, dc, da, db, bshuf);
+		SSE_SIZE(_mm_set1_epi8(-1));
+	}
+	s.b+=_mm_cvtsi128_si32(sum)+_mm_extract_epi32(sum, 2);
+	return s;
+}
+
+static enc_state qoi_size_chunk4_sse(enc_state s){
+	__m128i da, db, dc, dd, r, g, b, a, ar, ag, ab, arb, w1, w2, w3, w4, w5, w6;
+	__m128i shuf1, shuf2, gshuf, blend;
+	__m128i op1, op2, op3, sum=_mm_setzero_si128();
+	unsigned int run_mask;
+
+	//constants
+	shuf1=SSE_SHUF1_RGBA;
+	shuf2=SSE_SHUF2_RGBA;
+	gshuf=_mm_setr_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+	blend=_mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1);
+
+	for (; s.px_pos < s.pixel_cnt*4; s.px_pos += 64) {
+		LOAD16(da,  0, 4);
+		LOAD16(db, 16, 4);
+		LOAD16(dc, 32, 4);
+		LOAD16(dd, 48, 4);
+		w1=_mm_shuffle_epi8(da, shuf1);//r4g4b4a4
+		w2=_mm_shuffle_epi8(db, shuf1);//r4g4b4a4
+		w3=_mm_shuffle_epi8(dc, shuf2);//g4r4a4b4
+		w4=_mm_shuffle_epi8(dd, shuf2);//g4r4a4b4
+		w5=_mm_unpackhi_epi32(w1, w2);//b8a8
+		w6=_mm_unpackhi_epi32(w3, w4);//a8b8
+		a=_mm_blendv_epi8(w6, w5, blend);//out of order
+		a=_mm_shuffle_epi8(a, gshuf);//in order
+		a=_mm_cmpeq_epi8(a, _mm_setzero_si128());//alpha unchanged
+		b=_mm_blendv_epi8(w5, w6, blend);
+		w1=_mm_unpacklo_epi32(w1, w2);//r8g8
+		w2=_mm_unpacklo_epi32(w3, w4);//g8r8
+		r=_mm_blendv_epi8(w1, w2, blend);
+		g=_mm_blendv_epi8(w2, w1, blend);//out of order
+		g=_mm_shuffle_epi8(g, gshuf);//in order
+		SSE_SIZE(a);
+	}
+	s.b+=_mm_cvtsi128_si32(sum)+_mm_extract_epi32(sum, 2);
+	return s;
+}
 #endif
 
-//pointers to optimised functions
-static enc_state (*enc_bulk[])(enc_state)={
-#ifdef QOI_SCALAR
-	qoi_encode_chunk3_scalar, qoi_encode_chunk4_scalar
-#elif defined QOI_SSE
-	qoi_encode_chunk3_sse, qoi_encode_chunk4_sse
+//size kernels for whole multiples of 16 pixels, indexed by channels-3
+static enc_state (*const size_bulk[2])(enc_state)={
+#ifdef QOI_SSE
+	qoi_size_chunk3_sse, qoi_size_chunk4_sse
+#else
+	qoi_size_chunk3_scalar, qoi_size_chunk4_scalar
+#endif
+};
+
+#ifdef QOI_SSE
+#define QOI_KERNEL_DEFAULT QOI_KERNEL_SSE
 #elif defined QOI_AVX2
-	qoi_encode_chunk3_avx2, qoi_encode_chunk4_avx2
+#define QOI_KERNEL_DEFAULT QOI_KERNEL_AVX2
 #elif defined QOI_AVX512
-	qoi_encode_chunk3_avx512, qoi_encode_chunk4_avx512
+#define QOI_KERNEL_DEFAULT QOI_KERNEL_AVX512
 #else
-#error "Must define instruction set at compile time. One of: QOI_SCALAR QOI_SSE"
+#define QOI_KERNEL_DEFAULT QOI_KERNEL_SCALAR
+#endif
+
+//kernels by QOI_KERNEL_*, NULL where not compiled in
+static enc_state (*const enc_kernels[QOI_KERNEL_COUNT][QOI_ENC_COUNT])(enc_state)={
+	[QOI_KERNEL_SCALAR]={qoi_encode_chunk3_scalar, qoi_encode_chunk4_scalar, qoi_encode_chunk4o_scalar,
+		qoi_encode_chunk4bgra_scalar, qoi_encode_chunk4bgrx_scalar},
+	[QOI_KERNEL_MLUT]={qoi_encode_chunk3_mlut, qoi_encode_chunk4_mlut, qoi_encode_chunk4o_mlut,
+		qoi_encode_chunk4bgra_mlut, qoi_encode_chunk4bgrx_mlut},
+#ifdef QOI_SSE
+	[QOI_KERNEL_SSE]={qoi_encode_chunk3_sse, qoi_encode_chunk4_sse, qoi_encode_chunk4o_sse,
+		qoi_encode_chunk4bgra_sse, qoi_encode_chunk4bgrx_sse},
+#endif
+#ifdef QOI_AVX2
+	[QOI_KERNEL_AVX2]={qoi_encode_chunk3_avx2, qoi_encode_chunk4_avx2, qoi_encode_chunk4_avx2,
+		qoi_encode_chunk4bgra_scalar, qoi_encode_chunk4bgrx_scalar},
+#endif
+#ifdef QOI_AVX512
+	[QOI_KERNEL_AVX512]={qoi_encode_chunk3_avx512, qoi_encode_chunk4_avx512, qoi_encode_chunk4_avx512,
+		qoi_encode_chunk4bgra_scalar, qoi_encode_chunk4bgrx_scalar},
 #endif
 };
 
+int qoi_kernel_available(int kernel){
+	if(kernel==QOI_KERNEL_AUTO)
+		return 1;
+	if(kernel<0 || kernel>=QOI_KERNEL_COUNT || !enc_kernels[kernel][0])
+		return 0;
+	return kernel!=QOI_KERNEL_MLUT || qoi_mlut;
+}
+
+//point s->bulk and s->finish at the kernels requested by opt. The scalar
+//kernel ignores opt->mlut so it stays a reference for the others
+static int qoi_kernel_select(const options *opt, enc_state *s){
+	int bulk=opt->kernel, finish=QOI_KERNEL_SCALAR;
+	if(!qoi_kernel_available(bulk))
+		return 0;
+	if((opt->mlut && bulk!=QOI_KERNEL_SCALAR) || bulk==QOI_KERNEL_MLUT){
+		if(!qoi_mlut)
+			return 0;
+		finish=QOI_KERNEL_MLUT;
+#ifdef QOI_SCALAR
+		if(bulk==QOI_KERNEL_AUTO)
+			bulk=QOI_KERNEL_MLUT;
+#endif
+	}
+	if(bulk==QOI_KERNEL_AUTO)
+		bulk=QOI_KERNEL_DEFAULT;
+	s->bulk=enc_kernels[bulk];
+	s->finish=enc_kernels[finish];
+	return 1;
+}
+
 //Optimised decode functions////////////////////////////////////////////////////
 typedef struct{
 	unsigned char *bytes, *pixels;
 	qoi_rgba_t px;
-	unsigned int b, b_limit, b_present, p, p_limit, px_pos, run, pixel_cnt, pixel_curr;
+	unsigned int b, b_limit, b_present, p, p_limit, px_pos, run, pixel_cnt, pixel_curr, raw, flags;
 } dec_state;
 
 #define QOI_DECODE_COMMON \
@@ -828,6 +1170,7 @@ typedef struct{
 		s.px.rgba.r += vg + ((b1 >> 4) & 3); \
 		s.px.rgba.g += vg + 2; \
 		s.px.rgba.b += vg + ((b1 >> 6) & 3); \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_LUMA232, 1); \
 	} \
 	else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA464) { \
 		int b2=s.bytes[s.b++]; \
@@ -835,6 +1178,7 @@ typedef struct{
 		s.px.rgba.r += vg + ((b2     ) & 0x0f); \
 		s.px.rgba.g += vg + 8; \
 		s.px.rgba.b += vg + ((b2 >>4) & 0x0f); \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_LUMA464, 2); \
 	} \
 	else if ((b1 & QOI_MASK_3) == QOI_OP_LUMA777) { \
 		int b2=s.bytes[s.b++]; \
@@ -843,6 +1187,7 @@ typedef struct{
 		s.px.rgba.r += vg + (((b3&1)<<6)|((b2>>2)&63)); \
 		s.px.rgba.g += vg + 64; \
 		s.px.rgba.b += vg + ((b3>>1)&127); \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_LUMA777, 3); \
 	} \
 	else if (b1 == QOI_OP_RGB) { \
 		signed char vg=s.bytes[s.b++]; \
@@ -851,9 +1196,17 @@ typedef struct{
 		s.px.rgba.r += vg + b3; \
 		s.px.rgba.g += vg; \
 		s.px.rgba.b += vg + b4; \
+		QOI_STAT_OP(qoi_stats_dec, QOI_STAT_RGB, 4); \
 	}
 
 static dec_state dec_in4out4(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(4, 4);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(4);
 	while( ((s.b+6)<s.b_present) && ((s.px_pos+4)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
@@ -861,11 +1214,29 @@ static dec_state dec_in4out4(dec_state s){
 			OP_RGBA_GOTO:
 			QOI_DECODE_COMMON
 			else if (b1 == QOI_OP_RGBA) {
+				if((s.b+7)>=s.b_present){//RGBA can chain, wait for input covering the next op too
+					s.b--;
+					break;
+				}
 				s.px.rgba.a = s.bytes[s.b++];
+				QOI_STAT_OP(qoi_stats_dec, QOI_STAT_RGBA, 2);
 				goto OP_RGBA_GOTO;
 			}
-			else// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				QOI_DECODE_RUN_FILL(4);
+				continue;
+			}
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(4, 4);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
 				s.run = ((b1>>3) & 0x1f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
 		s.pixels[s.px_pos + 1] = s.px.rgba.g;
@@ -878,6 +1249,13 @@ static dec_state dec_in4out4(dec_state s){
 }
 
 static dec_state dec_in4out3(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(4, 3);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(3);
 	while( ((s.b+6)<s.b_present) && ((s.px_pos+3)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
@@ -885,11 +1263,29 @@ static dec_state dec_in4out3(dec_state s){
 			OP_RGBA_GOTO:
 			QOI_DECODE_COMMON
 			else if (b1 == QOI_OP_RGBA) {
+				if((s.b+7)>=s.b_present){//RGBA can chain, wait for input covering the next op too
+					s.b--;
+					break;
+				}
 				s.px.rgba.a = s.bytes[s.b++];
+				QOI_STAT_OP(qoi_stats_dec, QOI_STAT_RGBA, 2);
 				goto OP_RGBA_GOTO;
 			}
-			else// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				QOI_DECODE_RUN_FILL(3);
+				continue;
+			}
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(4, 3);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
 				s.run = ((b1>>3) & 0x1f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
 		s.pixels[s.px_pos + 1] = s.px.rgba.g;
@@ -901,13 +1297,33 @@ static dec_state dec_in4out3(dec_state s){
 }
 
 static dec_state dec_in3out4(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(3, 4);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(4);
 	while( ((s.b+6)<s.b_present) && ((s.px_pos+4)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
 		else{
 			QOI_DECODE_COMMON
-			else// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				QOI_DECODE_RUN_FILL(4);
+				continue;
+			}
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(3, 4);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
 				s.run = ((b1>>3) & 0x1f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
 		s.pixels[s.px_pos + 1] = s.px.rgba.g;
@@ -920,13 +1336,33 @@ static dec_state dec_in3out4(dec_state s){
 }
 
 static dec_state dec_in3out3(dec_state s){
+	if(s.raw){//a raw block cut short by the input or p_limit
+		QOI_DECODE_RAW(3, 3);
+		if(s.raw)
+			return s;
+	}
+	else if(s.run>QOI_RUN_FULL_VAL)//a long run cut short by p_limit
+		QOI_DECODE_RUN_FILL(3);
 	while( ((s.b+6)<s.b_present) && ((s.px_pos+3)<=s.p_limit) && (s.pixel_cnt!=s.pixel_curr) ){
 		if (s.run)
 			s.run--;
 		else{
 			QOI_DECODE_COMMON
-			else// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
+			else if (b1 == QOI_OP_RUN_FULL && (s.flags&QOI_FLAG_LONG_RUN)) {
+				QOI_DECODE_LONG_RUN;
+				QOI_DECODE_RUN_FILL(3);
+				continue;
+			}
+			else if (b1 == QOI_OP_RAW && (s.flags&QOI_FLAG_RAW_BLOCKS)) {
+				QOI_DECODE_RAW_BLOCK(3, 3);
+				if(s.raw)
+					return s;
+				continue;
+			}
+			else{// if ((b1 & QOI_MASK_3) == QOI_OP_RUN)
 				s.run = ((b1>>3) & 0x1f);
+				QOI_STAT_RUN_OP(qoi_stats_dec, s.run+1);
+			}
 		}
 		s.pixels[s.px_pos + 0] = s.px.rgba.r;
 		s.pixels[s.px_pos + 1] = s.px.rgba.g;